@@ -13,6 +13,11 @@
  * GNU General Public License for more details.
  */
 
+/* O_DIRECT */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "fat.h"
 #include <wchar.h>
 #include <stdio.h>
@@ -20,9 +25,101 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/errno.h>
 
-#define _fseek64 fseeko
+#if defined(__linux__) && !defined(FAT_NO_URING)
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#define FAT_HAVE_URING
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define FAT_HAVE_SENDFILE
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_HAVE_X86
+#endif
+
+/* default size of the sector cache */
+#ifndef FAT_CACHE_DEFAULT_SIZE
+#define FAT_CACHE_DEFAULT_SIZE (128 * 1024)
+#endif
+
+/* sector cache stripes, each keeps at least FAT_CACHE_SHARD_MIN sectors */
+#ifndef FAT_CACHE_SHARDS
+#define FAT_CACHE_SHARDS       16
+#endif
+#define FAT_CACHE_SHARD_MIN    16
+#define FAT_CACHE_LINE         64
+
+/* cache hit counters, a thread always counts in the same slot */
+#define FAT_CACHE_SLOTS        64
+
+/* default limit of a read spanning contiguous clusters */
+#ifndef FAT_MAX_IO_DEFAULT
+#define FAT_MAX_IO_DEFAULT     (1024 * 1024)
+#endif
+
+/* io_uring queue depth, largest single sqe */
+#define FAT_URING_ENTRIES      64
+#define FAT_URING_MAX_LEN      (1024 * 1024 * 1024)
+
+/* direct I/O: alignment of offsets, lengths and memory, bounce buffers */
+#ifndef FAT_DIRECT_ALIGN
+#define FAT_DIRECT_ALIGN       4096
+#endif
+#define FAT_DIRECT_BUFSZ       (1024 * 1024)
+#define FAT_DIRECT_POOL        4
+
+/* volumes one thread can hold at once, through nested callbacks */
+#define FAT_LOCK_NEST          4
+
+/* fat_sendfile: bounce buffer when the kernel cannot move the data */
+#define FAT_SENDFILE_BUFSZ     (64 * 1024)
+
+/* fat_sendfile: kernel primitives, tried in this order */
+#define FAT_XFER_COPY_RANGE    0
+#define FAT_XFER_SENDFILE      1
+#define FAT_XFER_SPLICE        2
+#define FAT_XFER_BUFFERED      3
+
+/* segments gathered by a read before they are submitted */
+#define FAT_READ_BATCH         16
+
+/* sequential readahead window, it doubles from min up to max */
+#define FAT_READAHEAD_MIN      (16 * 1024)
+#ifndef FAT_READAHEAD_MAX
+#define FAT_READAHEAD_MAX      (256 * 1024)
+#endif
+
+/* in memory fat table, decoded entries per demand loaded page */
+#define FAT_TABLE_PAGE_ENTRIES 1024
+#define FAT_TABLE_PAGE_RAWSIZE (FAT_TABLE_PAGE_ENTRIES * 4)
+#define FAT_HUGEPAGE_SIZE      (2 * 1024 * 1024)
+
+/* above this size, a fat32 table is demand loaded */
+#ifndef FAT_TABLE_MAX_SIZE
+#define FAT_TABLE_MAX_SIZE     (64 * 1024 * 1024)
+#endif
+
+/* free cluster scan, a multiple of 3 keeps fat12 entry pairs whole; the
+   fat is scanned a buffer at a time, when an allocation first needs it */
+#define FAT_SCAN_BUFSZ      (48 * 1024)
+
+/* fat mirrors are copied from the active fat at sync, this much at once */
+#define FAT_MIRROR_BUFSZ    (64 * 1024)
+
+/* extent allocation: runs examined for a best fit, fat write buffer */
+#define FAT_EXTENT_MAX_SCAN 4096
+#define FAT_EXTENT_BUFSZ    4096
 
 /* invalid cluster value */
 #define INVALID_CLUSTER ((fatclus_t)-1)
@@ -50,6 +147,9 @@
 #define FAT_ATTR_LONG_NAME \
 (FAT_ATTR_READ_ONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM | FAT_ATTR_VOLUME_ID)
 
+/* clusters a block remembers behind it, enough for the longest lfn */
+#define FAT_BLOCK_HISTORY 4
+
 /* logical block on data area (including fat12/16 root directory) */
 typedef struct _fatblock {
 	fatoff_t curoff;
@@ -57,44 +157,214 @@ typedef struct _fatblock {
 	fatclus_t cluster;
 	fatclus_t clsinit; /* first cluster on chain */
 	fatoff_t index;    /* zero based */
+
+	/* clusters left behind, slot index % FAT_BLOCK_HISTORY */
+	fatclus_t history[FAT_BLOCK_HISTORY];
+	fatoff_t histindex[FAT_BLOCK_HISTORY];
 } fatblock_t;
 
+/* sector cache entry */
+struct fatcache_entry {
+	fatoff_t sector;    /* sector number on volume, -1 if unused */
+	int32_t hnext;      /* hash chain */
+	uint8_t ref;        /* clock reference bit */
+	uint8_t dirty;
+	uint8_t *data;
+};
+
+/* dirty sector, sorted before the write back */
+struct fatcache_flushent {
+	fatoff_t sector;
+	struct fatcache_entry *pentry;
+};
+
+/* stripe of the sector cache, a sector always hashes to the same shard;
+   hits run without the lock and retry when seq moved under them */
+struct fatcache_shard {
+	pthread_mutex_t lock;
+	uint32_t seq;       /* odd while entries change */
+	uint32_t wdepth;    /* nested changes, under lock */
+	struct fatcache_entry *entries;
+	int32_t *buckets;
+	uint32_t nentries;
+	uint32_t nbuckets;
+	uint32_t hand;      /* clock hand */
+} __attribute__((aligned(FAT_CACHE_LINE)));
+
+/* hit counters of the threads sharing a slot, a line of their own so
+   counting never touches the seq of a shard */
+struct fatcache_count {
+	uint64_t hits;
+	uint64_t misses;
+} __attribute__((aligned(FAT_CACHE_LINE)));
+
+/* sector cache, sharded, clock evicted and write back */
+struct fatcache {
+	struct fatcache_shard *shards;
+	struct fatcache_count *counts; /* FAT_CACHE_SLOTS */
+	struct fatcache_entry *entries;
+	int32_t *buckets;
+	struct fatcache_flushent *flushlist;
+	uint8_t *mem;
+	uint32_t nshards;   /* power of two */
+	uint32_t nentries;
+	uint32_t ndirty;
+	uint32_t dirty_max;
+	pthread_mutex_t lock; /* write back of every shard */
+};
+
+/* free clusters, one bit per cluster, set when free; bits of a chunk
+   are valid once the chunk is scanned */
+struct fatbitmap {
+	uint64_t *words;
+	uint64_t *summary; /* one bit per word, set when it has a free cluster */
+	uint8_t *scanned;  /* one flag per chunk */
+	const struct fatscan_ops *pops;
+	uint32_t nwords;
+	uint32_t nsummary;
+	uint32_t perchunk; /* entries, a multiple of 64 */
+	uint32_t nchunks;
+	uint32_t nscanned;
+	uint8_t changed;   /* the fat was written since the bitmap exists */
+};
+
+/* sectors of the active fat the other copies miss, one bit each; the
+   fat is only written to under alloc_lock */
+struct fatmirror {
+	uint64_t *dirty;
+	uint32_t nsectors;
+	uint32_t ndirty;
+};
+
+/* in memory copy of the active fat */
+struct fattable {
+	uint32_t *map;     /* entries as returned by the fat reader */
+	size_t mapsize;
+	uint32_t nentries;
+	uint8_t *loaded;   /* one flag per page */
+	uint8_t *rawbuf;   /* page as stored on disk */
+	pthread_mutex_t lock; /* page loads and updates, lookups go lock free */
+
+	fatclus_t (*devreadfat)(struct fatfs *, fatclus_t);
+	int       (*devwritefat)(struct fatfs *, fatclus_t, fatclus_t);
+};
+
+/* descriptor opened with O_DIRECT for file data, -1 if unused */
+struct fatdirect {
+	int fd;
+	fatoff_t limit;    /* device size, an aligned write never goes past it */
+	uint8_t *pool[FAT_DIRECT_POOL];
+	uint32_t npool;
+	pthread_mutex_t lock;
+};
+
 /* fatfs_t */
 struct fatfs {
-	FILE *stream;
+	struct fatdev dev;
+	int fd;            /* image descriptor of fd devices, -1 otherwise */
 	fatoff_t offset;
 	fatoff_t volsize;
+	uint32_t flags;
+	size_t max_io;
+	size_t ra_max;
+	uint32_t scan;     /* FAT_SCAN_* kernel level */
 
 	int32_t type;
-	int32_t errnum;
 	wchar_t *label;
 
 	fatoff_t fat_first_off;
 	fatoff_t fat_active_off;
 	fatoff_t fat_size_bytes;
 	uint8_t  fat_num;
+	uint8_t  fat_nomirror; /* fat32: only the active fat is updated */
 
 	fatblock_t root_block;
 	fatoff_t data_start_off;
 
 	fatclus_t max_cluster_num;
 	uint32_t bytes_per_cluster;
+	uint32_t bytes_per_sector;
+
+	struct fatcache cache;
+	struct fattable table;
+	struct fatmirror mirror;
+	struct fatbitmap bitmap;
+	struct fatdirect direct;
+
+	/* asynchronous transfers, pring is set on io_uring mounts */
+	struct fatring *pring;
+	struct fataio *aio_done, **aio_donetail;
+	uint32_t aio_count;
+	pthread_mutex_t aio_lock;
+
+	/* shared by file and directory operations, exclusive for changes made
+	   by path; alloc_lock serializes fat updates and the free counters */
+	pthread_rwlock_t lock;
+	pthread_mutex_t alloc_lock;
 
 	fatclus_t first_free_cluster;
 	fatclus_t num_of_free_clusters;
 
+	/* bumped on every directory entry update */
+	uint32_t dirgen;
+
+	/* bumped on every file data write or truncate */
+	uint32_t datagen;
+
+	/* fat32 fsinfo sector, 0 if absent; hints as stored on the device */
+	fatoff_t fsinfo_off;
+	uint32_t fsinfo_free;
+	uint32_t fsinfo_next;
+
 	fatclus_t (*readfat)(struct fatfs *, fatclus_t);
 	int       (*writefat)(struct fatfs *, fatclus_t, fatclus_t);
 	fatclus_t (*readfatbuf)(void *data, size_t size, fatclus_t cluster);
 };
 
+/* run of contiguous clusters of a file */
+struct fatextent {
+	fatclus_t index;   /* logical cluster, zero based */
+	fatclus_t cluster;
+	fatclus_t length;
+};
+
+/* cluster chain of a file as runs, built on first seek */
+struct fatextmap {
+	struct fatextent *extents;
+	size_t count;
+	size_t capacity;
+	uint8_t built;
+};
+
+/* file data read ahead of a sequential reader */
+struct fatra {
+	uint8_t *buf;
+	size_t size;     /* allocated */
+	fatoff_t start;  /* file offset of buf[0] */
+	size_t len;      /* valid bytes, 0 if empty */
+	size_t window;   /* next fill, 0 while the access is random */
+	fatoff_t next;   /* where a sequential read would start */
+	uint32_t datagen; /* of the volume when filled */
+};
+
 /* fatdir_t */
+/* directory entries read a cluster at a time, or a cluster sized chunk
+   of the fat12/16 root */
+struct fatdirbuf {
+	uint8_t *data;
+	size_t size;     /* allocated */
+	fatoff_t start;  /* device offset of data[0] */
+	size_t len;      /* valid bytes, 0 if empty */
+	uint32_t dirgen; /* of the volume when filled */
+};
+
 struct fatdir {
 	fatfs_t *pfatfs;
 	fatoff_t privoff;
 	fatblock_t block;
 	long position;
 	struct fatdirent data;
+	struct fatdirbuf buf;
 };
 
 /* fatfile_t */
@@ -104,9 +374,121 @@ struct fatfile {
 	fatblock_t block;
 	fatoff_t filesize;
 	fatoff_t oversize;
+	struct fatextmap map;
+	struct fatra ra;
 	uint8_t mode;
+	pthread_mutex_t lock;
+};
+
+/* error of the last operation, per thread */
+static _Thread_local int32_t fat_errnum;
+
+/* volumes locked by this thread, nested calls do not take them again */
+struct fatlockhold {
+	fatfs_t *pfatfs;
+	uint32_t depth;
+	uint8_t exclusive;
 };
 
+static _Thread_local struct fatlockhold fat_lockholds[FAT_LOCK_NEST];
+
+/* cache counter slot of this thread, 0 until its first cache access */
+static _Thread_local uint32_t fat_cacheslot;
+static uint32_t fat_cacheslots;
+
+/* every mutex is recursive, public calls nest */
+static void
+fat_mutex_init(pthread_mutex_t *pmutex)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(pmutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* the hold of this thread on pfatfs, NULL if it has none */
+static struct fatlockhold *
+fatfs_lockhold(fatfs_t *pfatfs)
+{
+	for (int i = 0; i < FAT_LOCK_NEST; i++) {
+		if (fat_lockholds[i].pfatfs == pfatfs)
+			return &fat_lockholds[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * a shared hold cannot become exclusive, the writer would wait for itself;
+ * only an exclusive request fails. Past FAT_LOCK_NEST volumes a shared
+ * hold is not tracked and nesting on it takes the rwlock again.
+ */
+static int
+fatfs_lock(fatfs_t *pfatfs, int exclusive)
+{
+	struct fatlockhold *phold = fatfs_lockhold(pfatfs);
+
+	if (phold) {
+		if (exclusive && !phold->exclusive) {
+			fat_errnum = FAT_ERR_DEADLK;
+			return -1;
+		}
+
+		phold->depth++;
+		return 0;
+	}
+
+	phold = fatfs_lockhold(NULL);
+	if (exclusive && !phold) {
+		fat_errnum = FAT_ERR_DEADLK;
+		return -1;
+	}
+
+	if (exclusive)
+		pthread_rwlock_wrlock(&pfatfs->lock);
+	else
+		pthread_rwlock_rdlock(&pfatfs->lock);
+
+	if (phold) {
+		phold->pfatfs = pfatfs;
+		phold->depth = 1;
+		phold->exclusive = (uint8_t) (exclusive != 0);
+	}
+
+	return 0;
+}
+
+static void
+fatfs_unlock(fatfs_t *pfatfs)
+{
+	struct fatlockhold *phold = fatfs_lockhold(pfatfs);
+
+	if (phold) {
+		if (--phold->depth)
+			return;
+		phold->pfatfs = NULL;
+	}
+
+	pthread_rwlock_unlock(&pfatfs->lock);
+}
+
+/* file operations: the volume is shared, the file is not */
+static void
+fatfile_lock(fatfile_t *pfatfile)
+{
+	fatfs_lock(pfatfile->pfatfs, 0);
+	pthread_mutex_lock(&pfatfile->lock);
+}
+
+static void
+fatfile_unlock(fatfile_t *pfatfile)
+{
+	pthread_mutex_unlock(&pfatfile->lock);
+	fatfs_unlock(pfatfile->pfatfs);
+}
+
 #pragma pack(push, 1)
 /* BIOS Parameter Block */
 struct fat_bpb {
@@ -192,1654 +574,5852 @@ struct privdirent {
 	} type;
 };
 
+/* FAT32 FSInfo sector */
+struct fat_fsinfo {
+	uint32_t lead_sig;
+	uint8_t reserved[480];
+	uint32_t struc_sig;
+	uint32_t free_count; /* 0xffffffff if unknown */
+	uint32_t nxt_free;   /* 0xffffffff if unknown */
+	uint8_t reserved1[12];
+	uint32_t trail_sig;
+};
 #pragma pack(pop)
 
-/* read nbytes from offset */
-static size_t
-fatfs_read_from_offset(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
+#define FSINFO_LEAD_SIG  0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_TRAIL_SIG 0xaa550000
+#define FSINFO_UNKNOWN   0xffffffff
+
+/* default device: positional I/O on a raw file descriptor */
+struct fddev {
+	int fd;
+};
+
+static int
+fddev_read_at(void *priv, void *buf, size_t nbytes, fatoff_t off)
 {
-	size_t nread = 0;
-	pfatfs->errnum = FAT_ERR_IO;
+	struct fddev *pfddev = (struct fddev *) priv;
+	ssize_t nread;
 
-	/* check negative */
-	if (offset < 0)
-		return 0;
-	/* check wraparound */
-	if (((fatoff_t)(offset + nbytes)) < 0)
-		return 0;
-	/* check volume bounds */
-	if ((fatoff_t)(offset + nbytes) > pfatfs->volsize)
-		return 0;
+	while (nbytes) {
+		nread = pread(pfddev->fd, buf, nbytes, (off_t) off);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
 
-	if (_fseek64(pfatfs->stream, pfatfs->offset + offset, SEEK_SET))
-		return 0;
+		/* unexpected end of device */
+		if (nread == 0)
+			return -1;
 
-	nread = fread(buf, 1, nbytes, pfatfs->stream);
-	if (!ferror(pfatfs->stream))
-		pfatfs->errnum = FAT_ERR_SUCCESS;
+		buf = (char *) buf + nread;
+		nbytes -= (size_t) nread;
+		off += nread;
+	}
 
-	return nread;
+	return 0;
 }
 
-/* write nbytes to offset */
-static size_t
-fatfs_write_to_offset(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
+static int
+fddev_write_at(void *priv, const void *buf, size_t nbytes, fatoff_t off)
 {
-	size_t nread = 0;
-	pfatfs->errnum = FAT_ERR_IO;
+	struct fddev *pfddev = (struct fddev *) priv;
+	ssize_t nwrite;
 
-	/* check negative */
-	if (offset < 0)
-		return 0;
-	/* check wraparound */
-	if (((fatoff_t)(offset + nbytes)) < 0)
-		return 0;
-	/* check volume bounds */
-	if ((fatoff_t)(offset + nbytes) > pfatfs->volsize)
-		return 0;
+	while (nbytes) {
+		nwrite = pwrite(pfddev->fd, buf, nbytes, (off_t) off);
+		if (nwrite < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
 
-	if (_fseek64(pfatfs->stream, pfatfs->offset + offset, SEEK_SET))
-		return 0;
+		/* device is full */
+		if (nwrite == 0)
+			return -1;
 
-	nread = fwrite(buf, 1, nbytes, pfatfs->stream);
-	if (!ferror(pfatfs->stream))
-		pfatfs->errnum = FAT_ERR_SUCCESS;
+		buf = (const char *) buf + nwrite;
+		nbytes -= (size_t) nwrite;
+		off += nwrite;
+	}
 
-	return nread;
+	return 0;
 }
 
-static inline int
-fatfs_isvalid_cluster(fatfs_t *pfatfs, fatclus_t cluster)
+static int
+fddev_flush(void *priv)
 {
-	if ((cluster < 2) || (cluster > pfatfs->max_cluster_num))
-		return 0;
+	return fsync(((struct fddev *) priv)->fd);
+}
 
-	return 1;
+static fatoff_t
+fddev_size(void *priv)
+{
+	return (fatoff_t) lseek(((struct fddev *) priv)->fd, 0, SEEK_END);
 }
 
-static fatclus_t
-fatfs_read_fat12(fatfs_t *pfatfs, fatclus_t cluster)
+static void
+fddev_close(void *priv)
 {
-	int16_t value = 0;
+	struct fddev *pfddev = (struct fddev *) priv;
 
-	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
-		pfatfs->fat_active_off + cluster + (cluster / 2)) < sizeof(value))
-		return INVALID_CLUSTER;
+	close(pfddev->fd);
+	free(pfddev);
+}
 
-	return (cluster & 1) ? (value >> 4) : (value & 0xfff);
+static void
+fddev_init(struct fatdev *pdev, struct fddev *pfddev, int fd)
+{
+	pfddev->fd = fd;
+	pdev->priv = pfddev;
+	pdev->read_at = fddev_read_at;
+	pdev->write_at = fddev_write_at;
+	pdev->flush = fddev_flush;
+	pdev->size = fddev_size;
+	pdev->close = fddev_close;
 }
 
+/* read-only device: the image is mapped from a page aligned offset */
+struct mmdev {
+	uint8_t *base;
+	fatoff_t start;
+	fatoff_t length;
+};
+
 static int
-fatfs_write_fat12(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+mmdev_read_at(void *priv, void *buf, size_t nbytes, fatoff_t off)
 {
-	int16_t entry = 0;
-	value &= 0xfff;
+	struct mmdev *pmmdev = (struct mmdev *) priv;
 
-	/* read entry */
-	if (fatfs_read_from_offset(pfatfs, &entry, sizeof(entry),
-		pfatfs->fat_active_off + cluster + (cluster / 2)) < sizeof(entry))
+	off -= pmmdev->start;
+	if ((off < 0) || ((fatoff_t) nbytes > pmmdev->length - off))
 		return -1;
 
-	/* update value */
-	if (cluster & 1)
-		entry = (entry & 0xf) | (value << 4);
-	else
-		entry = (entry & 0xf000) | value;
-
-	/* update all fats  */
-	for (uint8_t i = 0; i < pfatfs->fat_num; i++) {
-		fatoff_t fatoff = pfatfs->fat_first_off + (i * pfatfs->fat_size_bytes);
-
-		if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
-			fatoff + cluster + (cluster / 2)) < sizeof(entry))
-			return -1;
-	}
-
+	memcpy(buf, pmmdev->base + off, nbytes);
 	return 0;
 }
 
-static fatclus_t
-fatfs_read_fat16(fatfs_t *pfatfs, fatclus_t cluster)
+static fatoff_t
+mmdev_size(void *priv)
 {
-	int16_t value = 0;
+	struct mmdev *pmmdev = (struct mmdev *) priv;
+	return pmmdev->start + pmmdev->length;
+}
 
-	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
-		pfatfs->fat_active_off + (cluster * 2)) < sizeof(value))
-		return INVALID_CLUSTER;
+static void
+mmdev_close(void *priv)
+{
+	struct mmdev *pmmdev = (struct mmdev *) priv;
 
-	return value;
+	munmap(pmmdev->base, (size_t) pmmdev->length);
+	free(pmmdev);
 }
 
 static int
-fatfs_write_fat16(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+mmdev_init(struct fatdev *pdev, int fd, fatoff_t offset)
 {
-	int16_t entry = (int16_t) value;
+	struct mmdev *pmmdev;
+	fatoff_t devsize;
+	void *base;
 
-	/* update all fats  */
-	for (uint8_t i = 0; i < pfatfs->fat_num; i++) {
-		fatoff_t fatoff = pfatfs->fat_first_off + (i * pfatfs->fat_size_bytes);
+	devsize = (fatoff_t) lseek(fd, 0, SEEK_END);
+	if (devsize < 0)
+		return FAT_ERR_IO;
+	if (devsize <= offset)
+		return FAT_ERR_NOTFATFS;
 
-		if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
-			fatoff + (cluster * 2)) < sizeof(entry))
-			return -1;
+	pmmdev = (struct mmdev *) calloc(1, sizeof(*pmmdev));
+	if (!pmmdev)
+		return FAT_ERR_ENOMEM;
+
+	/* mmap offset must be page aligned */
+	pmmdev->start = offset - (offset % sysconf(_SC_PAGESIZE));
+	pmmdev->length = devsize - pmmdev->start;
+
+	base = mmap(NULL, (size_t) pmmdev->length, PROT_READ, MAP_SHARED, fd,
+	            (off_t) pmmdev->start);
+	if (base == MAP_FAILED) {
+		free(pmmdev);
+		return (errno == ENOMEM) ? FAT_ERR_ENOMEM : FAT_ERR_IO;
 	}
 
-	return 0;
+	pmmdev->base = (uint8_t *) base;
+	pdev->priv = pmmdev;
+	pdev->read_at = mmdev_read_at;
+	pdev->write_at = NULL;
+	pdev->flush = NULL;
+	pdev->size = mmdev_size;
+	pdev->close = mmdev_close;
+	return FAT_ERR_SUCCESS;
 }
 
-static fatclus_t
-fatfs_read_fat32(fatfs_t *pfatfs, fatclus_t cluster)
-{
-	int32_t value = 0;
+/* transfer split in device segments, they complete in any order */
+struct fatseg {
+	uint8_t *buf;
+	size_t nbytes;
+	fatoff_t off;
+};
 
-	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
-		pfatfs->fat_active_off + (cluster * 4)) < sizeof(value))
-		return INVALID_CLUSTER;
+struct fataio {
+	fatfile_t *pfatfile;
+	uint8_t *buf;
+	size_t nbytes;
+	fat_aio_done done; /* NULL for a synchronous transfer */
+	void *arg;
+	struct fatseg *segs;
+	size_t nsegs;
+	uint32_t pending;  /* segments in flight */
+	size_t expect;     /* bytes queued */
+	size_t got;        /* bytes transferred */
+	int errnum;
+	uint8_t write;
+	struct fataio *next;
+};
 
-	return value & 0x0fffffff;
+#ifdef FAT_HAVE_URING
+/* io_uring instance, the rings are shared with the kernel */
+struct fatring {
+	int fd;
+	int evfd;          /* signalled on completions, -1 if not registered */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqmapsize, cqmapsize, sqesize;
+	unsigned sq_entries, cq_entries;
+	unsigned queued;   /* sqes not submitted yet */
+	unsigned inflight; /* submitted, not reaped */
+	struct fataio *done, **donetail;
+	pthread_mutex_t lock;
+};
+
+static void
+fatring_free(struct fatring *pring)
+{
+	if (pring->sqes)
+		munmap(pring->sqes, pring->sqesize);
+	if (pring->cqmap && (pring->cqmap != pring->sqmap))
+		munmap(pring->cqmap, pring->cqmapsize);
+	if (pring->sqmap)
+		munmap(pring->sqmap, pring->sqmapsize);
+	if (pring->evfd >= 0)
+		close(pring->evfd);
+	if (pring->fd >= 0)
+		close(pring->fd);
+
+	pthread_mutex_destroy(&pring->lock);
+	memset(pring, 0, sizeof(*pring));
+	pring->fd = pring->evfd = -1;
 }
 
 static int
-fatfs_write_fat32(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+fatring_init(struct fatring *pring, unsigned entries)
 {
-	int32_t entry = (int32_t) value;
+	struct io_uring_params params;
+	uint8_t *sq, *cq;
+	void *ptr;
+
+	memset(pring, 0, sizeof(*pring));
+	memset(&params, 0, sizeof(params));
+	pring->evfd = -1;
+	pring->donetail = &pring->done;
+	fat_mutex_init(&pring->lock);
+
+	pring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (pring->fd < 0)
+		return -1;
+
+	pring->sq_entries = params.sq_entries;
+	pring->cq_entries = params.cq_entries;
+	pring->sqmapsize = params.sq_off.array + (params.sq_entries *
+		sizeof(unsigned));
+	pring->cqmapsize = params.cq_off.cqes + (params.cq_entries *
+		sizeof(struct io_uring_cqe));
+	pring->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* both rings may live in a single mapping */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (pring->cqmapsize > pring->sqmapsize)
+			pring->sqmapsize = pring->cqmapsize;
+		pring->cqmapsize = pring->sqmapsize;
+	}
 
-	/* update all fats  */
-	for (uint8_t i = 0; i < pfatfs->fat_num; i++) {
-		fatoff_t fatoff = pfatfs->fat_first_off + (i * pfatfs->fat_size_bytes);
+	ptr = mmap(NULL, pring->sqmapsize, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_POPULATE, pring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto _error;
+	pring->sqmap = ptr;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		pring->cqmap = pring->sqmap;
+	else {
+		ptr = mmap(NULL, pring->cqmapsize, PROT_READ | PROT_WRITE,
+		           MAP_SHARED | MAP_POPULATE, pring->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto _error;
+		pring->cqmap = ptr;
+	}
 
-		if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
-			fatoff + (cluster * 4)) < sizeof(entry))
-			return -1;
+	ptr = mmap(NULL, pring->sqesize, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_POPULATE, pring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto _error;
+	pring->sqes = (struct io_uring_sqe *) ptr;
+
+	sq = (uint8_t *) pring->sqmap;
+	cq = (uint8_t *) pring->cqmap;
+	pring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	pring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	pring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	pring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	pring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	pring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	pring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	pring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	/* optional: an event loop can poll this descriptor */
+	pring->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((pring->evfd >= 0) && (syscall(__NR_io_uring_register, pring->fd,
+	    IORING_REGISTER_EVENTFD, &pring->evfd, 1) < 0)) {
+		close(pring->evfd);
+		pring->evfd = -1;
 	}
 
 	return 0;
+
+_error:
+	fatring_free(pring);
+	return -1;
 }
 
-static fatclus_t
-fatfs_safe_readfat(fatfs_t *pfatfs, fatclus_t cluster)
+/* submit the queued sqes and wait for 'wait' completions */
+static int
+fatring_enter(struct fatring *pring, unsigned wait)
 {
-	fatclus_t nextcluster;
-
-	/* validate cluster */
-	if (!fatfs_isvalid_cluster(pfatfs, cluster))
-		return INVALID_CLUSTER;
+	int ret;
 
-	nextcluster = pfatfs->readfat(pfatfs, cluster);
+	do {
+		ret = (int) syscall(__NR_io_uring_enter, pring->fd, pring->queued, wait,
+		                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while ((ret < 0) && (errno == EINTR));
 
-	/* validate cluster */
-	if (!fatfs_isvalid_cluster(pfatfs, nextcluster))
-		return INVALID_CLUSTER;
+	if (ret < 0)
+		return -1;
 
-	return nextcluster;
+	pring->queued -= (unsigned) ret;
+	pring->inflight += (unsigned) ret;
+	return 0;
 }
 
-static int
-fatfs_safe_writefat(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+/* account completions, finished asynchronous transfers go to the done list */
+static void
+fatring_reap(struct fatring *pring)
 {
-	/* validate cluster */
-	if (!fatfs_isvalid_cluster(pfatfs, cluster))
-		return -1;
+	unsigned head = *pring->cq_head;
+	unsigned tail = __atomic_load_n(pring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *pcqe = &pring->cqes[head & *pring->cq_mask];
+		struct fataio *paio = (struct fataio *) (uintptr_t) pcqe->user_data;
+
+		if (pcqe->res < 0)
+			paio->errnum = FAT_ERR_IO;
+		else
+			paio->got += (size_t) pcqe->res;
+
+		pring->inflight--;
+		if ((--paio->pending == 0) && paio->done) {
+			paio->next = NULL;
+			*pring->donetail = paio;
+			pring->donetail = &paio->next;
+		}
+	}
 
-	return pfatfs->writefat(pfatfs, cluster, value);
+	__atomic_store_n(pring->cq_head, head, __ATOMIC_RELEASE);
 }
 
-static fatclus_t
-readfatbuf_12(void *data, size_t size, fatclus_t cluster)
+/* queue one transfer, making room in the rings if needed */
+static int
+fatring_queue(struct fatring *pring, struct fataio *paio, int fd,
+              uint8_t *buf, size_t nbytes, fatoff_t off)
 {
-	int16_t value;
-	int8_t *d = (int8_t *) data;
-
-	if (((ssize_t) size) < 0)
-		return INVALID_CLUSTER;
+	while (nbytes) {
+		size_t len = (nbytes > FAT_URING_MAX_LEN) ? FAT_URING_MAX_LEN : nbytes;
+		struct io_uring_sqe *psqe;
+		unsigned tail, idx;
+
+		/* the completion ring must never overflow */
+		while ((pring->queued == pring->sq_entries) ||
+		       (pring->queued + pring->inflight >= pring->cq_entries)) {
+			if (fatring_enter(pring, (pring->queued + pring->inflight >=
+			                          pring->cq_entries) ? 1 : 0))
+				return -1;
+			fatring_reap(pring);
+		}
 
-	if (cluster + (cluster / 2) > (fatoff_t) size)
-		return INVALID_CLUSTER;
+		tail = *pring->sq_tail;
+		idx = tail & *pring->sq_mask;
+		psqe = &pring->sqes[idx];
+
+		memset(psqe, 0, sizeof(*psqe));
+		psqe->opcode = paio->write ? IORING_OP_WRITE : IORING_OP_READ;
+		psqe->fd = fd;
+		psqe->addr = (uint64_t) (uintptr_t) buf;
+		psqe->len = (uint32_t) len;
+		psqe->off = (uint64_t) off;
+		psqe->user_data = (uint64_t) (uintptr_t) paio;
+
+		pring->sq_array[idx] = idx;
+		__atomic_store_n(pring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		pring->queued++;
+
+		paio->pending++;
+		paio->expect += len;
+		buf += len;
+		nbytes -= len;
+		off += (fatoff_t) len;
+	}
 
-	value = *((int16_t *)(d + cluster + (cluster / 2)));
-	value = (cluster & 1) ? (value >> 4) : (value & 0xfff);
-	return value;
+	return 0;
 }
 
-static fatclus_t
-readfatbuf_16(void *data, size_t size, fatclus_t cluster)
+/* wait until every segment of paio completed */
+static int
+fatring_wait(struct fatring *pring, struct fataio *paio)
 {
-	int16_t *d = (int16_t *) data;
+	while (paio->pending) {
+		if (fatring_enter(pring, 1))
+			return -1;
+		fatring_reap(pring);
+	}
 
-	if (((ssize_t) size) < 0)
-		return INVALID_CLUSTER;
-
-	if ((cluster + 1) * 2 > (fatoff_t) size)
-		return INVALID_CLUSTER;
-
-	return d[cluster];
+	return 0;
 }
 
-static fatclus_t
-readfatbuf_32(void *data, size_t size, fatclus_t cluster)
+/* io_uring device: the same descriptor, transfers go through the ring */
+struct urdev {
+	int fd;
+	struct fatring ring;
+};
+
+static int
+urdev_transfer(struct urdev *purdev, int write, const struct fatseg *segs,
+               size_t count)
 {
-	int32_t *d = (int32_t *) data;
+	struct fataio aio;
+	int error;
 
-	if (((ssize_t) size) < 0)
-		return INVALID_CLUSTER;
+	memset(&aio, 0, sizeof(aio));
+	aio.write = (uint8_t) write;
 
-	if ((cluster + 1) * 4 > (fatoff_t) size)
-		return INVALID_CLUSTER;
+	pthread_mutex_lock(&purdev->ring.lock);
+	for (size_t i = 0; i < count; i++) {
+		if (fatring_queue(&purdev->ring, &aio, purdev->fd, segs[i].buf,
+		                  segs[i].nbytes, segs[i].off)) {
+			aio.errnum = FAT_ERR_IO;
+			break;
+		}
+	}
 
-	return (d[cluster] & 0x0fffffff);
+	/* segments already queued must complete before aio goes away */
+	error = fatring_wait(&purdev->ring, &aio);
+	pthread_mutex_unlock(&purdev->ring.lock);
+	if (error)
+		return -1;
+
+	return (aio.errnum || (aio.got != aio.expect)) ? -1 : 0;
 }
 
-static fatoff_t
-fatfs_clus2off(fatfs_t *pfatfs, fatclus_t cluster)
+static int
+urdev_read_at(void *priv, void *buf, size_t nbytes, fatoff_t off)
 {
-	return pfatfs->data_start_off + ((cluster - 2) * pfatfs->bytes_per_cluster);
+	struct fatseg seg = { (uint8_t *) buf, nbytes, off };
+	return urdev_transfer((struct urdev *) priv, 0, &seg, 1);
 }
 
 static int
-fatfs_find_free_clusters(fatfs_t *pfatfs)
+urdev_write_at(void *priv, const void *buf, size_t nbytes, fatoff_t off)
 {
-	#define FATBUFSZ 516
-	uint8_t fatbuf[FATBUFSZ];
+	struct fatseg seg = { (uint8_t *) (uintptr_t) buf, nbytes, off };
+	return urdev_transfer((struct urdev *) priv, 1, &seg, 1);
+}
 
-	fatclus_t fatoff = pfatfs->fat_active_off;
-	fatoff_t max = pfatfs->max_cluster_num;
-	fatclus_t clusperbuf = (pfatfs->type == FAT_TYPE_32) ? (FATBUFSZ / 4) :
-	                       (pfatfs->type == FAT_TYPE_16) ? (FATBUFSZ / 2) :
-                           ((FATBUFSZ * 2) / 3);
+static int
+urdev_flush(void *priv)
+{
+	return fsync(((struct urdev *) priv)->fd);
+}
 
-	for (fatoff_t i = 0; i < (pfatfs->fat_size_bytes / FATBUFSZ); i++) {
-		fatfs_read_from_offset(pfatfs, fatbuf, FATBUFSZ, fatoff + (FATBUFSZ*i));
+static fatoff_t
+urdev_size(void *priv)
+{
+	return (fatoff_t) lseek(((struct urdev *) priv)->fd, 0, SEEK_END);
+}
 
-		/* check err */
-		if (pfatfs->errnum)
-			return -1;
+static void
+urdev_close(void *priv)
+{
+	struct urdev *purdev = (struct urdev *) priv;
 
-		/* loop around clusters in fatbuf  */
-		for (fatclus_t j = 0; (j < clusperbuf) && (max >= 0); j++, max--) {
-			fatclus_t next = pfatfs->readfatbuf(fatbuf, FATBUFSZ, j);
+	fatring_free(&purdev->ring);
+	close(purdev->fd);
+	free(purdev);
+}
 
-			/* skip used */
-			if (next)
-				continue;
+static int
+urdev_init(struct fatdev *pdev, int fd)
+{
+	struct urdev *purdev = (struct urdev *) calloc(1, sizeof(*purdev));
 
-			/* set first free */
-			if (!pfatfs->first_free_cluster)
-				pfatfs->first_free_cluster = (i * clusperbuf) + j;
+	if (!purdev)
+		return -1;
 
-			pfatfs->num_of_free_clusters++;
-		}
+	if (fatring_init(&purdev->ring, FAT_URING_ENTRIES)) {
+		free(purdev);
+		return -1;
 	}
 
+	purdev->fd = fd;
+	pdev->priv = purdev;
+	pdev->read_at = urdev_read_at;
+	pdev->write_at = urdev_write_at;
+	pdev->flush = urdev_flush;
+	pdev->size = urdev_size;
+	pdev->close = urdev_close;
 	return 0;
 }
+#endif /* FAT_HAVE_URING */
 
-static fatclus_t
-fatfs_allocate_cluster(fatfs_t *pfatfs)
+static inline int
+fatfs_check_bounds(fatfs_t *pfatfs, size_t nbytes, fatoff_t offset)
 {
-	fatclus_t nextfree;
+	/* check negative */
+	if (offset < 0)
+		return -1;
+	/* check wraparound */
+	if (((fatoff_t)(offset + nbytes)) < 0)
+		return -1;
+	/* check volume bounds */
+	if ((fatoff_t)(offset + nbytes) > pfatfs->volsize)
+		return -1;
 
-	if (pfatfs->num_of_free_clusters == 0) {
-		pfatfs->errnum = FAT_ERR_FULLDISK;
-		return INVALID_CLUSTER;
+	return 0;
+}
+
+static int
+fatcache_init(fatfs_t *pfatfs, size_t size, size_t dirty_max)
+{
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t nentries = (uint32_t) (size / pfatfs->bytes_per_sector);
+	uint32_t first = 0, nbuckets = 0;
+	void *shards, *counts;
+
+	if (nentries == 0)
+		return 0;
+
+	/* power of two shards, small caches get fewer */
+	pcache->nshards = FAT_CACHE_SHARDS;
+	while ((pcache->nshards > 1) &&
+	       (nentries / pcache->nshards < FAT_CACHE_SHARD_MIN))
+		pcache->nshards >>= 1;
+
+	if (posix_memalign(&shards, FAT_CACHE_LINE,
+	                   pcache->nshards * sizeof(*pcache->shards)))
+		return -1;
+
+	pcache->shards = shards;
+	memset(pcache->shards, 0, pcache->nshards * sizeof(*pcache->shards));
+
+	if (posix_memalign(&counts, FAT_CACHE_LINE,
+	                   FAT_CACHE_SLOTS * sizeof(*pcache->counts)))
+		return -1;
+
+	pcache->counts = counts;
+	memset(pcache->counts, 0, FAT_CACHE_SLOTS * sizeof(*pcache->counts));
+	for (uint32_t i = 0; i < pcache->nshards; i++)
+		fat_mutex_init(&pcache->shards[i].lock);
+
+	/* power of two, at least one bucket per entry of the shard */
+	for (uint32_t i = 0; i < pcache->nshards; i++) {
+		struct fatcache_shard *pshard = &pcache->shards[i];
+
+		pshard->nentries = nentries / pcache->nshards +
+			(i < nentries % pcache->nshards);
+		pshard->nbuckets = 1;
+		while (pshard->nbuckets < pshard->nentries)
+			pshard->nbuckets <<= 1;
+		nbuckets += pshard->nbuckets;
 	}
 
-	nextfree = pfatfs->first_free_cluster;
-	pfatfs->num_of_free_clusters--;
-	pfatfs->first_free_cluster = INVALID_CLUSTER;
+	pcache->entries = calloc(nentries, sizeof(*pcache->entries));
+	pcache->buckets = malloc(nbuckets * sizeof(*pcache->buckets));
+	pcache->flushlist = malloc(nentries * sizeof(*pcache->flushlist));
+	pcache->mem = malloc((size_t) nentries * pfatfs->bytes_per_sector);
+	if (!pcache->entries || !pcache->buckets || !pcache->flushlist ||
+		!pcache->mem)
+		return -1;
 
-	/* find next free */
-	for (fatclus_t num = nextfree + 1; num <= pfatfs->max_cluster_num; num++) {
-		fatclus_t next = pfatfs->readfat(pfatfs, num);
+	for (uint32_t i = 0; i < nbuckets; i++)
+		pcache->buckets[i] = -1;
 
-		if (next == 0) {
-			pfatfs->first_free_cluster = num;
-			break;
-		}
+	/* every entry starts unused */
+	for (uint32_t i = 0; i < nentries; i++) {
+		pcache->entries[i].sector = -1;
+		pcache->entries[i].hnext = -1;
+		pcache->entries[i].data = pcache->mem +
+			((size_t) i * pfatfs->bytes_per_sector);
+	}
+
+	/* shards take consecutive slices of entries and buckets */
+	nbuckets = 0;
+	for (uint32_t i = 0; i < pcache->nshards; i++) {
+		struct fatcache_shard *pshard = &pcache->shards[i];
+
+		pshard->entries = pcache->entries + first;
+		pshard->buckets = pcache->buckets + nbuckets;
+		first += pshard->nentries;
+		nbuckets += pshard->nbuckets;
 	}
 
-	/* no free ahead, reset values */
-	if (pfatfs->first_free_cluster == INVALID_CLUSTER)
-		fatfs_find_free_clusters(pfatfs);
+	/* dirty sectors above the cap are written back */
+	pcache->dirty_max = dirty_max / pfatfs->bytes_per_sector;
+	if ((pcache->dirty_max == 0) || (pcache->dirty_max > nentries))
+		pcache->dirty_max = nentries;
 
-	return nextfree;
+	pcache->nentries = nentries;
+	return 0;
 }
 
-static int
-fatfs_release_cluster(fatfs_t *pfatfs, fatclus_t cluster)
+static void
+fatcache_free(fatfs_t *pfatfs)
 {
-	return fatfs_safe_writefat(pfatfs, cluster, 0);
+	struct fatcache *pcache = &pfatfs->cache;
+
+	for (uint32_t i = 0; pcache->shards && (i < pcache->nshards); i++)
+		pthread_mutex_destroy(&pcache->shards[i].lock);
+
+	free(pcache->shards);
+	free(pcache->counts);
+	free(pcache->entries);
+	free(pcache->buckets);
+	free(pcache->flushlist);
+	free(pcache->mem);
+	pcache->shards = NULL;
+	pcache->counts = NULL;
+	pcache->entries = NULL;
+	pcache->buckets = NULL;
+	pcache->flushlist = NULL;
+	pcache->mem = NULL;
+	pcache->nentries = 0;
 }
 
-static int
-fatfs_link_cluster(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t clus2link)
+/* spread neighbour sectors over shards and buckets */
+static inline uint32_t
+fatcache_hash(fatoff_t sector)
 {
-	/* avoid to write an arbitrary value */
-	if (clus2link != END_OF_FILE) {
-		if (!fatfs_isvalid_cluster(pfatfs, clus2link))
-			return -1;
-	}
-
-	return fatfs_safe_writefat(pfatfs, cluster, clus2link);
+	return (uint32_t) (((uint64_t) sector * 0x9e3779b97f4a7c15ULL) >> 32);
 }
 
-static int
-fatfs_goto_next_block(fatfs_t *pfatfs, fatblock_t *pblock)
+static inline struct fatcache_shard *
+fatcache_shard(struct fatcache *pcache, uint32_t hash)
 {
-	pblock->cluster = fatfs_safe_readfat(pfatfs, pblock->cluster);
-	if (pblock->cluster == INVALID_CLUSTER)
-		return -1;
-
-	pblock->curoff = fatfs_clus2off(pfatfs, pblock->cluster);
-	pblock->endoff = pblock->curoff + pfatfs->bytes_per_cluster;
-	pblock->index++;
-	return 0;
+	return &pcache->shards[hash & (pcache->nshards - 1)];
 }
 
-/* read nbytes from fatblock_t */
-static size_t
-fatfs_read_from_block(fatfs_t *pfatfs, void *buf, size_t nbytes,
-                      fatblock_t *pblock)
+static inline int32_t *
+fatcache_bucket(struct fatcache_shard *pshard, uint32_t hash)
 {
-	size_t total_read = 0;
-
-	while ((total_read < nbytes)) {
+	return &pshard->buckets[(hash >> 16) & (pshard->nbuckets - 1)];
+}
 
-		/* calc current slice */
-		size_t slice_size = pblock->endoff - pblock->curoff;
-		if (slice_size > (nbytes - total_read))
-			slice_size = (nbytes - total_read);
+/* the hash chains are walked without the lock too, at most nentries hops */
+static struct fatcache_entry *
+fatcache_lookup(struct fatcache_shard *pshard, fatoff_t sector, uint32_t hash)
+{
+	int32_t i = __atomic_load_n(fatcache_bucket(pshard, hash),
+	                            __ATOMIC_ACQUIRE);
 
-		/* read */
-		size_t nread = fatfs_read_from_offset(pfatfs, (char *)buf + total_read,
-		                                      slice_size, pblock->curoff);
+	for (uint32_t hops = 0; (i >= 0) && (hops < pshard->nentries); hops++) {
+		struct fatcache_entry *pentry = &pshard->entries[i];
 
-		total_read += nread;
-		if (pfatfs->errnum)
-			break;
+		if (__atomic_load_n(&pentry->sector, __ATOMIC_RELAXED) == sector)
+			return pentry;
+		i = __atomic_load_n(&pentry->hnext, __ATOMIC_RELAXED);
+	}
 
-		/* inc offset */
-		pblock->curoff += nread;
+	return NULL;
+}
 
-		/* if necessary, goto next block */
-		if (pblock->curoff == pblock->endoff) {
-			if (fatfs_goto_next_block(pfatfs, pblock) < 0)
-				break;
-		}
+/* entries of the shard are about to change, under lock */
+static inline void
+fatcache_change_begin(struct fatcache_shard *pshard)
+{
+	if (pshard->wdepth++ == 0) {
+		__atomic_store_n(&pshard->seq, pshard->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
+}
 
-	return total_read;
+static inline void
+fatcache_change_end(struct fatcache_shard *pshard)
+{
+	if (--pshard->wdepth == 0)
+		__atomic_store_n(&pshard->seq, pshard->seq + 1, __ATOMIC_RELEASE);
 }
 
-static inline int
-fatfs_advance_block(fatfs_t *pfatfs, fatblock_t *pblock)
+static void
+fatcache_unhash(struct fatcache_shard *pshard, struct fatcache_entry *pentry)
 {
-	fatclus_t current = pblock->cluster;
+	int32_t idx = (int32_t) (pentry - pshard->entries);
+	int32_t *pnext;
 
-	/* go to next block */
-	if (fatfs_goto_next_block(pfatfs, pblock) < 0) {
-		pblock->cluster = current;
+	if (pentry->sector < 0)
+		return;
 
-		/* if no more blocks, allocate one */
-		fatclus_t newcluster = fatfs_allocate_cluster(pfatfs);
+	pnext = fatcache_bucket(pshard, fatcache_hash(pentry->sector));
+	while (*pnext != idx)
+		pnext = &pshard->entries[*pnext].hnext;
 
-		/* volume is full */
-		if (newcluster == INVALID_CLUSTER)
-			return -1;
+	__atomic_store_n(pnext, pentry->hnext, __ATOMIC_RELAXED);
+	__atomic_store_n(&pentry->hnext, -1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pentry->sector, -1, __ATOMIC_RELAXED);
+}
 
-		/* set EOF */
-		if (fatfs_link_cluster(pfatfs, newcluster, END_OF_FILE))
-			return -1;
+static void
+fatcache_hash_insert(struct fatcache_shard *pshard,
+                     struct fatcache_entry *pentry, fatoff_t sector,
+                     uint32_t hash)
+{
+	int32_t *pbucket = fatcache_bucket(pshard, hash);
 
-		/* link one another */
-		if (fatfs_link_cluster(pfatfs, pblock->cluster, newcluster))
-			return -1;
+	__atomic_store_n(&pentry->sector, sector, __ATOMIC_RELAXED);
+	__atomic_store_n(&pentry->hnext, *pbucket, __ATOMIC_RELAXED);
+	__atomic_store_n(pbucket, (int32_t) (pentry - pshard->entries),
+	                 __ATOMIC_RELEASE);
+}
 
-		/* go to new block */
-		if (fatfs_goto_next_block(pfatfs, pblock) < 0)
-			return -1;
+/* clock: the first entry not referenced since the hand last passed it */
+static struct fatcache_entry *
+fatcache_victim(struct fatcache_shard *pshard)
+{
+	for (;;) {
+		struct fatcache_entry *pentry = &pshard->entries[pshard->hand];
+
+		if (++pshard->hand == pshard->nentries)
+			pshard->hand = 0;
+
+		if (!__atomic_load_n(&pentry->ref, __ATOMIC_RELAXED))
+			return pentry;
+		__atomic_store_n(&pentry->ref, 0, __ATOMIC_RELAXED);
 	}
+}
+
+static inline void
+fatcache_reference(struct fatcache_entry *pentry)
+{
+	/* keep the line clean when the bit is already set */
+	if (!__atomic_load_n(&pentry->ref, __ATOMIC_RELAXED))
+		__atomic_store_n(&pentry->ref, 1, __ATOMIC_RELAXED);
+}
+
+/* write a dirty sector back to the device, under the shard lock */
+static int
+fatcache_writeback(fatfs_t *pfatfs, struct fatcache_entry *pentry)
+{
+	if (!pentry->dirty)
+		return 0;
+
+	if (pfatfs->dev.write_at(pfatfs->dev.priv, pentry->data,
+	                         pfatfs->bytes_per_sector, pfatfs->offset +
+	                         (pentry->sector * pfatfs->bytes_per_sector)))
+		return -1;
 
+	pentry->dirty = 0;
+	__atomic_fetch_sub(&pfatfs->cache.ndirty, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-/* write nbytes to fatblock_t */
-static size_t
-fatfs_write_to_block(fatfs_t *pfatfs, void *buf, size_t nbytes,
-                     fatblock_t *pblock)
+static int
+fatcache_cmp_sector(const void *a, const void *b)
 {
-	size_t total_write = 0;
+	fatoff_t sa = ((const struct fatcache_flushent *) a)->sector;
+	fatoff_t sb = ((const struct fatcache_flushent *) b)->sector;
 
-	while ((total_write < nbytes)) {
+	return (sa > sb) - (sa < sb);
+}
 
-		/* no more bytes in this block  */
-		if (pblock->curoff == pblock->endoff) {
-			if (fatfs_advance_block(pfatfs, pblock))
-				break;
+/* write every dirty sector back, in ascending offset order; the caller
+   holds no shard lock */
+static int
+fatcache_flush(fatfs_t *pfatfs)
+{
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t count = 0;
+	int error = 0;
+
+	if (!pcache->nentries)
+		return 0;
+
+	/* shards are locked in order, only here more than one is held */
+	pthread_mutex_lock(&pcache->lock);
+	for (uint32_t i = 0; i < pcache->nshards; i++) {
+		struct fatcache_shard *pshard = &pcache->shards[i];
+
+		pthread_mutex_lock(&pshard->lock);
+		for (uint32_t j = 0; j < pshard->nentries; j++) {
+			if (pshard->entries[j].dirty) {
+				pcache->flushlist[count].sector = pshard->entries[j].sector;
+				pcache->flushlist[count].pentry = &pshard->entries[j];
+				count++;
+			}
 		}
+	}
 
-		/* calc current slice */
-		size_t slice_size = pblock->endoff - pblock->curoff;
-		if (slice_size > (nbytes - total_write))
-			slice_size = (nbytes - total_write);
+	qsort(pcache->flushlist, count, sizeof(*pcache->flushlist),
+	      fatcache_cmp_sector);
 
-		/* write */
-		size_t nwrite = fatfs_write_to_offset(pfatfs, (char *)buf + total_write,
-		                                      slice_size, pblock->curoff);
+	for (uint32_t i = 0; (i < count) && !error; i++)
+		error = fatcache_writeback(pfatfs, pcache->flushlist[i].pentry);
 
-		total_write += nwrite;
-		if (pfatfs->errnum)
-			break;
+	for (uint32_t i = pcache->nshards; i > 0; i--)
+		pthread_mutex_unlock(&pcache->shards[i - 1].lock);
+	pthread_mutex_unlock(&pcache->lock);
+	return error;
+}
 
-		/* inc offset */
-		pblock->curoff += nwrite;
+/* counters of this thread, slots are handed out round robin */
+static struct fatcache_count *
+fatcache_count(struct fatcache *pcache)
+{
+	if (!fat_cacheslot)
+		fat_cacheslot = __atomic_add_fetch(&fat_cacheslots, 1,
+		                                   __ATOMIC_RELAXED);
+
+	return &pcache->counts[fat_cacheslot % FAT_CACHE_SLOTS];
+}
+
+/* return the cached sector, loading it from the device on a miss; under
+   the shard lock */
+static struct fatcache_entry *
+fatcache_get(fatfs_t *pfatfs, struct fatcache_shard *pshard, fatoff_t sector,
+             uint32_t hash, int load)
+{
+	struct fatcache_entry *pentry;
+
+	pentry = fatcache_lookup(pshard, sector, hash);
+	if (pentry) {
+		__atomic_fetch_add(&fatcache_count(&pfatfs->cache)->hits, 1,
+		                   __ATOMIC_RELAXED);
+		fatcache_reference(pentry);
+		return pentry;
 	}
 
-	return total_write;
+	__atomic_fetch_add(&fatcache_count(&pfatfs->cache)->misses, 1,
+	                   __ATOMIC_RELAXED);
+	pentry = fatcache_victim(pshard);
+	if (fatcache_writeback(pfatfs, pentry))
+		return NULL;
+
+	/* lock free readers of the old sector retry */
+	fatcache_change_begin(pshard);
+	fatcache_unhash(pshard, pentry);
+	fatcache_change_end(pshard);
+
+	if (load && pfatfs->dev.read_at(pfatfs->dev.priv, pentry->data,
+	                                pfatfs->bytes_per_sector, pfatfs->offset +
+	                                (sector * pfatfs->bytes_per_sector)))
+		return NULL;
+
+	fatcache_hash_insert(pshard, pentry, sector, hash);
+	fatcache_reference(pentry);
+	return pentry;
 }
 
-/* read privdirent from fatblock_t */
+/* copy from a cached sector without the lock, 0 if absent or it changed */
 static int
-privdirent_read_from_block(fatfs_t *pfatfs, struct privdirent *pprivdir,
-                           fatblock_t *pblock)
+fatcache_read_fast(struct fatcache *pcache, struct fatcache_shard *pshard,
+                   fatoff_t sector, uint32_t hash, void *buf, size_t secoff,
+                   size_t slice)
 {
-	size_t size = sizeof(*pprivdir);
-	if (fatfs_read_from_block(pfatfs, pprivdir, size, pblock) != size)
-		return -1;
+	uint32_t seq = __atomic_load_n(&pshard->seq, __ATOMIC_ACQUIRE);
+	struct fatcache_entry *pentry;
 
-	return 0;
+	if (seq & 1)
+		return 0;
+
+	pentry = fatcache_lookup(pshard, sector, hash);
+	if (!pentry)
+		return 0;
+
+	memcpy(buf, pentry->data + secoff, slice);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&pshard->seq, __ATOMIC_RELAXED) != seq)
+		return 0;
+
+	__atomic_fetch_add(&fatcache_count(pcache)->hits, 1, __ATOMIC_RELAXED);
+	fatcache_reference(pentry);
+	return 1;
 }
 
+/* copy dirty cached sectors over a buffer read from the device */
 static void
-fatfs_fatblock_init(fatfs_t *pfatfs, fatblock_t *pblock, fatclus_t clsfirst)
+fatcache_overlay(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
 {
-	pblock->curoff = fatfs_clus2off(pfatfs, clsfirst);
-	pblock->endoff = pblock->curoff + pfatfs->bytes_per_cluster;
-	pblock->cluster = clsfirst;
-	pblock->clsinit = clsfirst;
-	pblock->index = 0;
-}
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t bps = pfatfs->bytes_per_sector;
 
-static inline fatoff_t
-fatfs_block_get_startoff(fatfs_t *pfatfs, fatblock_t *pblock)
-{
-	fatoff_t startoff = pblock->endoff - pfatfs->bytes_per_cluster;
+	if (!pcache->nentries)
+		return;
 
-	/* root directory for fat12/16 */
-	if ((pblock->cluster == INVALID_CLUSTER) &&
-		(pblock->index == 0)) {
-		startoff = pfatfs->fat_first_off;
-		startoff += pfatfs->fat_num * pfatfs->fat_size_bytes;
+	while (__atomic_load_n(&pcache->ndirty, __ATOMIC_RELAXED) && nbytes) {
+		fatoff_t sector = offset / bps;
+		uint32_t hash = fatcache_hash(sector);
+		struct fatcache_shard *pshard = fatcache_shard(pcache, hash);
+		struct fatcache_entry *pentry;
+		size_t secoff = (size_t) (offset % bps);
+		size_t slice = bps - secoff;
+
+		if (slice > nbytes)
+			slice = nbytes;
+
+		pthread_mutex_lock(&pshard->lock);
+		pentry = fatcache_lookup(pshard, sector, hash);
+		if (pentry && pentry->dirty)
+			memcpy(buf, pentry->data + secoff, slice);
+		pthread_mutex_unlock(&pshard->lock);
+
+		buf = (uint8_t *) buf + slice;
+		nbytes -= slice;
+		offset += slice;
 	}
-
-	return startoff;
 }
 
+/* read through the cache, transfers above one sector go to the device */
 static int
-fatfs_decrement_block_offset(fatfs_t *pfatfs, fatblock_t *pblock, fatoff_t off)
+fatcache_read(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
 {
-	fatoff_t startoff = fatfs_block_get_startoff(pfatfs, pblock);
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t bps = pfatfs->bytes_per_sector;
 
-	/* max decrement is one block */
-	if (off > pfatfs->bytes_per_cluster)
-		return -1;
-	/* if block is on chain, initial cluster must be valid */
-	if (pblock->clsinit != INVALID_CLUSTER) {
-		if (!fatfs_isvalid_cluster(pfatfs, pblock->clsinit))
+	if (!pcache->nentries || (nbytes > bps)) {
+		if (pfatfs->dev.read_at(pfatfs->dev.priv, buf, nbytes,
+		                        pfatfs->offset + offset))
 			return -1;
-	}
 
-	/* offset in the previous block */
-	if ((pblock->curoff - off) < startoff) {
-		if (pblock->index == 0)
-			return -1;
+		fatcache_overlay(pfatfs, buf, nbytes, offset);
+		return 0;
+	}
 
-		/* find the previous cluster number */
-		fatclus_t clsnum = pblock->clsinit;
-		for (fatoff_t i = 0; i < pblock->index - 1; i++) {
-			clsnum = fatfs_safe_readfat(pfatfs, clsnum);
-			if (clsnum == INVALID_CLUSTER)
+	while (nbytes) {
+		fatoff_t sector = offset / bps;
+		uint32_t hash = fatcache_hash(sector);
+		struct fatcache_shard *pshard = fatcache_shard(pcache, hash);
+		struct fatcache_entry *pentry;
+		size_t secoff = (size_t) (offset % bps);
+		size_t slice = bps - secoff;
+
+		if (slice > nbytes)
+			slice = nbytes;
+
+		/* a miss or a racing change falls back to the lock */
+		if (!fatcache_read_fast(pcache, pshard, sector, hash, buf, secoff,
+		                        slice)) {
+			pthread_mutex_lock(&pshard->lock);
+			pentry = fatcache_get(pfatfs, pshard, sector, hash, 1);
+			if (pentry)
+				memcpy(buf, pentry->data + secoff, slice);
+			pthread_mutex_unlock(&pshard->lock);
+
+			if (!pentry)
 				return -1;
 		}
 
-		off += startoff - pblock->curoff;
-
-		/* update block */
-		pblock->index--;
-		pblock->cluster = clsnum;
-		pblock->endoff = fatfs_clus2off(pfatfs, clsnum);
-		pblock->endoff += pfatfs->bytes_per_cluster;
-		pblock->curoff = pblock->endoff;
+		buf = (uint8_t *) buf + slice;
+		nbytes -= slice;
+		offset += slice;
 	}
 
-	pblock->curoff -= off;
 	return 0;
 }
 
-/* write privdirent to fatblock_t */
-/*
-static int
-privdirent_write_to_block(fatfs_t *pfatfs, struct privdirent *pprivdir,
-                          fatblock_t *pblock)
+/* keep cached sectors coherent with a write to the device */
+static void
+fatcache_update(fatfs_t *pfatfs, const void *buf, size_t nbytes,
+                fatoff_t offset)
 {
-	size_t size = sizeof(*pprivdir);
-	if (fatfs_write_to_block(pfatfs, pprivdir, size, pblock) != size)
-		return -1;
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t bps = pfatfs->bytes_per_sector;
 
-	return 0;
+	if (!pcache->nentries)
+		return;
+
+	while (nbytes) {
+		fatoff_t sector = offset / bps;
+		uint32_t hash = fatcache_hash(sector);
+		struct fatcache_shard *pshard = fatcache_shard(pcache, hash);
+		struct fatcache_entry *pentry;
+		size_t secoff = (size_t) (offset % bps);
+		size_t slice = bps - secoff;
+
+		if (slice > nbytes)
+			slice = nbytes;
+
+		pthread_mutex_lock(&pshard->lock);
+		pentry = fatcache_lookup(pshard, sector, hash);
+		if (pentry) {
+			fatcache_change_begin(pshard);
+			memcpy(pentry->data + secoff, buf, slice);
+			fatcache_change_end(pshard);
+		}
+		pthread_mutex_unlock(&pshard->lock);
+
+		buf = (const uint8_t *) buf + slice;
+		nbytes -= slice;
+		offset += slice;
+	}
 }
-*/
 
+/* write back cache, transfers above one sector go to the device */
 static int
-check_cyclic_fat(fatfs_t *pfatfs, fatclus_t first_cluster)
+fatcache_write(fatfs_t *pfatfs, const void *buf, size_t nbytes,
+               fatoff_t offset)
 {
-	fatblock_t block;
-	fatclus_t saved_cluster = 0;
+	struct fatcache *pcache = &pfatfs->cache;
+	uint32_t bps = pfatfs->bytes_per_sector;
 
-	fatfs_fatblock_init(pfatfs, &block, first_cluster);
+	if (!pcache->nentries || (nbytes > bps)) {
+		if (pfatfs->dev.write_at(pfatfs->dev.priv, buf, nbytes,
+		                         pfatfs->offset + offset))
+			return -1;
 
-	/* follow every cluster number in the FAT chain */
-	for (fatclus_t i = 0; i <= pfatfs->max_cluster_num; i++) {
-		/* if some cluster number repeat, this is a cyclic chain */
-		if (block.cluster == saved_cluster)
-			return 1;
+		if (pcache->nentries)
+			fatcache_update(pfatfs, buf, nbytes, offset);
+		return 0;
+	}
 
-		/* from time to time save the current cluster */
-		if (!(i & 0xff))
-			saved_cluster = block.cluster;
+	while (nbytes) {
+		fatoff_t sector = offset / bps;
+		uint32_t hash = fatcache_hash(sector);
+		struct fatcache_shard *pshard = fatcache_shard(pcache, hash);
+		struct fatcache_entry *pentry;
+		size_t secoff = (size_t) (offset % bps);
+		size_t slice = bps - secoff;
+
+		if (slice > nbytes)
+			slice = nbytes;
+
+		/* a whole sector write does not need the old content, readers
+		   must not see it before the copy */
+		pthread_mutex_lock(&pshard->lock);
+		fatcache_change_begin(pshard);
+		pentry = fatcache_get(pfatfs, pshard, sector, hash, (slice != bps));
+		if (pentry) {
+			memcpy(pentry->data + secoff, buf, slice);
+			if (!pentry->dirty) {
+				pentry->dirty = 1;
+				__atomic_fetch_add(&pcache->ndirty, 1, __ATOMIC_RELAXED);
+			}
+		}
+		fatcache_change_end(pshard);
+		pthread_mutex_unlock(&pshard->lock);
 
-		/* goto next */
-		if (fatfs_goto_next_block(pfatfs, &block) < 0)
-			return 0;
+		if (!pentry)
+			return -1;
+
+		buf = (const uint8_t *) buf + slice;
+		nbytes -= slice;
+		offset += slice;
 	}
 
-	/* no end-of-file means cyclic chain */
-	return 1;
+	/* keep dirty memory bounded */
+	if (__atomic_load_n(&pcache->ndirty, __ATOMIC_RELAXED) > pcache->dirty_max)
+		return fatcache_flush(pfatfs);
+
+	return 0;
 }
 
-static int
-fatdirent_load_lfn(fatfs_t *pfatfs, struct fatdirent *pdirent,
-                   fatblock_t *pblock)
+/* read nbytes from offset */
+static size_t
+fatfs_read_from_offset(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
 {
-	fatblock_t block;
-	struct privdirent privdir;
-	size_t max_lfn_entries = FAT_MAX_NAME / 13;
-	wchar_t *pwsz = &pdirent->d_name[0];
+	fat_errnum = FAT_ERR_IO;
 
-	/* copy fatblock_t, avoid to change the caller structure */
-	memcpy(&block, pblock, sizeof(block));
+	if (fatfs_check_bounds(pfatfs, nbytes, offset))
+		return 0;
 
-	/* initialize */
-	memset(pdirent->d_name, 0, sizeof(pdirent->d_name));
-	memset(&privdir, 0, sizeof(privdir));
+	if (fatcache_read(pfatfs, buf, nbytes, offset))
+		return 0;
 
-	/* retrieve lfn entries */
-	for (size_t ord = 1; ord <= max_lfn_entries; ord++) {
-		if (fatfs_decrement_block_offset(pfatfs, &block, 64))
-			return -1;
+	fat_errnum = FAT_ERR_SUCCESS;
+	return nbytes;
+}
 
-		/* read entry */
-		if(privdirent_read_from_block(pfatfs, &privdir, &block))
-			return -1;
+/* write nbytes to offset */
+static size_t
+fatfs_write_to_offset(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
+{
+	if (pfatfs->flags & FAT_MOUNT_RDONLY) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return 0;
+	}
 
-		/* check attr */
-		if (privdir.type.lfn.attribute != FAT_ATTR_LONG_NAME)
-			return -1;
-		/* check lfn ordinal */
-		if ((privdir.type.lfn.ordinal != 0x40) &&
-			((privdir.type.lfn.ordinal & (~0x40)) != ord))
-			return -1;
+	fat_errnum = FAT_ERR_IO;
 
-		/* copy lfn */
-		for (size_t i = 0; i < PRIVDIR_LFN_NAME1; i++)
-			pwsz[i] = (wchar_t) privdir.type.lfn.name1[i];
-		pwsz += PRIVDIR_LFN_NAME1;
+	if (fatfs_check_bounds(pfatfs, nbytes, offset))
+		return 0;
 
-		for (size_t i = 0; i < PRIVDIR_LFN_NAME2; i++)
-			pwsz[i] = (wchar_t) privdir.type.lfn.name2[i];
-		pwsz += PRIVDIR_LFN_NAME2;
+	if (fatcache_write(pfatfs, buf, nbytes, offset))
+		return 0;
 
-		for (size_t i = 0; i < PRIVDIR_LFN_NAME3; i++)
-			pwsz[i] = (wchar_t) privdir.type.lfn.name3[i];
-		pwsz += PRIVDIR_LFN_NAME3;
+	fat_errnum = FAT_ERR_SUCCESS;
+	return nbytes;
+}
 
-		/* if last, break */
-		if (privdir.type.lfn.ordinal & 0x40)
-			break;
-	}
+/* take a bounce buffer from the pool */
+static uint8_t *
+fatdirect_get(struct fatdirect *pdirect)
+{
+	void *buf = NULL;
 
-	return 0;
+	pthread_mutex_lock(&pdirect->lock);
+	if (pdirect->npool)
+		buf = pdirect->pool[--pdirect->npool];
+	pthread_mutex_unlock(&pdirect->lock);
+
+	if (!buf && posix_memalign(&buf, FAT_DIRECT_ALIGN, FAT_DIRECT_BUFSZ))
+		return NULL;
+
+	return (uint8_t *) buf;
 }
 
-static inline void
-fatdirent_load_lfn_from_8dot3(struct fatdirent *pdirent,
-                              struct privdirent *pprivdir)
+static void
+fatdirect_put(struct fatdirect *pdirect, uint8_t *buf)
 {
-	memset(pdirent->d_name, 0, sizeof(pdirent->d_name));
-	wchar_t *pwsz = &pdirent->d_name[0];
-
-	/* copy name */
-	for (int i = 0; i < 8; i++) {
-		if (pprivdir->type.gen.name_8dot3[i] == ' ')
-			break;
-		*pwsz = (wchar_t) pprivdir->type.gen.name_8dot3[i];
-		pwsz++;
+	pthread_mutex_lock(&pdirect->lock);
+	if (pdirect->npool < FAT_DIRECT_POOL) {
+		pdirect->pool[pdirect->npool++] = buf;
+		buf = NULL;
 	}
+	pthread_mutex_unlock(&pdirect->lock);
 
-	/* copy ext */
-	if (pprivdir->type.gen.name_8dot3[8] != ' ') {
-		*pwsz = (wchar_t) '.';
-		pwsz++;
+	free(buf);
+}
 
-		for (int i = 8; i < 11; i++) {
-			if (pprivdir->type.gen.name_8dot3[i] == ' ')
-				break;
-			*pwsz = pprivdir->type.gen.name_8dot3[i];
-			pwsz++;
-		}
-	}
+static void
+fatdirect_free(struct fatdirect *pdirect)
+{
+	while (pdirect->npool)
+		free(pdirect->pool[--pdirect->npool]);
+
+	if (pdirect->fd >= 0)
+		close(pdirect->fd);
+	pdirect->fd = -1;
 }
 
-/* read fatdirent from fatblock_t */
+/* aligned transfer, a read may stop at the end of device after need bytes */
 static int
-fatdirent_read_from_block(fatfs_t *pfatfs, struct fatdirent *pdirent,
-                          fatblock_t *pblock)
+fatdirect_transfer(struct fatdirect *pdirect, int write, uint8_t *buf,
+                   size_t nbytes, fatoff_t off, size_t need)
 {
-	fatblock_t block;
-	struct privdirent privdir;
-	fatclus_t first_cluster = 0;
+	ssize_t n;
 
-	memset(&privdir, 0, sizeof(privdir));
+	do {
+		n = (write) ? pwrite(pdirect->fd, buf, nbytes, (off_t) off) :
+			pread(pdirect->fd, buf, nbytes, (off_t) off);
+	} while ((n < 0) && (errno == EINTR));
 
-	while (1) {
-		/* read next entry */
-		if(privdirent_read_from_block(pfatfs, &privdir, pblock))
-			return -1;
+	/* O_DIRECT cannot resume at an unaligned offset */
+	if ((n < 0) || ((size_t) n < ((write) ? nbytes : need)))
+		return -1;
 
-		first_cluster = ((privdir.type.gen.first_cluster_high << 16) |
-			privdir.type.gen.first_cluster_low);
+	return 0;
+}
 
-		/* no more entries */
-		if (privdir.type.gen.name_8dot3[0] == 0x00)
-			return -1;
+/* open the image again with O_DIRECT, the page cache stays in use on failure */
+static void
+fatdirect_init(fatfs_t *pfatfs, const char *filename)
+{
+#ifdef O_DIRECT
+	struct fatdirect *pdirect = &pfatfs->direct;
+	int oflag = (pfatfs->flags & FAT_MOUNT_RDONLY) ? O_RDONLY : O_RDWR;
 
-		/* skip deleted entry */
-		if (privdir.type.gen.name_8dot3[0] == 0xe5)
-			continue;
+	/* the volume must start on an aligned offset */
+	if ((pfatfs->offset % FAT_DIRECT_ALIGN) || !pfatfs->dev.size)
+		return;
 
-		/* skip invalid */
-		if (!fatfs_isvalid_cluster(pfatfs, first_cluster)) {
-			/* empty files may have an invalid cluster number */
-			if ((privdir.type.gen.file_size == 0) &&
-				(privdir.type.gen.attribute & FAT_ATTR_ARCHIVE))
-				break;
+	pdirect->limit = pfatfs->dev.size(pfatfs->dev.priv);
+	if (pdirect->limit <= 0)
+		return;
 
-			continue;
-		}
+	pdirect->fd = open(filename, oflag | O_DIRECT);
+#else
+	(void) pfatfs;
+	(void) filename;
+#endif
+}
 
-		/* file */
-		if (privdir.type.gen.attribute & FAT_ATTR_ARCHIVE)
-			break;
+/* split a transfer in chunks that fit a bounce buffer once aligned */
+static inline size_t
+fatdirect_chunk(fatoff_t devoff, size_t nbytes, size_t *phead, size_t *pspan)
+{
+	size_t slice = FAT_DIRECT_BUFSZ - FAT_DIRECT_ALIGN;
 
-		/* directory */
-		if (privdir.type.gen.attribute & FAT_ATTR_DIRECTORY)
-			break;
-	}
+	if (slice > nbytes)
+		slice = nbytes;
 
-	/* copy block before decrement */
-	memcpy(&block, pblock, sizeof(fatblock_t));
-	if (fatfs_decrement_block_offset(pfatfs, &block, 32))
-		return -1;
+	*phead = (size_t) (devoff % FAT_DIRECT_ALIGN);
+	*pspan = (*phead + slice + FAT_DIRECT_ALIGN - 1) &
+		~((size_t) FAT_DIRECT_ALIGN - 1);
+	return slice;
+}
 
-	pdirent->d_privoff = block.curoff;
-	pdirent->d_cluster = first_cluster;
-	pdirent->d_size = privdir.type.gen.file_size;
-	pdirent->d_type = (privdir.type.gen.attribute & FAT_ATTR_DIRECTORY) ?
-		FAT_TYPE_DIRECTORY : FAT_TYPE_ARCHIVE;
+/* read file data around the page cache */
+static size_t
+fatfs_read_direct(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
+{
+	struct fatdirect *pdirect = &pfatfs->direct;
+	uint8_t *bounce = NULL;
+	size_t total_read = 0;
 
-	/* load long name, skip '.', '..' */
-	if (memcmp(privdir.type.gen.name_8dot3, ". ", 2) &&
-		memcmp(privdir.type.gen.name_8dot3, ".. ", 3)) {
-		if (!fatdirent_load_lfn(pfatfs, pdirent, pblock))
-			return 0;
-	}
+	fat_errnum = FAT_ERR_IO;
 
-	/* use 8dot3 */
-	fatdirent_load_lfn_from_8dot3(pdirent, &privdir);
-	return 0;
-}
+	if (fatfs_check_bounds(pfatfs, nbytes, offset))
+		return 0;
 
-static int
-fatdirent_find_entry(fatfs_t *pfatfs, struct fatdirent *pdirent,
-                     fatblock_t *pblock,
-                     const wchar_t *pwszname)
-{
-	/* search every entry from fatblock_t */
-	while (!fatdirent_read_from_block(pfatfs, pdirent, pblock)) {
-		/* compare name */
-		if (!wcsncmp(pdirent->d_name, pwszname, sizeof(pdirent->d_name))) {
-			/* entry found, check the fat chain */
-			if (check_cyclic_fat(pfatfs, pdirent->d_cluster)) {
-				pfatfs->errnum = FAT_ERR_LOOP;
-				return -1;
+	while (total_read < nbytes) {
+		fatoff_t devoff = pfatfs->offset + offset;
+		size_t head, span, slice;
+		uint8_t *dst = (uint8_t *) buf + total_read;
+
+		slice = fatdirect_chunk(devoff, nbytes - total_read, &head, &span);
+
+		/* aligned on every side, no copy */
+		if (!head && (span == slice) &&
+			!((uintptr_t) dst % FAT_DIRECT_ALIGN)) {
+			if (fatdirect_transfer(pdirect, 0, dst, slice, devoff, slice))
+				break;
+		} else {
+			if (!bounce && !(bounce = fatdirect_get(pdirect))) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				break;
 			}
 
-			return 0;
+			if (fatdirect_transfer(pdirect, 0, bounce, span, devoff - head,
+			                       head + slice))
+				break;
+
+			memcpy(dst, bounce + head, slice);
 		}
+
+		/* dirty sectors are newer than the device */
+		fatcache_overlay(pfatfs, dst, slice, offset);
+		total_read += slice;
+		offset += slice;
 	}
 
-	return -1;
+	if (bounce)
+		fatdirect_put(pdirect, bounce);
+
+	if (total_read == nbytes)
+		fat_errnum = FAT_ERR_SUCCESS;
+	return total_read;
 }
 
-static void
-split_path(wchar_t *path, wchar_t **ppdir, wchar_t **ppfile)
+/* write file data around the page cache; blocks it covers in part go
+   through the cached path, clusters smaller than a block share it with
+   other files and directory sectors, and the kernel merges those writes
+   where a read-modify-write here would race with them */
+static size_t
+fatfs_write_direct(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
 {
-	wchar_t *dirpart, *filepart;
+	struct fatdirect *pdirect = &pfatfs->direct;
+	uint8_t *bounce = NULL;
+	size_t total_write = 0;
 
-	/* find the last slash */
-	dirpart = path;
-	filepart = path + wcslen(path) - 1;
-	while (filepart > dirpart) {
-		if (*filepart == (wchar_t) '/') {
-			*filepart = (wchar_t) '\0';
-			filepart++;
-			break;
+	if (pfatfs->flags & FAT_MOUNT_RDONLY) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return 0;
+	}
+
+	fat_errnum = FAT_ERR_IO;
+
+	if (fatfs_check_bounds(pfatfs, nbytes, offset))
+		return 0;
+
+	while (total_write < nbytes) {
+		fatoff_t devoff = pfatfs->offset + offset;
+		size_t head = (size_t) (devoff % FAT_DIRECT_ALIGN);
+		size_t slice = nbytes - total_write;
+		uint8_t *src = (uint8_t *) buf + total_write;
+
+		/* up to the next block boundary, or whole blocks */
+		if (head)
+			slice = FAT_DIRECT_ALIGN - head;
+		else if (slice >= FAT_DIRECT_ALIGN)
+			slice &= ~((size_t) FAT_DIRECT_ALIGN - 1);
+		if (slice > nbytes - total_write)
+			slice = nbytes - total_write;
+		if (slice > FAT_DIRECT_BUFSZ)
+			slice = FAT_DIRECT_BUFSZ;
+
+		/* a partial block, or the last block of the device */
+		if ((slice % FAT_DIRECT_ALIGN) ||
+			(devoff + (fatoff_t) slice > pdirect->limit)) {
+			if (fatcache_write(pfatfs, src, slice, offset))
+				break;
+
+		/* aligned on every side, no copy */
+		} else if (!((uintptr_t) src % FAT_DIRECT_ALIGN)) {
+			if (fatdirect_transfer(pdirect, 1, src, slice, devoff, slice))
+				break;
+
+			if (pfatfs->cache.nentries)
+				fatcache_update(pfatfs, src, slice, offset);
+
+		} else {
+			if (!bounce && !(bounce = fatdirect_get(pdirect))) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				break;
+			}
+
+			memcpy(bounce, src, slice);
+			if (fatdirect_transfer(pdirect, 1, bounce, slice, devoff, slice))
+				break;
+
+			if (pfatfs->cache.nentries)
+				fatcache_update(pfatfs, src, slice, offset);
 		}
 
-		filepart--;
+		total_write += slice;
+		offset += slice;
 	}
 
-	/* filename on root directory */
-	if (dirpart == filepart) {
-		dirpart = L"/";
-		if (*filepart == (wchar_t) '/')
-			filepart++;
-	}
+	if (bounce)
+		fatdirect_put(pdirect, bounce);
 
-	*ppdir = dirpart;
-	*ppfile = (*filepart) ? (filepart) : NULL;
+	if (total_write == nbytes)
+		fat_errnum = FAT_ERR_SUCCESS;
+	return total_write;
 }
 
-static void
-fatfs_set_label_from_char(fatfs_t *pfatfs, char *label)
+/* write file data, it skips the page cache on direct mounts */
+static size_t
+fatfs_write_data(fatfs_t *pfatfs, void *buf, size_t nbytes, fatoff_t offset)
 {
-	pfatfs->label = calloc(1, (strlen(label) + 1) * sizeof(wchar_t));
-	for (size_t i = 0; i < strlen(label); i++)
-		pfatfs->label[i] = (wchar_t) label[i];
+	if ((pfatfs->direct.fd >= 0) && (nbytes > pfatfs->bytes_per_sector))
+		return fatfs_write_direct(pfatfs, buf, nbytes, offset);
+
+	return fatfs_write_to_offset(pfatfs, buf, nbytes, offset);
 }
 
-static inline void
-remove_trailing_spaces_char(char *s)
+static inline int
+fatfs_isvalid_cluster(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	char *p = s + strlen(s) - 1;
+	if ((cluster < 2) || (cluster > pfatfs->max_cluster_num))
+		return 0;
 
-	while (p > s) {
-		if (p[0] != ' ')
-			break;
-		p[0] = '\0';
-		p--;
-	}
+	return 1;
 }
 
-static int
-fatfs_parse_bpb(fatfs_t *pfatfs)
+/* the other fats get the sectors of [off, off + nbytes) at sync */
+static void
+fatmirror_mark(fatfs_t *pfatfs, fatoff_t off, size_t nbytes)
 {
-	struct fat_bpb bpb;
-	size_t nread;
-	char label[12];
+	struct fatmirror *pmirror = &pfatfs->mirror;
+	uint32_t first = (uint32_t) (off / pfatfs->bytes_per_sector);
+	uint32_t last = (uint32_t) ((off + nbytes - 1) / pfatfs->bytes_per_sector);
 
-	memset(label, 0, sizeof(label));
+	if (!pmirror->dirty)
+		return;
 
-	/* set offset */
-	if (_fseek64(pfatfs->stream, pfatfs->offset, SEEK_SET))
-		return -1;
+	for (uint32_t s = first; (s <= last) && (s < pmirror->nsectors); s++) {
+		uint64_t bit = 1ULL << (s & 63);
 
-	/* read bpb */
-	nread = fread(&bpb, 1, sizeof(bpb), pfatfs->stream);
-	if (ferror(pfatfs->stream) || (nread < sizeof(bpb)))
-		return -1;
+		if (!(pmirror->dirty[s >> 6] & bit)) {
+			pmirror->dirty[s >> 6] |= bit;
+			pmirror->ndirty++;
+		}
+	}
+}
 
-	/* check */
-	if ((bpb.bytes_per_sector != 512)
-		&& (bpb.bytes_per_sector != 1024)
-		&& (bpb.bytes_per_sector != 2048)
-		&& (bpb.bytes_per_sector != 4096))
-		return -1;
+/* copy the marked sectors of the active fat to every other fat, a run of
+   sectors at a time */
+static int
+fatmirror_flush(fatfs_t *pfatfs)
+{
+	struct fatmirror *pmirror = &pfatfs->mirror;
+	uint32_t bps = pfatfs->bytes_per_sector;
+	uint32_t maxrun = FAT_MIRROR_BUFSZ / bps;
+	uint8_t *buf;
+	int error = 0;
 
-	/* invalid value */
-	if (!bpb.sectors_per_cluster)
-		return -1;
-	/* invalid value */
-	if ((bpb.num_root_entries * 32) % bpb.bytes_per_sector)
-		return -1;
-	/* max count when fat mirroring is disabled */
-	if (bpb.num_fats > 0xf)
-		return -1;
-	/* one of these must be set */
-	if(!bpb.num_total_sectors_16 && !bpb.num_total_sectors_32)
+	pthread_mutex_lock(&pfatfs->alloc_lock);
+	if (!pmirror->ndirty) {
+		pthread_mutex_unlock(&pfatfs->alloc_lock);
+		return 0;
+	}
+
+	buf = malloc(FAT_MIRROR_BUFSZ);
+	if (!buf) {
+		pthread_mutex_unlock(&pfatfs->alloc_lock);
+		fat_errnum = FAT_ERR_ENOMEM;
 		return -1;
+	}
 
-	pfatfs->bytes_per_cluster = bpb.bytes_per_sector * bpb.sectors_per_cluster;
-	pfatfs->volsize = (bpb.num_total_sectors_16) ? bpb.num_total_sectors_16 :
-		bpb.num_total_sectors_32;
-	pfatfs->volsize *= bpb.bytes_per_sector;
+	for (uint32_t s = 0; (s < pmirror->nsectors) && !error;) {
+		fatoff_t off = (fatoff_t) s * bps;
+		uint32_t run = 0;
+		size_t nbytes;
 
-	/* check volsize */
-	if ((pfatfs->offset + pfatfs->volsize) < 0)
-		return -1;
+		/* clean words at once */
+		if (!(pmirror->dirty[s >> 6] >> (s & 63))) {
+			s = (s | 63) + 1;
+			continue;
+		}
 
-	/* offset to first fat */
-	pfatfs->fat_first_off = bpb.num_reserved_sectors * bpb.bytes_per_sector;
-	pfatfs->fat_active_off = pfatfs->fat_first_off;
-	pfatfs->fat_num = bpb.num_fats;
+		if (!(pmirror->dirty[s >> 6] & (1ULL << (s & 63)))) {
+			s++;
+			continue;
+		}
 
-	/* fat32 */
-	if (!bpb.sectors_per_fat_16) {
-		pfatfs->type = FAT_TYPE_32;
-		pfatfs->writefat = fatfs_write_fat32;
-		pfatfs->readfat = fatfs_read_fat32;
-		pfatfs->readfatbuf = readfatbuf_32;
+		while ((s + run < pmirror->nsectors) && (run < maxrun) &&
+		       (pmirror->dirty[(s + run) >> 6] & (1ULL << ((s + run) & 63))))
+			run++;
 
-		pfatfs->fat_size_bytes = bpb.specific.fat_32.sectors_per_fat_32 *
-			bpb.bytes_per_sector;
-		pfatfs->data_start_off = pfatfs->fat_first_off + (pfatfs->fat_num *
-			pfatfs->fat_size_bytes);
+		nbytes = (size_t) run * bps;
+		if (fatfs_read_from_offset(pfatfs, buf, nbytes,
+		                           pfatfs->fat_active_off + off) != nbytes)
+			error = -1;
 
-		/* support fat32 without mirroring */
-		if (bpb.specific.fat_32.extended_flags & 0x80) {
-			if ((bpb.specific.fat_32.extended_flags & 0xf) >= bpb.num_fats)
-				return -1;
-			/* adjust active fat */
-			pfatfs->fat_active_off += pfatfs->fat_size_bytes *
-				(bpb.specific.fat_32.extended_flags & 0xf);
+		for (uint8_t i = 0; (i < pfatfs->fat_num) && !error; i++) {
+			fatoff_t fatoff = pfatfs->fat_first_off +
+				(i * pfatfs->fat_size_bytes);
+
+			if ((fatoff != pfatfs->fat_active_off) &&
+				(fatfs_write_to_offset(pfatfs, buf, nbytes, fatoff + off)
+				 != nbytes))
+				error = -1;
 		}
 
-		pfatfs->max_cluster_num = ((pfatfs->volsize - pfatfs->data_start_off) /
-			pfatfs->bytes_per_cluster) + 1;
+		for (uint32_t i = 0; (i < run) && !error; i++, s++) {
+			pmirror->dirty[s >> 6] &= ~(1ULL << (s & 63));
+			pmirror->ndirty--;
+		}
+	}
 
-		/* validate root dir cluster */
-		if (((fatclus_t)bpb.specific.fat_32.root_cluster < 2) ||
-			((fatclus_t)bpb.specific.fat_32.root_cluster > pfatfs->max_cluster_num))
-			return -1;
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+	free(buf);
+	return error;
+}
 
-		/* check the fat chain (root) */
-		if (check_cyclic_fat(pfatfs, bpb.specific.fat_32.root_cluster)) {
-			pfatfs->errnum = FAT_ERR_LOOP;
-			return -1;
-		}
+static int
+fatmirror_init(fatfs_t *pfatfs)
+{
+	struct fatmirror *pmirror = &pfatfs->mirror;
 
-		fatfs_fatblock_init(pfatfs, &pfatfs->root_block,
-		                    bpb.specific.fat_32.root_cluster);
+	if ((pfatfs->fat_num < 2) || pfatfs->fat_nomirror)
+		return 0;
 
-		memcpy(label, bpb.specific.fat_32.label, sizeof(label) - 1);
+	pmirror->nsectors = (uint32_t) (pfatfs->fat_size_bytes /
+		pfatfs->bytes_per_sector);
+	pmirror->dirty = calloc((pmirror->nsectors + 63) / 64, sizeof(uint64_t));
+	if (!pmirror->dirty) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		return -1;
+	}
 
-	/* fat12, 16 */
-	} else {
-		pfatfs->type = FAT_TYPE_12;
-		pfatfs->writefat = fatfs_write_fat12;
-		pfatfs->readfat = fatfs_read_fat12;
-		pfatfs->readfatbuf = readfatbuf_12;
+	return 0;
+}
 
-		/* only case where the block is outside the file allocation table */
-		pfatfs->fat_size_bytes = bpb.sectors_per_fat_16 * bpb.bytes_per_sector;
-		pfatfs->root_block.cluster = INVALID_CLUSTER;
-		pfatfs->root_block.clsinit = INVALID_CLUSTER;
-		pfatfs->root_block.curoff = pfatfs->fat_first_off  +
-			(pfatfs->fat_num * pfatfs->fat_size_bytes);
-		pfatfs->root_block.endoff = pfatfs->root_block.curoff +
-			bpb.num_root_entries * 32;
-		pfatfs->root_block.index = 0;
-		pfatfs->data_start_off = pfatfs->root_block.endoff;
+static fatclus_t
+fatfs_read_fat12(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	uint16_t value = 0;
 
-		/* validate root dir offset */
-		if ((pfatfs->root_block.curoff > pfatfs->volsize) ||
-			(pfatfs->root_block.endoff >= pfatfs->volsize))
-			return -1;
+	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
+		pfatfs->fat_active_off + cluster + (cluster / 2)) < sizeof(value))
+		return INVALID_CLUSTER;
 
-		pfatfs->max_cluster_num = ((pfatfs->volsize - pfatfs->data_start_off) /
-			pfatfs->bytes_per_cluster) + 1;
+	return (cluster & 1) ? (value >> 4) : (value & 0xfff);
+}
 
-		if (pfatfs->max_cluster_num > 4085) {
-			pfatfs->type = FAT_TYPE_16;
-			pfatfs->writefat = fatfs_write_fat16;
-			pfatfs->readfat = fatfs_read_fat16;
-			pfatfs->readfatbuf = readfatbuf_16;
-		}
+static int
+fatfs_write_fat12(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+{
+	int16_t entry = 0;
+	value &= 0xfff;
 
-		memcpy(label, bpb.specific.fat_12_16.label, sizeof(label) - 1);
-	}
+	/* read entry */
+	if (fatfs_read_from_offset(pfatfs, &entry, sizeof(entry),
+		pfatfs->fat_active_off + cluster + (cluster / 2)) < sizeof(entry))
+		return -1;
 
-	pfatfs->label = 0;
-	remove_trailing_spaces_char(label);
-	fatfs_set_label_from_char(pfatfs, label);
+	/* update value */
+	if (cluster & 1)
+		entry = (entry & 0xf) | (value << 4);
+	else
+		entry = (entry & 0xf000) | value;
+
+	if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
+		pfatfs->fat_active_off + cluster + (cluster / 2)) < sizeof(entry))
+		return -1;
+
+	fatmirror_mark(pfatfs, cluster + (cluster / 2), sizeof(entry));
 	return 0;
 }
 
-int
-fat_mount(fatfs_t **ppfatfs, const char *filename, fatoff_t offset)
+static fatclus_t
+fatfs_read_fat16(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	int errnum;
-	fatfs_t *pfatfs;
-
-	/* sanity check */
-	if (!ppfatfs || !filename || (offset < 0))
-		return FAT_ERR_INVAL;
+	uint16_t value = 0;
 
-	/* open file */
-	FILE *stream = fopen(filename, "r+b");
-	if (!stream) {
-		if (errno == EACCES)
-			return FAT_ERR_ACCESS;
+	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
+		pfatfs->fat_active_off + (cluster * 2)) < sizeof(value))
+		return INVALID_CLUSTER;
 
-		else if (errno == EBUSY)
-			return FAT_ERR_DEVBUSY;
+	return value;
+}
 
-		return FAT_ERR_IO;
-	}
+static int
+fatfs_write_fat16(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+{
+	int16_t entry = (int16_t) value;
 
-	/* alloc new fatfs */
-	pfatfs = (fatfs_t *) calloc(1, sizeof(fatfs_t));
-	if (!pfatfs) {
-		fclose(stream);
-		return FAT_ERR_ENOMEM;
-	}
+	if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
+		pfatfs->fat_active_off + (cluster * 2)) < sizeof(entry))
+		return -1;
 
-	pfatfs->stream = stream;
-	pfatfs->offset = offset;
+	fatmirror_mark(pfatfs, cluster * 2, sizeof(entry));
+	return 0;
+}
 
-	/* parse bpb */
-	if (fatfs_parse_bpb(pfatfs)) {
-		errnum = (pfatfs->errnum) ? pfatfs->errnum : FAT_ERR_NOTFATFS;
-		fat_umount(pfatfs);
-		return errnum;
-	}
+static fatclus_t
+fatfs_read_fat32(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	int32_t value = 0;
 
-	/* find free clusters */
-	if (fatfs_find_free_clusters(pfatfs)) {
-		errnum = pfatfs->errnum;
-		fat_umount(pfatfs);
-		return errnum;
-	}
+	if (fatfs_read_from_offset(pfatfs, &value, sizeof(value),
+		pfatfs->fat_active_off + (cluster * 4)) < sizeof(value))
+		return INVALID_CLUSTER;
 
-	*ppfatfs = pfatfs;
-	return FAT_ERR_SUCCESS;
+	return value & 0x0fffffff;
 }
 
-void
-fat_umount(fatfs_t *pfatfs)
+static int
+fatfs_write_fat32(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
 {
-	if (pfatfs) {
-		fclose(pfatfs->stream);
-		free(pfatfs->label);
-		free(pfatfs);
-	}
+	int32_t entry = (int32_t) value;
+
+	if (fatfs_write_to_offset(pfatfs, &entry, sizeof(entry),
+		pfatfs->fat_active_off + (cluster * 4)) < sizeof(entry))
+		return -1;
+
+	fatmirror_mark(pfatfs, cluster * 4, sizeof(entry));
+	return 0;
 }
 
-wchar_t *
-fat_getlabel(fatfs_t *pfatfs)
+/* a chunk not yet scanned keeps its bits clear, the scan reads the fat */
+static inline int
+fatbitmap_scanned(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	return (pfatfs) ? (pfatfs->label) : NULL;
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+
+	return pbitmap->scanned[(uint32_t) cluster / pbitmap->perchunk];
 }
 
-int
-fat_error(fatfs_t *pfatfs)
+static inline int
+fatbitmap_complete(fatfs_t *pfatfs)
 {
-	return (pfatfs) ? (pfatfs->errnum) : 0;
+	return pfatfs->bitmap.words &&
+		(pfatfs->bitmap.nscanned == pfatfs->bitmap.nchunks);
 }
 
-fatdir_t *
-fat_opendir(fatfs_t *pfatfs, const wchar_t *path)
+static inline void
+fatbitmap_set_free(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	fatblock_t block;
-	wchar_t *pwsz, *curdir, *nextslash, *maxptr;
-	struct fatdirent fatdirent;
-	fatdir_t *pfatdir = NULL;
-	fatoff_t privoff = 0;
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint32_t w = (uint32_t) cluster >> 6;
+	uint64_t bit = 1ULL << (cluster & 63);
 
-	if (!pfatfs)
-		return NULL;
+	if (!pbitmap->words || !fatbitmap_scanned(pfatfs, cluster) ||
+		(pbitmap->words[w] & bit))
+		return;
 
-	if (!path) {
-		pfatfs->errnum = FAT_ERR_INVAL;
-		return NULL;
-	}
+	pbitmap->words[w] |= bit;
+	pbitmap->summary[w >> 6] |= 1ULL << (w & 63);
+	pfatfs->num_of_free_clusters++;
+}
 
-	if (!wcslen(path)) {
-		pfatfs->errnum = FAT_ERR_NOENT;
-		return NULL;
-	}
+static inline void
+fatbitmap_set_used(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint32_t w = (uint32_t) cluster >> 6;
+	uint64_t bit = 1ULL << (cluster & 63);
 
-	/* copy root dir block */
-	memcpy(&block, &pfatfs->root_block, sizeof(block));
-	privoff = pfatfs->root_block.curoff;
+	if (!pbitmap->words || !fatbitmap_scanned(pfatfs, cluster) ||
+		!(pbitmap->words[w] & bit))
+		return;
 
-	/* copy the name */
-	pwsz = wcsdup(path);
-	if (!pwsz) {
-		pfatfs->errnum = FAT_ERR_ENOMEM;
-		return NULL;
-	}
+	pbitmap->words[w] &= ~bit;
+	if (!pbitmap->words[w])
+		pbitmap->summary[w >> 6] &= ~(1ULL << (w & 63));
+	pfatfs->num_of_free_clusters--;
+}
 
-	maxptr = pwsz + wcslen(pwsz);
+static inline int
+fatbitmap_is_free(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	return (pfatfs->bitmap.words[(uint32_t) cluster >> 6] >>
+		(cluster & 63)) & 1;
+}
 
-	/* remove the initial slash, if any */
-	curdir = pwsz;
-	if (curdir[0] == (wchar_t) '/')
-		curdir++;
+/* first free cluster at or after 'from', word at a time */
+static fatclus_t
+fatbitmap_find_next(fatfs_t *pfatfs, fatclus_t from)
+{
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint64_t bits;
+	uint32_t w, s;
 
-	/* for all dir names */
-	while ((curdir < maxptr) && (curdir >= pwsz)) {
-		nextslash = wcschr(curdir, (wchar_t) '/');
-		if (nextslash)
-			*nextslash = (wchar_t) '\0';
+	if (from < 2)
+		from = 2;
+	if (from > pfatfs->max_cluster_num)
+		return INVALID_CLUSTER;
 
-		/* entry not found, free and ret */
-		if (fatdirent_find_entry(pfatfs, &fatdirent, &block, curdir) < 0) {
-			if (!pfatfs->errnum)
-				pfatfs->errnum = FAT_ERR_NOENT;
-			goto _free_and_ret;
-		}
+	/* rest of the current word */
+	w = (uint32_t) from >> 6;
+	bits = pbitmap->words[w] & (~0ULL << (from & 63));
+	if (bits)
+		return (fatclus_t) ((w << 6) + __builtin_ctzll(bits));
 
-		/* entry is not dir, free and ret */
-		if (fatdirent.d_type != FAT_TYPE_DIRECTORY) {
-			pfatfs->errnum = FAT_ERR_NOTDIR;
-			goto _free_and_ret;
+	/* summary tells which of the next words have a free cluster */
+	w++;
+	s = w >> 6;
+	if (s >= pbitmap->nsummary)
+		return INVALID_CLUSTER;
+
+	bits = pbitmap->summary[s] & (~0ULL << (w & 63));
+	while (!bits) {
+		if (++s >= pbitmap->nsummary)
+			return INVALID_CLUSTER;
+		bits = pbitmap->summary[s];
+	}
+
+	w = (s << 6) + __builtin_ctzll(bits);
+	return (fatclus_t) ((w << 6) + __builtin_ctzll(pbitmap->words[w]));
+}
+
+/* number of consecutive free clusters from 'start', up to 'max' */
+static fatclus_t
+fatbitmap_run_length(fatfs_t *pfatfs, fatclus_t start, fatclus_t max)
+{
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	fatclus_t length = 0;
+
+	while ((length < max) && (start + length <= pfatfs->max_cluster_num)) {
+		fatclus_t cluster = start + length;
+		fatclus_t left = 64 - (cluster & 63);
+		uint64_t bits = pbitmap->words[(uint32_t) cluster >> 6] >>
+			(cluster & 63);
+
+		/* count the trailing ones of this word */
+		fatclus_t ones = (~bits) ? __builtin_ctzll(~bits) : 64;
+		if (ones > left)
+			ones = left;
+
+		length += ones;
+		if (ones < left)
+			break;
+	}
+
+	/* clusters beyond the fat are never free */
+	if (start + length > pfatfs->max_cluster_num + 1)
+		length = pfatfs->max_cluster_num + 1 - start;
+
+	return (length < max) ? length : max;
+}
+
+static void
+fatbitmap_free(fatfs_t *pfatfs)
+{
+	free(pfatfs->bitmap.words);
+	free(pfatfs->bitmap.summary);
+	free(pfatfs->bitmap.scanned);
+	memset(&pfatfs->bitmap, 0, sizeof(pfatfs->bitmap));
+}
+
+/* an empty bitmap, chunks are scanned on demand */
+static int
+fatbitmap_init(fatfs_t *pfatfs)
+{
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint32_t nentries = (uint32_t) pfatfs->max_cluster_num + 1;
+	uint32_t pair = (pfatfs->type == FAT_TYPE_32) ? 8 :
+	                (pfatfs->type == FAT_TYPE_16) ? 4 : 3;
+
+	if (!pbitmap->words) {
+		pbitmap->nwords = ((uint32_t) pfatfs->max_cluster_num >> 6) + 1;
+		pbitmap->nsummary = (pbitmap->nwords + 63) >> 6;
+		pbitmap->perchunk = (FAT_SCAN_BUFSZ / pair) * 2;
+		pbitmap->nchunks = (nentries + pbitmap->perchunk - 1) /
+			pbitmap->perchunk;
+		pbitmap->words = calloc(pbitmap->nwords, sizeof(uint64_t));
+		pbitmap->summary = calloc(pbitmap->nsummary, sizeof(uint64_t));
+		pbitmap->scanned = calloc(pbitmap->nchunks, sizeof(uint8_t));
+		if (!pbitmap->words || !pbitmap->summary || !pbitmap->scanned) {
+			fatbitmap_free(pfatfs);
+			fat_errnum = FAT_ERR_ENOMEM;
+			return -1;
 		}
+	} else {
+		memset(pbitmap->words, 0, pbitmap->nwords * sizeof(uint64_t));
+		memset(pbitmap->summary, 0, pbitmap->nsummary * sizeof(uint64_t));
+		memset(pbitmap->scanned, 0, pbitmap->nchunks);
+	}
 
-		/* dir found, update block */
-		fatfs_fatblock_init(pfatfs, &block, fatdirent.d_cluster);
+	pbitmap->nscanned = 0;
+	pbitmap->changed = 0;
+	pfatfs->num_of_free_clusters = 0;
+	return 0;
+}
 
-		privoff = fatdirent.d_privoff;
-		curdir = nextslash + 1;
+/* free cluster scan kernels: each 64 fat entries give one bitmap word,
+   a bit set for every free (zero) entry */
+struct fatscan_ops {
+	const char *name;
+	void (*mask16)(const uint16_t *src, size_t ngroups, uint64_t *mask);
+	void (*mask32)(const uint32_t *src, size_t ngroups, uint64_t *mask);
+	void (*unpack12)(const uint8_t *src, size_t nentries, uint16_t *dst);
+};
+
+static void
+fatscan_mask16_scalar(const uint16_t *src, size_t ngroups, uint64_t *mask)
+{
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i++)
+			bits |= (uint64_t) (src[i] == 0) << i;
+		mask[g] = bits;
 	}
+}
 
-	/* allocate memory for fatdir */
-	pfatdir = calloc(1, sizeof(*pfatdir));
-	if (!pfatdir) {
-		pfatfs->errnum = FAT_ERR_ENOMEM;
-		goto _free_and_ret;
+static void
+fatscan_mask32_scalar(const uint32_t *src, size_t ngroups, uint64_t *mask)
+{
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i++)
+			bits |= (uint64_t) ((src[i] & 0x0fffffff) == 0) << i;
+		mask[g] = bits;
 	}
+}
 
-	/* set values */
-	pfatdir->pfatfs = pfatfs;
-	pfatdir->privoff = privoff;
-	pfatdir->position = 0;
-	memcpy(&pfatdir->block, &block, sizeof(block));
-	pfatfs->errnum = FAT_ERR_SUCCESS;
+/* two entries in three bytes, nentries is even */
+static void
+fatscan_unpack12_scalar(const uint8_t *src, size_t nentries, uint16_t *dst)
+{
+	for (size_t i = 0; i < nentries; i += 2, src += 3) {
+		dst[i] = (uint16_t) (src[0] | ((src[1] & 0x0f) << 8));
+		dst[i + 1] = (uint16_t) ((src[1] >> 4) | (src[2] << 4));
+	}
+}
 
-_free_and_ret:
-	free(pwsz);
-	return pfatdir;
+static const struct fatscan_ops fatscan_scalar = {
+	"scalar", fatscan_mask16_scalar, fatscan_mask32_scalar,
+	fatscan_unpack12_scalar
+};
+
+#ifdef FAT_HAVE_X86
+__attribute__((target("sse2")))
+static void
+fatscan_mask16_sse2(const uint16_t *src, size_t ngroups, uint64_t *mask)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+			__m128i b = _mm_loadu_si128((const __m128i *) (src + i + 8));
+			__m128i z = _mm_packs_epi16(_mm_cmpeq_epi16(a, zero),
+			                            _mm_cmpeq_epi16(b, zero));
+
+			bits |= (uint64_t) (uint16_t) _mm_movemask_epi8(z) << i;
+		}
+		mask[g] = bits;
+	}
 }
 
-struct fatdirent *
-fat_readdir(fatdir_t *pfatdir)
+__attribute__((target("sse2")))
+static void
+fatscan_mask32_sse2(const uint32_t *src, size_t ngroups, uint64_t *mask)
 {
-	if (pfatdir) {
-		if (!fatdirent_read_from_block(pfatdir->pfatfs, &pfatdir->data,
-		    &pfatdir->block)) {
-			pfatdir->position++;
-			pfatdir->pfatfs->errnum = FAT_ERR_SUCCESS;
-			return &pfatdir->data;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi32(0x0fffffff);
+
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i += 16) {
+			__m128i v[4], ab, cd;
+
+			for (unsigned j = 0; j < 4; j++) {
+				v[j] = _mm_loadu_si128((const __m128i *) (src + i + j * 4));
+				v[j] = _mm_cmpeq_epi32(_mm_and_si128(v[j], low), zero);
+			}
+
+			/* 32 bit lanes to bytes, order is kept */
+			ab = _mm_packs_epi32(v[0], v[1]);
+			cd = _mm_packs_epi32(v[2], v[3]);
+			bits |= (uint64_t) (uint16_t)
+				_mm_movemask_epi8(_mm_packs_epi16(ab, cd)) << i;
 		}
+		mask[g] = bits;
 	}
+}
 
-	return NULL;
+static const struct fatscan_ops fatscan_sse2 = {
+	"sse2", fatscan_mask16_sse2, fatscan_mask32_sse2, fatscan_unpack12_scalar
+};
+
+__attribute__((target("avx2")))
+static void
+fatscan_mask16_avx2(const uint16_t *src, size_t ngroups, uint64_t *mask)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+			__m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 16));
+			__m256i z = _mm256_packs_epi16(_mm256_cmpeq_epi16(a, zero),
+			                               _mm256_cmpeq_epi16(b, zero));
+
+			/* packs works per 128 bit lane */
+			z = _mm256_permute4x64_epi64(z, 0xd8);
+			bits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(z) << i;
+		}
+		mask[g] = bits;
+	}
 }
 
-long
-fat_telldir(fatdir_t *pfatdir)
+__attribute__((target("avx2")))
+static void
+fatscan_mask32_avx2(const uint32_t *src, size_t ngroups, uint64_t *mask)
 {
-	if (pfatdir) {
-		pfatdir->pfatfs->errnum = FAT_ERR_SUCCESS;
-		return pfatdir->position;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i low = _mm256_set1_epi32(0x0fffffff);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	for (size_t g = 0; g < ngroups; g++, src += 64) {
+		uint64_t bits = 0;
+
+		for (unsigned i = 0; i < 64; i += 32) {
+			__m256i v[4], ab, cd, z;
+
+			for (unsigned j = 0; j < 4; j++) {
+				v[j] = _mm256_loadu_si256((const __m256i *) (src + i + j * 8));
+				v[j] = _mm256_cmpeq_epi32(_mm256_and_si256(v[j], low), zero);
+			}
+
+			/* each lane holds four entries of every vector, regroup them */
+			ab = _mm256_packs_epi32(v[0], v[1]);
+			cd = _mm256_packs_epi32(v[2], v[3]);
+			z = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(ab, cd), order);
+			bits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(z) << i;
+		}
+		mask[g] = bits;
 	}
+}
 
-	return -1;
+/* sixteen entries from 24 bytes, each lane reads 16 and uses 12 */
+__attribute__((target("avx2")))
+static void
+fatscan_unpack12_avx2(const uint8_t *src, size_t nentries, uint16_t *dst)
+{
+	const __m256i ctl = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+	                                     6, 7, 7, 8, 9, 10, 10, 11,
+	                                     0, 1, 1, 2, 3, 4, 4, 5,
+	                                     6, 7, 7, 8, 9, 10, 10, 11);
+	const __m256i low = _mm256_set1_epi16(0x0fff);
+	size_t i = 0;
+
+	/* the last load must stay inside the 3 * nentries / 2 bytes */
+	for (; (i + 16) * 3 / 2 + 4 <= nentries * 3 / 2; i += 16) {
+		const uint8_t *p = src + (i * 3 / 2);
+		__m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *) p)),
+			_mm_loadu_si128((const __m128i *) (p + 12)), 1);
+
+		x = _mm256_shuffle_epi8(x, ctl);
+		x = _mm256_blend_epi16(_mm256_and_si256(x, low),
+		                       _mm256_srli_epi16(x, 4), 0xaa);
+		_mm256_storeu_si256((__m256i *) (dst + i), x);
+	}
+
+	fatscan_unpack12_scalar(src + (i * 3 / 2), nentries - i, dst + i);
 }
 
-void
-fat_seekdir(fatdir_t *pfatdir, long loc)
+static const struct fatscan_ops fatscan_avx2 = {
+	"avx2", fatscan_mask16_avx2, fatscan_mask32_avx2, fatscan_unpack12_avx2
+};
+#endif
+
+/* best kernels for this cpu, up to the FAT_SCAN_* level 'scan' */
+static const struct fatscan_ops *
+fatscan_select(uint32_t scan)
 {
-	if (!pfatdir)
-		return;
+	const struct fatscan_ops *pops = &fatscan_scalar;
+#ifdef FAT_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2") && (scan != FAT_SCAN_SCALAR))
+		pops = &fatscan_sse2;
+	if (__builtin_cpu_supports("avx2") &&
+		((scan == FAT_SCAN_AUTO) || (scan == FAT_SCAN_AVX2)))
+		pops = &fatscan_avx2;
+#else
+	(void) scan;
+#endif
+
+	return pops;
+}
 
-	if (loc < 0) {
-		pfatdir->pfatfs->errnum = FAT_ERR_INVAL;
-		return;
+/* free clusters of one scanned word, the bitmap starts cleared */
+static inline void
+fatbitmap_set_word(fatfs_t *pfatfs, uint32_t w, uint64_t bits)
+{
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+
+	pbitmap->words[w] = bits;
+	if (bits)
+		pbitmap->summary[w >> 6] |= 1ULL << (w & 63);
+	pfatfs->num_of_free_clusters += __builtin_popcountll(bits);
+}
+
+/* only clusters 2 to max_cluster_num can be free */
+static inline uint64_t
+fatbitmap_valid_bits(fatfs_t *pfatfs, uint32_t w)
+{
+	uint64_t bits = ~0ULL;
+	uint32_t last = (uint32_t) pfatfs->max_cluster_num;
+
+	if (w == 0)
+		bits &= ~3ULL;
+	if ((w << 6) + 63 > last)
+		bits &= (1ULL << (last - (w << 6) + 1)) - 1;
+
+	return bits;
+}
+
+/* free clusters of [first, first + count) from the in memory fat, 'first'
+   is a multiple of 64; -1 if a page of it is still on the device */
+static int
+fatfs_scan_table(fatfs_t *pfatfs, uint32_t first, uint32_t count)
+{
+	struct fattable *ptable = &pfatfs->table;
+	const struct fatscan_ops *pops = pfatfs->bitmap.pops;
+	uint32_t last = first + count - 1;
+	uint32_t ngroups = count / 64;
+	uint64_t mask[FAT_TABLE_PAGE_ENTRIES / 64];
+
+	if (!ptable->map || (last >= ptable->nentries))
+		return -1;
+
+	for (uint32_t page = first / FAT_TABLE_PAGE_ENTRIES;
+	     page <= last / FAT_TABLE_PAGE_ENTRIES; page++) {
+		if (!__atomic_load_n(&ptable->loaded[page], __ATOMIC_ACQUIRE))
+			return -1;
 	}
 
-	pfatdir->pfatfs->errnum = FAT_ERR_SUCCESS;
-	fat_rewinddir(pfatdir);
-	for (long i = 0; i < loc; i++)
-		fat_readdir(pfatdir);
+	for (uint32_t g = 0; g < ngroups; g += FAT_TABLE_PAGE_ENTRIES / 64) {
+		uint32_t n = FAT_TABLE_PAGE_ENTRIES / 64;
+		uint32_t w = first / 64 + g;
+
+		if (n > ngroups - g)
+			n = ngroups - g;
+
+		pops->mask32(ptable->map + ((size_t) w * 64), n, mask);
+		for (uint32_t i = 0; i < n; i++)
+			fatbitmap_set_word(pfatfs, w + i,
+			                   mask[i] & fatbitmap_valid_bits(pfatfs, w + i));
+	}
+
+	/* entries past the last whole group */
+	if (count % 64) {
+		uint32_t w = first / 64 + ngroups;
+		uint64_t bits = 0;
+
+		for (uint32_t c = w * 64; c <= last; c++) {
+			if (!ptable->map[c])
+				bits |= 1ULL << (c & 63);
+		}
+
+		fatbitmap_set_word(pfatfs, w, bits & fatbitmap_valid_bits(pfatfs, w));
+	}
+
+	return 0;
 }
 
-void
-fat_rewinddir(fatdir_t *pfatdir)
+/* add the free clusters of one chunk of the active fat to the bitmap */
+static int
+fatfs_scan_chunk(fatfs_t *pfatfs, uint32_t chunk)
 {
-	/* sanity check */
-	if (!pfatdir)
-		return;
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint32_t nentries = (uint32_t) pfatfs->max_cluster_num + 1;
+	uint32_t pair = (pfatfs->type == FAT_TYPE_32) ? 8 :
+	                (pfatfs->type == FAT_TYPE_16) ? 4 : 3;
+	uint32_t first = chunk * pbitmap->perchunk;
+	uint32_t count = nentries - first;
+	uint64_t mask[FAT_SCAN_BUFSZ * 2 / 3 / 64];
+	uint16_t *unpacked = NULL;
+	uint8_t *buf = NULL;
+	fatoff_t off = (fatoff_t) first / 2 * pair;
+	size_t ngroups, nbytes, nread;
+	int error = -1;
+
+	if (!pbitmap->pops)
+		pbitmap->pops = fatscan_select(pfatfs->scan);
+	if (count > pbitmap->perchunk)
+		count = pbitmap->perchunk;
+
+	/* decoded fat in memory, unless pages are still on the device */
+	if (!fatfs_scan_table(pfatfs, first, count))
+		goto _scanned;
+
+	buf = malloc(FAT_SCAN_BUFSZ);
+	if (pfatfs->type == FAT_TYPE_12)
+		unpacked = malloc(pbitmap->perchunk * sizeof(*unpacked));
+	if (!buf || ((pfatfs->type == FAT_TYPE_12) && !unpacked)) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		goto out;
+	}
 
-	pfatdir->position = 0;
-	pfatdir->block.cluster = pfatdir->block.clsinit;
-	pfatdir->block.index = 0;
+	/* whole groups, what is beyond the fat reads as used */
+	ngroups = (count + 63) / 64;
+	nbytes = ngroups * 64 / 2 * pair;
+	nread = (size_t) (((fatoff_t) nbytes > pfatfs->fat_size_bytes - off) ?
+		pfatfs->fat_size_bytes - off : (fatoff_t) nbytes);
+
+	if (nread && (fatfs_read_from_offset(pfatfs, buf, nread,
+	                                     pfatfs->fat_active_off + off)
+	              != nread))
+		goto out;
+	memset(buf + nread, 0xff, nbytes - nread);
+
+	if (pfatfs->type == FAT_TYPE_32)
+		pbitmap->pops->mask32((const uint32_t *) buf, ngroups, mask);
+	else if (pfatfs->type == FAT_TYPE_16)
+		pbitmap->pops->mask16((const uint16_t *) buf, ngroups, mask);
+	else {
+		pbitmap->pops->unpack12(buf, ngroups * 64, unpacked);
+		pbitmap->pops->mask16(unpacked, ngroups, mask);
+	}
 
-	/* generic rewind */
-	if (fatfs_isvalid_cluster(pfatdir->pfatfs, pfatdir->block.cluster)) {
-		fatfs_fatblock_init(pfatdir->pfatfs, &pfatdir->block,
-		                    pfatdir->block.clsinit);
-		return;
+	for (size_t g = 0; g < ngroups; g++) {
+		uint32_t w = first / 64 + (uint32_t) g;
+
+		fatbitmap_set_word(pfatfs, w, mask[g] & fatbitmap_valid_bits(pfatfs, w));
 	}
 
-	/* rewind on fat12,fat16 root dir */
-	memcpy(&pfatdir->block, &pfatdir->pfatfs->root_block, sizeof(fatblock_t));
+_scanned:
+	pbitmap->scanned[chunk] = 1;
+	pbitmap->nscanned++;
+	error = 0;
+out:
+	free(unpacked);
+	free(buf);
+	return error;
 }
 
-void
-fat_closedir(fatdir_t *pfatdir)
+/* make the bitmap valid around 'cluster' */
+static int
+fatfs_scan_cluster(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	free(pfatdir);
+	uint32_t chunk;
+
+	if (cluster < 2)
+		cluster = 2;
+	if (cluster > pfatfs->max_cluster_num)
+		return 0;
+
+	chunk = (uint32_t) cluster / pfatfs->bitmap.perchunk;
+	if (pfatfs->bitmap.scanned[chunk])
+		return 0;
+
+	return fatfs_scan_chunk(pfatfs, chunk);
 }
 
-int
-fat_mkdir(fatfs_t *pfatfs, const wchar_t *path)
+/* scan the first chunk left at or after 'cluster', wrapping around;
+   1 if a chunk was scanned, 0 if the bitmap is complete, -1 on error */
+static int
+fatfs_scan_next(fatfs_t *pfatfs, fatclus_t cluster)
 {
-	// TODO: implement
-	fprintf(stderr, "fat_mkdir(%p, %p): not implemented\n",
-	        (void *) pfatfs, (void *) path);
-	return FAT_ERR_NOTIMPL;
+	struct fatbitmap *pbitmap = &pfatfs->bitmap;
+	uint32_t chunk;
+
+	if ((cluster < 2) || (cluster > pfatfs->max_cluster_num))
+		cluster = 2;
+
+	chunk = (uint32_t) cluster / pbitmap->perchunk;
+	for (uint32_t i = 0; i < pbitmap->nchunks; i++) {
+		uint32_t c = (chunk + i) % pbitmap->nchunks;
+
+		if (!pbitmap->scanned[c])
+			return fatfs_scan_chunk(pfatfs, c) ? -1 : 1;
+	}
+
+	return 0;
 }
 
-int
-fat_rmdir(fatfs_t *pfatfs, const wchar_t *path)
+/* scan every chunk left, the free count is exact afterwards */
+static int
+fatfs_scan_all(fatfs_t *pfatfs)
 {
-	// TODO: implement
-	fprintf(stderr, "fat_rmdir(%p, %p): not implemented\n",
-	        (void *) pfatfs, (void *) path);
-	return FAT_ERR_NOTIMPL;
+	int ret;
+
+	while ((ret = fatfs_scan_next(pfatfs, 2)) > 0)
+		;
+
+	return ret;
 }
 
-static inline int
-parse_fopen_mode(const char *mode, uint8_t *oflag_mode, uint8_t *create,
-                 uint8_t *trunc)
+/* build the free cluster bitmap from the active fat */
+static int
+fatfs_find_free_clusters(fatfs_t *pfatfs)
 {
-	*oflag_mode = 0;
-	*create = 0;
-	*trunc = 0;
+	fat_errnum = FAT_ERR_SUCCESS;
 
-	switch (*mode) {
-		case 'a':
-			*create = 1;
-			*oflag_mode = FAT_FILE_MODE_APPEND;
-			if (mode[1] == '+')
-				*oflag_mode |= FAT_FILE_MODE_READ;
-			break;
+	if (fatbitmap_init(pfatfs) || fatfs_scan_all(pfatfs))
+		return -1;
 
-		case 'r':
-			*oflag_mode = FAT_FILE_MODE_READ;
-			if (mode[1] == '+')
-				*oflag_mode |= FAT_FILE_MODE_WRITE;
-			break;
+	pfatfs->first_free_cluster = fatbitmap_find_next(pfatfs, 2);
+	return 0;
+}
+
+/* an empty bitmap on the first fat update of a mount that trusted
+   fsinfo, a lazy mount already has one */
+static int
+fatfs_load_free_clusters(fatfs_t *pfatfs)
+{
+	if (!pfatfs->bitmap.words && fatbitmap_init(pfatfs))
+		return -1;
+
+	pfatfs->bitmap.changed = 1;
+	return 0;
+}
+
+static fatclus_t
+fatfs_safe_readfat(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	fatclus_t nextcluster;
+
+	/* validate cluster */
+	if (!fatfs_isvalid_cluster(pfatfs, cluster))
+		return INVALID_CLUSTER;
+
+	nextcluster = pfatfs->readfat(pfatfs, cluster);
+
+	/* validate cluster */
+	if (!fatfs_isvalid_cluster(pfatfs, nextcluster))
+		return INVALID_CLUSTER;
+
+	return nextcluster;
+}
+
+static int
+fatfs_safe_writefat(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+{
+	int error;
+
+	/* validate cluster */
+	if (!fatfs_isvalid_cluster(pfatfs, cluster))
+		return -1;
+
+	pthread_mutex_lock(&pfatfs->alloc_lock);
+	error = fatfs_load_free_clusters(pfatfs) ||
+		pfatfs->writefat(pfatfs, cluster, value);
+
+	/* keep the free bitmap in sync */
+	if (!error && (value == 0))
+		fatbitmap_set_free(pfatfs, cluster);
+	else if (!error)
+		fatbitmap_set_used(pfatfs, cluster);
+
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+	return error ? -1 : 0;
+}
+
+static fatclus_t
+readfatbuf_12(void *data, size_t size, fatclus_t cluster)
+{
+	uint16_t value;
+	int8_t *d = (int8_t *) data;
+
+	if (((ssize_t) size) < 0)
+		return INVALID_CLUSTER;
+
+	if (cluster + (cluster / 2) > (fatoff_t) size)
+		return INVALID_CLUSTER;
+
+	/* unsigned, an odd entry from 0x800 on must not sign-extend */
+	value = *((uint16_t *)(d + cluster + (cluster / 2)));
+	value = (cluster & 1) ? (value >> 4) : (value & 0xfff);
+	return value;
+}
+
+static fatclus_t
+readfatbuf_16(void *data, size_t size, fatclus_t cluster)
+{
+	uint16_t *d = (uint16_t *) data;
+
+	if (((ssize_t) size) < 0)
+		return INVALID_CLUSTER;
+
+	if ((cluster + 1) * 2 > (fatoff_t) size)
+		return INVALID_CLUSTER;
+
+	return d[cluster];
+}
+
+static fatclus_t
+readfatbuf_32(void *data, size_t size, fatclus_t cluster)
+{
+	int32_t *d = (int32_t *) data;
+
+	if (((ssize_t) size) < 0)
+		return INVALID_CLUSTER;
+
+	if ((cluster + 1) * 4 > (fatoff_t) size)
+		return INVALID_CLUSTER;
+
+	return (d[cluster] & 0x0fffffff);
+}
+
+/* allocate anonymous memory for the fat table, huge pages if possible */
+static void *
+fattable_mmap(size_t *psize, int huge)
+{
+	void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (huge) {
+		size_t hsize = (*psize + FAT_HUGEPAGE_SIZE - 1) &
+			~((size_t) FAT_HUGEPAGE_SIZE - 1);
+
+		ptr = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			*psize = hsize;
+			return ptr;
+		}
+	}
+#endif
+
+	ptr = mmap(NULL, *psize, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	/* transparent huge pages, if the kernel allows */
+	if (huge)
+		madvise(ptr, *psize, MADV_HUGEPAGE);
+#endif
+
+	return ptr;
+}
+
+/* decode one page of the active fat into the table */
+static int
+fattable_load_page(fatfs_t *pfatfs, uint32_t page)
+{
+	struct fattable *ptable = &pfatfs->table;
+	uint32_t first = page * FAT_TABLE_PAGE_ENTRIES;
+	uint32_t count = FAT_TABLE_PAGE_ENTRIES;
+	fatoff_t rawoff, rawsize;
+
+	if (count > ptable->nentries - first)
+		count = ptable->nentries - first;
+
+	/* fat12 entries are 12 bits, a page always starts on an even entry */
+	rawoff = (pfatfs->type == FAT_TYPE_32) ? first * 4 :
+	         (pfatfs->type == FAT_TYPE_16) ? first * 2 : first + (first / 2);
+	rawsize = (pfatfs->type == FAT_TYPE_32) ? count * 4 :
+	          (pfatfs->type == FAT_TYPE_16) ? count * 2 : count + (count / 2) + 1;
+
+	/* entries beyond the fat itself are never free */
+	if (rawsize > pfatfs->fat_size_bytes - rawoff)
+		rawsize = pfatfs->fat_size_bytes - rawoff;
+
+	memset(ptable->rawbuf, 0, FAT_TABLE_PAGE_RAWSIZE);
+	if (rawsize > 0) {
+		if (fatfs_read_from_offset(pfatfs, ptable->rawbuf, (size_t) rawsize,
+		    pfatfs->fat_active_off + rawoff) != (size_t) rawsize)
+			return -1;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		fatclus_t value = pfatfs->readfatbuf(ptable->rawbuf, (size_t) rawsize, i);
+		ptable->map[first + i] = (uint32_t) value;
+	}
+
+	__atomic_store_n(&ptable->loaded[page], 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static fatclus_t
+fattable_readfat(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	struct fattable *ptable = &pfatfs->table;
+	uint32_t page;
+
+	if ((cluster < 0) || ((uint32_t) cluster >= ptable->nentries))
+		return ptable->devreadfat(pfatfs, cluster);
+
+	/* demand load, once */
+	page = (uint32_t) cluster / FAT_TABLE_PAGE_ENTRIES;
+	if (!__atomic_load_n(&ptable->loaded[page], __ATOMIC_ACQUIRE)) {
+		int error;
+
+		pthread_mutex_lock(&ptable->lock);
+		error = !ptable->loaded[page] && fattable_load_page(pfatfs, page);
+		pthread_mutex_unlock(&ptable->lock);
+		if (error)
+			return INVALID_CLUSTER;
+	}
+
+	return (fatclus_t) __atomic_load_n(&ptable->map[cluster],
+	                                   __ATOMIC_RELAXED);
+}
+
+static int
+fattable_writefat(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t value)
+{
+	struct fattable *ptable = &pfatfs->table;
+	uint32_t page;
+
+	if (ptable->devwritefat(pfatfs, cluster, value))
+		return -1;
+
+	if ((cluster < 0) || ((uint32_t) cluster >= ptable->nentries))
+		return 0;
+
+	/* store the value as the fat reader decodes it */
+	page = (uint32_t) cluster / FAT_TABLE_PAGE_ENTRIES;
+	pthread_mutex_lock(&ptable->lock);
+	if (ptable->loaded[page])
+		__atomic_store_n(&ptable->map[cluster],
+		                 (uint32_t) ptable->devreadfat(pfatfs, cluster),
+		                 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ptable->lock);
+
+	return 0;
+}
+
+/* reload entries written to the fat behind the table */
+static void
+fattable_refresh(fatfs_t *pfatfs, fatclus_t first, fatclus_t count)
+{
+	struct fattable *ptable = &pfatfs->table;
+
+	if (!ptable->map)
+		return;
+
+	pthread_mutex_lock(&ptable->lock);
+	for (fatclus_t c = first; c < first + count; c++) {
+		if ((c < 0) || ((uint32_t) c >= ptable->nentries))
+			break;
+		if (ptable->loaded[(uint32_t) c / FAT_TABLE_PAGE_ENTRIES])
+			__atomic_store_n(&ptable->map[c],
+			                 (uint32_t) ptable->devreadfat(pfatfs, c),
+			                 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ptable->lock);
+}
+
+/* keep the active fat decoded in memory, demand loaded on large fat32 */
+static int
+fattable_init(fatfs_t *pfatfs)
+{
+	struct fattable *ptable = &pfatfs->table;
+	uint32_t npages;
+	int paged;
+
+	ptable->nentries = (uint32_t) pfatfs->max_cluster_num + 1;
+	ptable->mapsize = (size_t) ptable->nentries * sizeof(*ptable->map);
+	npages = (ptable->nentries + FAT_TABLE_PAGE_ENTRIES - 1) /
+		FAT_TABLE_PAGE_ENTRIES;
+	paged = (pfatfs->type == FAT_TYPE_32) &&
+		(ptable->mapsize > FAT_TABLE_MAX_SIZE);
+
+	/* untouched pages of a paged table cost no memory */
+	ptable->map = (uint32_t *) fattable_mmap(&ptable->mapsize, !paged);
+	ptable->loaded = calloc(npages, sizeof(*ptable->loaded));
+	ptable->rawbuf = malloc(FAT_TABLE_PAGE_RAWSIZE);
+	if (!ptable->map || !ptable->loaded || !ptable->rawbuf)
+		return -1;
+
+	ptable->devreadfat = pfatfs->readfat;
+	ptable->devwritefat = pfatfs->writefat;
+	pfatfs->readfat = fattable_readfat;
+	pfatfs->writefat = fattable_writefat;
+
+	if (paged)
+		return 0;
+
+	for (uint32_t page = 0; page < npages; page++) {
+		if (fattable_load_page(pfatfs, page))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void
+fattable_free(fatfs_t *pfatfs)
+{
+	struct fattable *ptable = &pfatfs->table;
+
+	if (ptable->map)
+		munmap(ptable->map, ptable->mapsize);
+
+	free(ptable->loaded);
+	free(ptable->rawbuf);
+	memset(ptable, 0, sizeof(*ptable));
+}
+
+static fatoff_t
+fatfs_clus2off(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	return pfatfs->data_start_off + ((cluster - 2) * pfatfs->bytes_per_cluster);
+}
+
+/* take the free count and the next free hint from fsinfo, -1 if they
+   cannot be trusted and the fat must be scanned */
+static int
+fatfs_read_fsinfo(fatfs_t *pfatfs)
+{
+	struct fat_fsinfo fsinfo;
+	uint32_t nclusters = (uint32_t) pfatfs->max_cluster_num - 1;
+
+	if (!pfatfs->fsinfo_off)
+		return -1;
+
+	if (fatfs_read_from_offset(pfatfs, &fsinfo, sizeof(fsinfo),
+	                           pfatfs->fsinfo_off) < sizeof(fsinfo))
+		return -1;
+
+	/* not an fsinfo sector, never written back */
+	if ((fsinfo.lead_sig != FSINFO_LEAD_SIG) ||
+		(fsinfo.struc_sig != FSINFO_STRUC_SIG) ||
+		(fsinfo.trail_sig != FSINFO_TRAIL_SIG)) {
+		pfatfs->fsinfo_off = 0;
+		return -1;
+	}
+
+	pfatfs->fsinfo_free = fsinfo.free_count;
+	pfatfs->fsinfo_next = fsinfo.nxt_free;
+
+	/* unknown or beyond the volume */
+	if ((fsinfo.free_count == FSINFO_UNKNOWN) ||
+		(fsinfo.free_count > nclusters))
+		return -1;
+
+	/* a stale hint points at a used cluster, one fat read tells */
+	if ((fsinfo.nxt_free >= 2) &&
+		(fsinfo.nxt_free <= (uint32_t) pfatfs->max_cluster_num)) {
+		if (fsinfo.free_count &&
+			(pfatfs->readfat(pfatfs, (fatclus_t) fsinfo.nxt_free) != 0))
+			return -1;
+		pfatfs->first_free_cluster = (fatclus_t) fsinfo.nxt_free;
+	} else
+		pfatfs->first_free_cluster = 2;
+
+	pfatfs->num_of_free_clusters = (fatclus_t) fsinfo.free_count;
+	return 0;
+}
+
+/* store the free count and the next free hint, if they changed */
+static int
+fatfs_write_fsinfo(fatfs_t *pfatfs)
+{
+	uint32_t hints[2];
+	int error = 0;
+
+	if (!pfatfs->fsinfo_off)
+		return 0;
+
+	pthread_mutex_lock(&pfatfs->alloc_lock);
+
+	/* unchanged hints stand, else the free count must be exact */
+	if (pfatfs->bitmap.words &&
+		(pfatfs->bitmap.changed || fatbitmap_complete(pfatfs))) {
+		if (fatfs_scan_all(pfatfs)) {
+			pthread_mutex_unlock(&pfatfs->alloc_lock);
+			return -1;
+		}
+
+		hints[0] = (uint32_t) pfatfs->num_of_free_clusters;
+		hints[1] = fatfs_isvalid_cluster(pfatfs, pfatfs->first_free_cluster) ?
+			(uint32_t) pfatfs->first_free_cluster : FSINFO_UNKNOWN;
+
+		if ((hints[0] != pfatfs->fsinfo_free) ||
+			(hints[1] != pfatfs->fsinfo_next)) {
+			if (fatfs_write_to_offset(pfatfs, hints, sizeof(hints),
+			                          pfatfs->fsinfo_off +
+			                          offsetof(struct fat_fsinfo, free_count))
+			    < sizeof(hints))
+				error = -1;
+			else {
+				pfatfs->fsinfo_free = hints[0];
+				pfatfs->fsinfo_next = hints[1];
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+	return error;
+}
+
+/* append a run to the extent map, merging with the last one */
+static int
+fatextmap_push(struct fatextmap *pmap, fatclus_t cluster, fatclus_t length)
+{
+	struct fatextent *plast = pmap->count ? &pmap->extents[pmap->count - 1] :
+		NULL;
+	fatclus_t index = plast ? plast->index + plast->length : 0;
+
+	if (plast && (plast->cluster + plast->length == cluster)) {
+		plast->length += length;
+		return 0;
+	}
+
+	if (pmap->count == pmap->capacity) {
+		size_t capacity = pmap->capacity ? pmap->capacity * 2 : 8;
+		struct fatextent *extents = realloc(pmap->extents,
+		                                    capacity * sizeof(*extents));
+		if (!extents)
+			return -1;
+
+		pmap->extents = extents;
+		pmap->capacity = capacity;
+	}
+
+	pmap->extents[pmap->count].index = index;
+	pmap->extents[pmap->count].cluster = cluster;
+	pmap->extents[pmap->count].length = length;
+	pmap->count++;
+	return 0;
+}
+
+static void
+fatextmap_free(struct fatextmap *pmap)
+{
+	free(pmap->extents);
+	memset(pmap, 0, sizeof(*pmap));
+}
+
+/* record clusters appended to a chain, a map not built yet stays lazy */
+static void
+fatextmap_extend(struct fatextmap *pmap, fatclus_t cluster, fatclus_t length)
+{
+	if (pmap && pmap->built && fatextmap_push(pmap, cluster, length))
+		fatextmap_free(pmap);
+}
+
+/* drop everything from the logical cluster 'nclusters' on */
+static void
+fatextmap_truncate(struct fatextmap *pmap, fatclus_t nclusters)
+{
+	while (pmap->count) {
+		struct fatextent *plast = &pmap->extents[pmap->count - 1];
+
+		if (plast->index >= nclusters)
+			pmap->count--;
+		else {
+			if (plast->index + plast->length > nclusters)
+				plast->length = nclusters - plast->index;
+			break;
+		}
+	}
+}
+
+/* walk the chain once and record its runs */
+static int
+fatextmap_build(fatfs_t *pfatfs, struct fatextmap *pmap, fatclus_t clsinit)
+{
+	fatclus_t cluster = clsinit, first = clsinit, length = 0, total = 0;
+
+	if (pmap->built)
+		return 0;
+
+	pmap->count = 0;
+	while (fatfs_isvalid_cluster(pfatfs, cluster)) {
+		fatclus_t next = fatfs_safe_readfat(pfatfs, cluster);
+
+		/* a chain cannot be longer than the volume */
+		if (++total > pfatfs->max_cluster_num) {
+			fat_errnum = FAT_ERR_LOOP;
+			return -1;
+		}
+
+		length++;
+		if (next != cluster + 1) {
+			if (fatextmap_push(pmap, first, length)) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				return -1;
+			}
+
+			first = next;
+			length = 0;
+		}
+
+		cluster = next;
+	}
+
+	pmap->built = 1;
+	return 0;
+}
+
+/* run holding the logical cluster 'index', binary search */
+static struct fatextent *
+fatextmap_find(struct fatextmap *pmap, fatclus_t index)
+{
+	size_t lo = 0, hi = pmap->count;
+
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+		struct fatextent *pext = &pmap->extents[mid];
+
+		if (index < pext->index)
+			hi = mid;
+		else if (index >= pext->index + pext->length)
+			lo = mid + 1;
+		else
+			return pext;
+	}
+
+	return NULL;
+}
+
+/* physical cluster of the logical cluster 'index' */
+static fatclus_t
+fatextmap_lookup(struct fatextmap *pmap, fatclus_t index)
+{
+	struct fatextent *pext = fatextmap_find(pmap, index);
+
+	if (!pext)
+		return INVALID_CLUSTER;
+
+	return pext->cluster + (index - pext->index);
+}
+
+static int
+fatfs_release_cluster(fatfs_t *pfatfs, fatclus_t cluster)
+{
+	return fatfs_safe_writefat(pfatfs, cluster, 0);
+}
+
+static int
+fatfs_link_cluster(fatfs_t *pfatfs, fatclus_t cluster, fatclus_t clus2link)
+{
+	/* avoid to write an arbitrary value */
+	if (clus2link != END_OF_FILE) {
+		if (!fatfs_isvalid_cluster(pfatfs, clus2link))
+			return -1;
+	}
+
+	return fatfs_safe_writefat(pfatfs, cluster, clus2link);
+}
+
+/* reserve a free run of up to n clusters, contiguous to 'hint' or best fit */
+static fatclus_t
+fatfs_allocate_extent(fatfs_t *pfatfs, fatclus_t hint, fatclus_t n,
+                      fatclus_t *plength)
+{
+	fatclus_t first = INVALID_CLUSTER, length = 0;
+	fatclus_t over = INVALID_CLUSTER, overlen = 0;
+	fatclus_t under = INVALID_CLUSTER, underlen = 0;
+	uint32_t scanned = 0;
+	int ret;
+
+	if (fatbitmap_complete(pfatfs) && (pfatfs->num_of_free_clusters == 0)) {
+		fat_errnum = FAT_ERR_FULLDISK;
+		return INVALID_CLUSTER;
+	}
+
+	/* keep the chain contiguous if possible */
+	if (fatfs_isvalid_cluster(pfatfs, hint)) {
+		if (fatfs_scan_cluster(pfatfs, hint))
+			return INVALID_CLUSTER;
+
+		if (fatbitmap_is_free(pfatfs, hint)) {
+			first = hint;
+			length = fatbitmap_run_length(pfatfs, hint, n);
+			goto _reserve;
+		}
+	}
+
+	/* single clusters follow the next-fit cursor, so appends stay together;
+	   chunks are scanned from the cursor until one has a free cluster */
+	if (n == 1) {
+		if (fatfs_scan_cluster(pfatfs, pfatfs->first_free_cluster))
+			return INVALID_CLUSTER;
+
+		for (;;) {
+			first = fatbitmap_find_next(pfatfs, pfatfs->first_free_cluster);
+			if (first == INVALID_CLUSTER)
+				first = fatbitmap_find_next(pfatfs, 2);
+			if (first != INVALID_CLUSTER)
+				break;
+
+			ret = fatfs_scan_next(pfatfs, pfatfs->first_free_cluster);
+			if (ret <= 0) {
+				if (ret == 0)
+					fat_errnum = FAT_ERR_FULLDISK;
+				return INVALID_CLUSTER;
+			}
+		}
+
+		length = 1;
+		goto _reserve;
+	}
+
+	/* smallest run that fits, or the largest one if none fits; more of
+	   the fat is scanned while no scanned run fits */
+	for (;;) {
+		for (fatclus_t c = fatbitmap_find_next(pfatfs, 2);
+		     (c != INVALID_CLUSTER) && (scanned < FAT_EXTENT_MAX_SCAN);
+		     c = fatbitmap_find_next(pfatfs, c + length + 1), scanned++) {
+			length = fatbitmap_run_length(pfatfs, c, pfatfs->max_cluster_num);
+
+			if (length == n) {
+				over = c;
+				overlen = length;
+				break;
+			}
+
+			if ((length > n) &&
+				((over == INVALID_CLUSTER) || (length < overlen))) {
+				over = c;
+				overlen = length;
+			}
+
+			if ((length < n) && (length > underlen)) {
+				under = c;
+				underlen = length;
+			}
+		}
+
+		if ((over != INVALID_CLUSTER) || (scanned >= FAT_EXTENT_MAX_SCAN))
+			break;
+
+		ret = fatfs_scan_next(pfatfs, pfatfs->first_free_cluster);
+		if (ret < 0)
+			return INVALID_CLUSTER;
+		if (ret == 0)
+			break;
+
+		under = INVALID_CLUSTER;
+		underlen = 0;
+		length = 0;
+		scanned = 0;
+	}
+
+	first = (over != INVALID_CLUSTER) ? over : under;
+	length = (over != INVALID_CLUSTER) ? n : underlen;
+
+	if (first == INVALID_CLUSTER) {
+		fat_errnum = FAT_ERR_FULLDISK;
+		return INVALID_CLUSTER;
+	}
+
+_reserve:
+	for (fatclus_t i = 0; i < length; i++)
+		fatbitmap_set_used(pfatfs, first + i);
+
+	pfatfs->first_free_cluster = first + length;
+	*plength = length;
+	return first;
+}
+
+/* chain 'length' clusters from 'first' and set EOF */
+static int
+fatfs_link_extent(fatfs_t *pfatfs, fatclus_t first, fatclus_t length)
+{
+	uint8_t buf[FAT_EXTENT_BUFSZ];
+	uint32_t width = (pfatfs->type == FAT_TYPE_32) ? 4 : 2;
+	fatclus_t perbuf = (fatclus_t) (sizeof(buf) / width);
+
+	/* fat12 entries share bytes */
+	if (pfatfs->type == FAT_TYPE_12) {
+		for (fatclus_t i = 0; i < length; i++) {
+			if (fatfs_safe_writefat(pfatfs, first + i, (i + 1 < length) ?
+			                        first + i + 1 : END_OF_FILE))
+				return -1;
+		}
+
+		return 0;
+	}
+
+	if (!fatfs_isvalid_cluster(pfatfs, first) ||
+		!fatfs_isvalid_cluster(pfatfs, first + length - 1))
+		return -1;
+
+	for (fatclus_t done = 0; done < length; done += perbuf) {
+		fatclus_t count = (length - done < perbuf) ? length - done : perbuf;
+
+		for (fatclus_t i = 0; i < count; i++) {
+			fatclus_t cluster = first + done + i;
+			uint32_t value = (cluster + 1 < first + length) ?
+				(uint32_t) cluster + 1 : (uint32_t) END_OF_FILE;
+
+			if (width == 4)
+				memcpy(buf + (i * 4), &value, 4);
+			else {
+				uint16_t value16 = (uint16_t) value;
+				memcpy(buf + (i * 2), &value16, 2);
+			}
+		}
+
+		if (fatfs_write_to_offset(pfatfs, buf, count * width,
+		    pfatfs->fat_active_off + ((first + done) * width)) < count * width)
+			return -1;
+
+		fatmirror_mark(pfatfs, (first + done) * width, count * width);
+	}
+
+	fattable_refresh(pfatfs, first, length);
+	return 0;
+}
+
+/* free up to 'count' clusters of the chain starting at 'first' */
+static void
+fatfs_release_chain(fatfs_t *pfatfs, fatclus_t first, fatclus_t count)
+{
+	fatclus_t cluster = first;
+
+	while (count-- && fatfs_isvalid_cluster(pfatfs, cluster)) {
+		fatclus_t next = fatfs_safe_readfat(pfatfs, cluster);
+
+		/* an entry that cannot be cleared stays allocated */
+		if (fatfs_release_cluster(pfatfs, cluster))
+			break;
+		cluster = next;
+	}
+}
+
+/* append n clusters after 'last', or start a chain if 'last' is invalid;
+   on failure the fat, the bitmap and pmap are as they were */
+static fatclus_t
+fatfs_fatchain_extend(fatfs_t *pfatfs, fatclus_t last, fatclus_t n,
+                      struct fatextmap *pmap)
+{
+	fatclus_t first = INVALID_CLUSTER, origlast = last, added = 0, mapped = 0;
+	int32_t errnum;
+
+	/* logical clusters already in the map, to trim it back on failure */
+	if (pmap && pmap->built && pmap->count) {
+		struct fatextent *plast = &pmap->extents[pmap->count - 1];
+		mapped = plast->index + plast->length;
+	}
+
+	/* the search and the fat update are one step for other writers */
+	pthread_mutex_lock(&pfatfs->alloc_lock);
+	if (fatfs_load_free_clusters(pfatfs)) {
+		pthread_mutex_unlock(&pfatfs->alloc_lock);
+		return INVALID_CLUSTER;
+	}
+
+	while (n > 0) {
+		fatclus_t length, extent;
+
+		extent = fatfs_allocate_extent(pfatfs, (last == INVALID_CLUSTER) ?
+		                               INVALID_CLUSTER : last + 1, n, &length);
+		if (extent == INVALID_CLUSTER)
+			goto _rollback;
+
+		if (fatfs_link_extent(pfatfs, extent, length) ||
+			((last != INVALID_CLUSTER) &&
+			 fatfs_link_cluster(pfatfs, last, extent))) {
+			/* not part of the chain yet, give the whole run back */
+			errnum = fat_errnum;
+			for (fatclus_t i = 0; i < length; i++)
+				fatfs_release_cluster(pfatfs, extent + i);
+			fat_errnum = errnum;
+			goto _rollback;
+		}
+
+		if (first == INVALID_CLUSTER)
+			first = extent;
+
+		fatextmap_extend(pmap, extent, length);
+		last = extent + length - 1;
+		added += length;
+		n -= length;
+	}
+
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+	return first;
+
+_rollback:
+	/* the runs linked so far end at 'last', the original end is restored */
+	errnum = fat_errnum;
+	if (first != INVALID_CLUSTER) {
+		if (origlast != INVALID_CLUSTER)
+			fatfs_link_cluster(pfatfs, origlast, END_OF_FILE);
+		fatfs_release_chain(pfatfs, first, added);
+	}
+
+	if (pmap && pmap->built)
+		fatextmap_truncate(pmap, mapped);
+	fat_errnum = errnum;
+
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+	return INVALID_CLUSTER;
+}
+
+/* remember the cluster at 'index' for a later step back */
+static inline void
+fatblock_remember(fatblock_t *pblock, fatoff_t index, fatclus_t cluster)
+{
+	pblock->history[index % FAT_BLOCK_HISTORY] = cluster;
+	pblock->histindex[index % FAT_BLOCK_HISTORY] = index;
+}
+
+/* the cluster at 'index', INVALID_CLUSTER if it was not remembered */
+static inline fatclus_t
+fatblock_recall(fatblock_t *pblock, fatoff_t index)
+{
+	if ((index < 0) || (pblock->histindex[index % FAT_BLOCK_HISTORY] != index))
+		return INVALID_CLUSTER;
+
+	return pblock->history[index % FAT_BLOCK_HISTORY];
+}
+
+static inline void
+fatblock_forget(fatblock_t *pblock)
+{
+	for (int i = 0; i < FAT_BLOCK_HISTORY; i++)
+		pblock->histindex[i] = -1;
+}
+
+/* the clusters of a contiguous run skipped from 'index' */
+static inline void
+fatblock_remember_run(fatblock_t *pblock, fatoff_t index, fatclus_t cluster,
+                      fatoff_t nclus)
+{
+	fatoff_t skip = (nclus > FAT_BLOCK_HISTORY) ? nclus - FAT_BLOCK_HISTORY : 0;
+
+	for (fatoff_t i = skip; i < nclus; i++)
+		fatblock_remember(pblock, index + i, cluster + (fatclus_t) i);
+}
+
+static int
+fatfs_goto_next_block(fatfs_t *pfatfs, fatblock_t *pblock)
+{
+	fatclus_t next = fatfs_safe_readfat(pfatfs, pblock->cluster);
+
+	/* at the end of chain, the block stays on the last cluster */
+	if (next == INVALID_CLUSTER)
+		return -1;
+
+	fatblock_remember(pblock, pblock->index, pblock->cluster);
+	pblock->cluster = next;
+	pblock->curoff = fatfs_clus2off(pfatfs, pblock->cluster);
+	pblock->endoff = pblock->curoff + pfatfs->bytes_per_cluster;
+	pblock->index++;
+	return 0;
+}
+
+/* read a batch of segments, a single submission on io_uring */
+static int
+fatfs_read_segments(fatfs_t *pfatfs, const struct fatseg *segs, size_t count)
+{
+#ifdef FAT_HAVE_URING
+	if (pfatfs->pring && (count > 1) && (pfatfs->direct.fd < 0)) {
+		struct fatdev *pdev = &pfatfs->dev;
+		struct fatseg devsegs[FAT_READ_BATCH];
+		size_t ndev = 0;
+
+		fat_errnum = FAT_ERR_IO;
+
+		/* what the sector cache holds is read from it */
+		for (size_t i = 0; i < count; i++) {
+			if (fatfs_check_bounds(pfatfs, segs[i].nbytes, segs[i].off))
+				return -1;
+
+			if (pfatfs->cache.nentries &&
+				(segs[i].nbytes <= pfatfs->bytes_per_sector)) {
+				if (fatcache_read(pfatfs, segs[i].buf, segs[i].nbytes,
+				                  segs[i].off))
+					return -1;
+				continue;
+			}
+
+			devsegs[ndev] = segs[i];
+			devsegs[ndev++].off += pfatfs->offset;
+		}
+
+		if (ndev && urdev_transfer((struct urdev *) pdev->priv, 0, devsegs,
+		                           ndev))
+			return -1;
+
+		for (size_t i = 0; i < ndev; i++)
+			fatcache_overlay(pfatfs, devsegs[i].buf, devsegs[i].nbytes,
+			                 devsegs[i].off - pfatfs->offset);
+
+		fat_errnum = FAT_ERR_SUCCESS;
+		return 0;
+	}
+#endif
+
+	for (size_t i = 0; i < count; i++) {
+		size_t nread;
+
+		/* file data skips the page cache, metadata reads are small */
+		if ((pfatfs->direct.fd >= 0) &&
+			(segs[i].nbytes > pfatfs->bytes_per_sector))
+			nread = fatfs_read_direct(pfatfs, segs[i].buf, segs[i].nbytes,
+			                          segs[i].off);
+		else
+			nread = fatfs_read_from_offset(pfatfs, segs[i].buf,
+			                               segs[i].nbytes, segs[i].off);
+
+		if (nread != segs[i].nbytes)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* read nbytes from fatblock_t, contiguous clusters are read at once */
+static size_t
+fatfs_read_from_block(fatfs_t *pfatfs, void *buf, size_t nbytes,
+                      fatblock_t *pblock)
+{
+	struct fatseg segs[FAT_READ_BATCH];
+	size_t total_read = 0, queued = 0, count = 0;
+	fatblock_t start;
+	int end = 0;
+
+	memcpy(&start, pblock, sizeof(start));
+	while ((queued < nbytes) && !end) {
+		fatclus_t last = pblock->cluster, next;
+		fatoff_t nclus = 0;
+
+		/* calc current slice */
+		size_t slice_size = pblock->endoff - pblock->curoff;
+
+		/* stretch it over the clusters that follow on disk */
+		while ((slice_size < (nbytes - queued)) &&
+		       (slice_size + pfatfs->bytes_per_cluster <= pfatfs->max_io)) {
+			next = fatfs_safe_readfat(pfatfs, last);
+			if ((next == INVALID_CLUSTER) || (next != last + 1))
+				break;
+
+			slice_size += pfatfs->bytes_per_cluster;
+			last = next;
+			nclus++;
+		}
+
+		if (slice_size > (nbytes - queued))
+			slice_size = (nbytes - queued);
+
+		if (slice_size) {
+			segs[count].buf = (uint8_t *) buf + queued;
+			segs[count].nbytes = slice_size;
+			segs[count].off = pblock->curoff;
+			count++;
+			queued += slice_size;
+		}
+
+		/* inc offset, the run is contiguous */
+		pblock->curoff += slice_size;
+		if (nclus) {
+			fatblock_remember_run(pblock, pblock->index, pblock->cluster, nclus);
+			pblock->cluster = last;
+			pblock->index += nclus;
+			pblock->endoff = fatfs_clus2off(pfatfs, last) +
+				pfatfs->bytes_per_cluster;
+		}
+
+		/* if necessary, goto next block */
+		if (pblock->curoff == pblock->endoff) {
+			if (fatfs_goto_next_block(pfatfs, pblock) < 0)
+				end = 1;
+		}
+
+		/* read */
+		if ((count == FAT_READ_BATCH) || (queued == nbytes) || end) {
+			if (fatfs_read_segments(pfatfs, segs, count)) {
+				/* the block stays where the data stops */
+				memcpy(pblock, &start, sizeof(start));
+				break;
+			}
+
+			total_read = queued;
+			memcpy(&start, pblock, sizeof(start));
+			count = 0;
+		}
+	}
+
+	return total_read;
+}
+
+/* move to the next block, allocating clusters for nbytes if at the end */
+static inline int
+fatfs_advance_block(fatfs_t *pfatfs, fatblock_t *pblock, size_t nbytes,
+                    struct fatextmap *pmap)
+{
+	fatclus_t current = pblock->cluster;
+
+	/* go to next block */
+	if (fatfs_goto_next_block(pfatfs, pblock) < 0) {
+		/* if no more blocks, allocate all the write needs */
+		fatclus_t n = (fatclus_t) ((nbytes + pfatfs->bytes_per_cluster - 1) /
+			pfatfs->bytes_per_cluster);
+		if (fatfs_fatchain_extend(pfatfs, current, n, pmap) == INVALID_CLUSTER)
+			return -1;
+
+		/* go to new block */
+		if (fatfs_goto_next_block(pfatfs, pblock) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* write nbytes to fatblock_t, pmap (may be NULL) follows chain growth */
+static size_t
+fatfs_write_to_block(fatfs_t *pfatfs, void *buf, size_t nbytes,
+                     fatblock_t *pblock, struct fatextmap *pmap)
+{
+	size_t total_write = 0, nwrite;
+
+	while ((total_write < nbytes)) {
+		fatclus_t last, next;
+		fatoff_t nclus = 0;
+
+		/* no more bytes in this block  */
+		if (pblock->curoff == pblock->endoff) {
+			if (fatfs_advance_block(pfatfs, pblock, nbytes - total_write,
+			                        pmap))
+				break;
+		}
+
+		/* calc current slice */
+		size_t slice_size = pblock->endoff - pblock->curoff;
+
+		/* stretch it over the clusters that follow on disk */
+		last = pblock->cluster;
+		while ((slice_size < (nbytes - total_write)) &&
+		       (slice_size + pfatfs->bytes_per_cluster <= pfatfs->max_io)) {
+			next = fatfs_safe_readfat(pfatfs, last);
+			if ((next == INVALID_CLUSTER) || (next != last + 1))
+				break;
+
+			slice_size += pfatfs->bytes_per_cluster;
+			last = next;
+			nclus++;
+		}
+
+		if (slice_size > (nbytes - total_write))
+			slice_size = (nbytes - total_write);
+
+		/* write */
+		nwrite = fatfs_write_data(pfatfs, (char *)buf + total_write,
+		                          slice_size, pblock->curoff);
+
+		total_write += nwrite;
+		if (fat_errnum)
+			break;
+
+		/* inc offset, the run is contiguous */
+		pblock->curoff += nwrite;
+		if (nclus) {
+			fatblock_remember_run(pblock, pblock->index, pblock->cluster, nclus);
+			pblock->cluster = last;
+			pblock->index += nclus;
+			pblock->endoff = fatfs_clus2off(pfatfs, last) +
+				pfatfs->bytes_per_cluster;
+		}
+	}
+
+	return total_write;
+}
+
+/* read privdirent from fatblock_t */
+static int
+privdirent_read_from_block(fatfs_t *pfatfs, struct privdirent *pprivdir,
+                           fatblock_t *pblock)
+{
+	size_t size = sizeof(*pprivdir);
+	if (fatfs_read_from_block(pfatfs, pprivdir, size, pblock) != size)
+		return -1;
+
+	return 0;
+}
+
+/* directory sectors go through the sector cache one by one, so the next
+   lookup finds them there */
+static int
+fatdirbuf_fill(fatfs_t *pfatfs, uint8_t *buf, size_t nbytes, fatoff_t offset)
+{
+	uint32_t bps = pfatfs->bytes_per_sector;
+
+	while (nbytes) {
+		size_t slice = (pfatfs->cache.nentries) ?
+			bps - (size_t) (offset % bps) : nbytes;
+
+		if (slice > nbytes)
+			slice = nbytes;
+
+		if (fatfs_read_from_offset(pfatfs, buf, slice, offset) != slice)
+			return -1;
+
+		buf += slice;
+		nbytes -= slice;
+		offset += slice;
+	}
+
+	return 0;
+}
+
+/* read privdirent through the directory buffer, which is refilled when
+   the block leaves it or an entry changed */
+static int
+fatdirbuf_read(fatfs_t *pfatfs, struct fatdirbuf *pbuf,
+               struct privdirent *pprivdir, fatblock_t *pblock)
+{
+	uint32_t dirgen = __atomic_load_n(&pfatfs->dirgen, __ATOMIC_ACQUIRE);
+	size_t size = sizeof(*pprivdir);
+
+	if (!pbuf || !pbuf->data)
+		return privdirent_read_from_block(pfatfs, pprivdir, pblock);
+
+	/* the entry starts the next cluster */
+	if ((pblock->curoff == pblock->endoff) &&
+		(fatfs_goto_next_block(pfatfs, pblock) < 0))
+		return -1;
+
+	if (!pbuf->len || (pbuf->dirgen != dirgen) ||
+		(pblock->curoff < pbuf->start) ||
+		(pblock->curoff + (fatoff_t) size > pbuf->start + (fatoff_t) pbuf->len)) {
+		size_t len = (size_t) (pblock->endoff - pblock->curoff);
+
+		if (len > pbuf->size)
+			len = pbuf->size;
+
+		pbuf->len = 0;
+		if ((len < size) ||
+			fatdirbuf_fill(pfatfs, pbuf->data, len, pblock->curoff))
+			return -1;
+
+		pbuf->start = pblock->curoff;
+		pbuf->len = len;
+		pbuf->dirgen = dirgen;
+	}
+
+	memcpy(pprivdir, pbuf->data + (pblock->curoff - pbuf->start), size);
+	pblock->curoff += size;
+	return 0;
+}
+
+static void
+fatfs_fatblock_init(fatfs_t *pfatfs, fatblock_t *pblock, fatclus_t clsfirst)
+{
+	pblock->curoff = fatfs_clus2off(pfatfs, clsfirst);
+	pblock->endoff = pblock->curoff + pfatfs->bytes_per_cluster;
+	pblock->cluster = clsfirst;
+	pblock->clsinit = clsfirst;
+	pblock->index = 0;
+	fatblock_forget(pblock);
+}
+
+static inline fatoff_t
+fatfs_block_get_startoff(fatfs_t *pfatfs, fatblock_t *pblock)
+{
+	fatoff_t startoff = pblock->endoff - pfatfs->bytes_per_cluster;
+
+	/* root directory for fat12/16 */
+	if ((pblock->cluster == INVALID_CLUSTER) &&
+		(pblock->index == 0)) {
+		startoff = pfatfs->fat_first_off;
+		startoff += pfatfs->fat_num * pfatfs->fat_size_bytes;
+	}
+
+	return startoff;
+}
+
+static int
+fatfs_decrement_block_offset(fatfs_t *pfatfs, fatblock_t *pblock, fatoff_t off)
+{
+	fatoff_t startoff = fatfs_block_get_startoff(pfatfs, pblock);
+
+	/* max decrement is one block */
+	if (off > pfatfs->bytes_per_cluster)
+		return -1;
+	/* if block is on chain, initial cluster must be valid */
+	if (pblock->clsinit != INVALID_CLUSTER) {
+		if (!fatfs_isvalid_cluster(pfatfs, pblock->clsinit))
+			return -1;
+	}
+
+	/* offset in the previous block */
+	if ((pblock->curoff - off) < startoff) {
+		if (pblock->index == 0)
+			return -1;
+
+		/* the previous cluster is remembered, else walk the chain */
+		fatclus_t clsnum = fatblock_recall(pblock, pblock->index - 1);
+		if (!fatfs_isvalid_cluster(pfatfs, clsnum)) {
+			clsnum = pblock->clsinit;
+			for (fatoff_t i = 0; i < pblock->index - 1; i++) {
+				clsnum = fatfs_safe_readfat(pfatfs, clsnum);
+				if (clsnum == INVALID_CLUSTER)
+					return -1;
+			}
+		}
+
+		off += startoff - pblock->curoff;
+
+		/* update block */
+		pblock->index--;
+		pblock->cluster = clsnum;
+		pblock->endoff = fatfs_clus2off(pfatfs, clsnum);
+		pblock->endoff += pfatfs->bytes_per_cluster;
+		pblock->curoff = pblock->endoff;
+	}
+
+	pblock->curoff -= off;
+	return 0;
+}
+
+/* write privdirent to fatblock_t */
+/*
+static int
+privdirent_write_to_block(fatfs_t *pfatfs, struct privdirent *pprivdir,
+                          fatblock_t *pblock)
+{
+	size_t size = sizeof(*pprivdir);
+	if (fatfs_write_to_block(pfatfs, pprivdir, size, pblock, NULL) != size)
+		return -1;
+
+	return 0;
+}
+*/
+
+static int
+check_cyclic_fat(fatfs_t *pfatfs, fatclus_t first_cluster)
+{
+	fatblock_t block;
+	fatclus_t saved_cluster = 0;
+
+	fatfs_fatblock_init(pfatfs, &block, first_cluster);
+
+	/* follow every cluster number in the FAT chain */
+	for (fatclus_t i = 0; i <= pfatfs->max_cluster_num; i++) {
+		/* if some cluster number repeat, this is a cyclic chain */
+		if (block.cluster == saved_cluster)
+			return 1;
+
+		/* from time to time save the current cluster */
+		if (!(i & 0xff))
+			saved_cluster = block.cluster;
+
+		/* goto next */
+		if (fatfs_goto_next_block(pfatfs, &block) < 0)
+			return 0;
+	}
+
+	/* no end-of-file means cyclic chain */
+	return 1;
+}
+
+/* long name gathered from the slots that precede a short entry */
+struct fatlfn {
+	uint8_t ord;     /* ordinal of the last slot stored, 0 if none */
+	uint8_t chksum;
+	wchar_t name[FAT_MAX_NAME + 1];
+};
+
+static uint8_t
+privdirent_chksum(const uint8_t *name_8dot3)
+{
+	uint8_t sum = 0;
+
+	for (int i = 0; i < 11; i++)
+		sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + name_8dot3[i]);
+
+	return sum;
+}
+
+/* slots come last first, each one must follow the previous one */
+static void
+fatlfn_push(struct fatlfn *plfn, struct privdirent *pprivdir)
+{
+	uint8_t ord = pprivdir->type.lfn.ordinal & (~0x40);
+	wchar_t *pwsz;
+
+	if (!ord || (ord > FAT_MAX_NAME / 13)) {
+		plfn->ord = 0;
+		return;
+	}
+
+	/* first slot of a name */
+	if (pprivdir->type.lfn.ordinal & 0x40) {
+		memset(plfn->name, 0, sizeof(plfn->name));
+		plfn->chksum = pprivdir->type.lfn.chksum;
+	} else if ((ord + 1 != plfn->ord) ||
+		(pprivdir->type.lfn.chksum != plfn->chksum)) {
+		plfn->ord = 0;
+		return;
+	}
+
+	/* copy lfn */
+	pwsz = &plfn->name[(ord - 1) * 13];
+	for (size_t i = 0; i < PRIVDIR_LFN_NAME1; i++)
+		*pwsz++ = (wchar_t) pprivdir->type.lfn.name1[i];
+	for (size_t i = 0; i < PRIVDIR_LFN_NAME2; i++)
+		*pwsz++ = (wchar_t) pprivdir->type.lfn.name2[i];
+	for (size_t i = 0; i < PRIVDIR_LFN_NAME3; i++)
+		*pwsz++ = (wchar_t) pprivdir->type.lfn.name3[i];
+
+	plfn->ord = ord;
+}
+
+/* the name is whole and belongs to the short entry */
+static inline int
+fatlfn_match(struct fatlfn *plfn, struct privdirent *pprivdir)
+{
+	return (plfn->ord == 1) &&
+		(plfn->chksum == privdirent_chksum(pprivdir->type.gen.name_8dot3));
+}
+
+static inline void
+fatdirent_load_lfn_from_8dot3(struct fatdirent *pdirent,
+                              struct privdirent *pprivdir)
+{
+	memset(pdirent->d_name, 0, sizeof(pdirent->d_name));
+	wchar_t *pwsz = &pdirent->d_name[0];
+
+	/* copy name */
+	for (int i = 0; i < 8; i++) {
+		if (pprivdir->type.gen.name_8dot3[i] == ' ')
+			break;
+		*pwsz = (wchar_t) pprivdir->type.gen.name_8dot3[i];
+		pwsz++;
+	}
+
+	/* copy ext */
+	if (pprivdir->type.gen.name_8dot3[8] != ' ') {
+		*pwsz = (wchar_t) '.';
+		pwsz++;
+
+		for (int i = 8; i < 11; i++) {
+			if (pprivdir->type.gen.name_8dot3[i] == ' ')
+				break;
+			*pwsz = pprivdir->type.gen.name_8dot3[i];
+			pwsz++;
+		}
+	}
+}
+
+/* read fatdirent from fatblock_t */
+static int
+fatdirent_read_from_block(fatfs_t *pfatfs, struct fatdirent *pdirent,
+                          fatblock_t *pblock, struct fatdirbuf *pbuf)
+{
+	fatblock_t block;
+	struct privdirent privdir;
+	struct fatlfn lfn;
+	fatclus_t first_cluster = 0;
+
+	memset(&privdir, 0, sizeof(privdir));
+	lfn.ord = 0;
+
+	/* one pass, long name slots are gathered on the way */
+	while (1) {
+		/* read next entry */
+		if (fatdirbuf_read(pfatfs, pbuf, &privdir, pblock))
+			return -1;
+
+		first_cluster = ((privdir.type.gen.first_cluster_high << 16) |
+			privdir.type.gen.first_cluster_low);
+
+		/* no more entries */
+		if (privdir.type.gen.name_8dot3[0] == 0x00)
+			return -1;
+
+		/* skip deleted entry */
+		if (privdir.type.gen.name_8dot3[0] == 0xe5) {
+			lfn.ord = 0;
+			continue;
+		}
+
+		/* long name slot */
+		if (privdir.type.lfn.attribute == FAT_ATTR_LONG_NAME) {
+			fatlfn_push(&lfn, &privdir);
+			continue;
+		}
+
+		/* skip invalid */
+		if (!fatfs_isvalid_cluster(pfatfs, first_cluster)) {
+			/* empty files may have an invalid cluster number */
+			if ((privdir.type.gen.file_size == 0) &&
+				(privdir.type.gen.attribute & FAT_ATTR_ARCHIVE))
+				break;
+
+			lfn.ord = 0;
+			continue;
+		}
+
+		/* file */
+		if (privdir.type.gen.attribute & FAT_ATTR_ARCHIVE)
+			break;
+
+		/* directory */
+		if (privdir.type.gen.attribute & FAT_ATTR_DIRECTORY)
+			break;
+
+		lfn.ord = 0;
+	}
+
+	/* copy block before decrement */
+	memcpy(&block, pblock, sizeof(fatblock_t));
+	if (fatfs_decrement_block_offset(pfatfs, &block, 32))
+		return -1;
+
+	pdirent->d_privoff = block.curoff;
+	pdirent->d_cluster = first_cluster;
+	pdirent->d_size = privdir.type.gen.file_size;
+	pdirent->d_type = (privdir.type.gen.attribute & FAT_ATTR_DIRECTORY) ?
+		FAT_TYPE_DIRECTORY : FAT_TYPE_ARCHIVE;
+
+	/* long name, '.' and '..' have none */
+	if (memcmp(privdir.type.gen.name_8dot3, ". ", 2) &&
+		memcmp(privdir.type.gen.name_8dot3, ".. ", 3) &&
+		fatlfn_match(&lfn, &privdir)) {
+		memcpy(pdirent->d_name, lfn.name, sizeof(pdirent->d_name));
+		return 0;
+	}
+
+	/* use 8dot3 */
+	fatdirent_load_lfn_from_8dot3(pdirent, &privdir);
+	return 0;
+}
+
+static int
+fatdirent_find_entry(fatfs_t *pfatfs, struct fatdirent *pdirent,
+                     fatblock_t *pblock,
+                     const wchar_t *pwszname)
+{
+	/* search every entry from fatblock_t */
+	while (!fatdirent_read_from_block(pfatfs, pdirent, pblock, NULL)) {
+		/* compare name */
+		if (!wcsncmp(pdirent->d_name, pwszname, sizeof(pdirent->d_name))) {
+			/* entry found, check the fat chain */
+			if (check_cyclic_fat(pfatfs, pdirent->d_cluster)) {
+				fat_errnum = FAT_ERR_LOOP;
+				return -1;
+			}
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void
+split_path(wchar_t *path, wchar_t **ppdir, wchar_t **ppfile)
+{
+	wchar_t *dirpart, *filepart;
+
+	/* find the last slash */
+	dirpart = path;
+	filepart = path + wcslen(path) - 1;
+	while (filepart > dirpart) {
+		if (*filepart == (wchar_t) '/') {
+			*filepart = (wchar_t) '\0';
+			filepart++;
+			break;
+		}
+
+		filepart--;
+	}
+
+	/* filename on root directory */
+	if (dirpart == filepart) {
+		dirpart = L"/";
+		if (*filepart == (wchar_t) '/')
+			filepart++;
+	}
+
+	*ppdir = dirpart;
+	*ppfile = (*filepart) ? (filepart) : NULL;
+}
+
+static void
+fatfs_set_label_from_char(fatfs_t *pfatfs, char *label)
+{
+	pfatfs->label = calloc(1, (strlen(label) + 1) * sizeof(wchar_t));
+	for (size_t i = 0; i < strlen(label); i++)
+		pfatfs->label[i] = (wchar_t) label[i];
+}
+
+static inline void
+remove_trailing_spaces_char(char *s)
+{
+	char *p = s + strlen(s) - 1;
+
+	while (p > s) {
+		if (p[0] != ' ')
+			break;
+		p[0] = '\0';
+		p--;
+	}
+}
+
+static int
+fatfs_parse_bpb(fatfs_t *pfatfs)
+{
+	struct fat_bpb bpb;
+	fatoff_t devsize;
+	char label[12];
+
+	memset(label, 0, sizeof(label));
+
+	/* read bpb */
+	if (pfatfs->dev.read_at(pfatfs->dev.priv, &bpb, sizeof(bpb),
+	                        pfatfs->offset))
+		return -1;
+
+	/* check */
+	if ((bpb.bytes_per_sector != 512)
+		&& (bpb.bytes_per_sector != 1024)
+		&& (bpb.bytes_per_sector != 2048)
+		&& (bpb.bytes_per_sector != 4096))
+		return -1;
+
+	/* invalid value */
+	if (!bpb.sectors_per_cluster)
+		return -1;
+	/* invalid value */
+	if ((bpb.num_root_entries * 32) % bpb.bytes_per_sector)
+		return -1;
+	/* max count when fat mirroring is disabled */
+	if (bpb.num_fats > 0xf)
+		return -1;
+	/* one of these must be set */
+	if(!bpb.num_total_sectors_16 && !bpb.num_total_sectors_32)
+		return -1;
+
+	pfatfs->bytes_per_sector = bpb.bytes_per_sector;
+	pfatfs->bytes_per_cluster = bpb.bytes_per_sector * bpb.sectors_per_cluster;
+	pfatfs->volsize = (bpb.num_total_sectors_16) ? bpb.num_total_sectors_16 :
+		bpb.num_total_sectors_32;
+	pfatfs->volsize *= bpb.bytes_per_sector;
+
+	/* check volsize */
+	if ((pfatfs->offset + pfatfs->volsize) < 0)
+		return -1;
+
+	/* volume must fit in the device, if its size is known */
+	devsize = (pfatfs->dev.size) ? pfatfs->dev.size(pfatfs->dev.priv) : -1;
+	if ((devsize > 0) && ((pfatfs->offset + pfatfs->volsize) > devsize))
+		return -1;
+
+	/* offset to first fat */
+	pfatfs->fat_first_off = bpb.num_reserved_sectors * bpb.bytes_per_sector;
+	pfatfs->fat_active_off = pfatfs->fat_first_off;
+	pfatfs->fat_num = bpb.num_fats;
+
+	/* fat32 */
+	if (!bpb.sectors_per_fat_16) {
+		pfatfs->type = FAT_TYPE_32;
+		pfatfs->writefat = fatfs_write_fat32;
+		pfatfs->readfat = fatfs_read_fat32;
+		pfatfs->readfatbuf = readfatbuf_32;
+
+		pfatfs->fat_size_bytes = bpb.specific.fat_32.sectors_per_fat_32 *
+			bpb.bytes_per_sector;
+		pfatfs->data_start_off = pfatfs->fat_first_off + (pfatfs->fat_num *
+			pfatfs->fat_size_bytes);
+
+		/* support fat32 without mirroring */
+		if (bpb.specific.fat_32.extended_flags & 0x80) {
+			if ((bpb.specific.fat_32.extended_flags & 0xf) >= bpb.num_fats)
+				return -1;
+			/* adjust active fat */
+			pfatfs->fat_active_off += pfatfs->fat_size_bytes *
+				(bpb.specific.fat_32.extended_flags & 0xf);
+			pfatfs->fat_nomirror = 1;
+		}
+
+		pfatfs->max_cluster_num = ((pfatfs->volsize - pfatfs->data_start_off) /
+			pfatfs->bytes_per_cluster) + 1;
+
+		/* validate root dir cluster */
+		if (((fatclus_t)bpb.specific.fat_32.root_cluster < 2) ||
+			((fatclus_t)bpb.specific.fat_32.root_cluster > pfatfs->max_cluster_num))
+			return -1;
+
+		/* check the fat chain (root) */
+		if (check_cyclic_fat(pfatfs, bpb.specific.fat_32.root_cluster)) {
+			fat_errnum = FAT_ERR_LOOP;
+			return -1;
+		}
+
+		fatfs_fatblock_init(pfatfs, &pfatfs->root_block,
+		                    bpb.specific.fat_32.root_cluster);
+
+		/* fsinfo lives in the reserved region, 0 or 0xffff if absent */
+		if ((bpb.specific.fat_32.fs_info > 0) &&
+			(bpb.specific.fat_32.fs_info < bpb.num_reserved_sectors))
+			pfatfs->fsinfo_off = (fatoff_t) bpb.specific.fat_32.fs_info *
+				bpb.bytes_per_sector;
+
+		memcpy(label, bpb.specific.fat_32.label, sizeof(label) - 1);
+
+	/* fat12, 16 */
+	} else {
+		pfatfs->type = FAT_TYPE_12;
+		pfatfs->writefat = fatfs_write_fat12;
+		pfatfs->readfat = fatfs_read_fat12;
+		pfatfs->readfatbuf = readfatbuf_12;
+
+		/* only case where the block is outside the file allocation table */
+		pfatfs->fat_size_bytes = bpb.sectors_per_fat_16 * bpb.bytes_per_sector;
+		pfatfs->root_block.cluster = INVALID_CLUSTER;
+		pfatfs->root_block.clsinit = INVALID_CLUSTER;
+		pfatfs->root_block.curoff = pfatfs->fat_first_off  +
+			(pfatfs->fat_num * pfatfs->fat_size_bytes);
+		pfatfs->root_block.endoff = pfatfs->root_block.curoff +
+			bpb.num_root_entries * 32;
+		pfatfs->root_block.index = 0;
+		pfatfs->data_start_off = pfatfs->root_block.endoff;
+
+		/* validate root dir offset */
+		if ((pfatfs->root_block.curoff > pfatfs->volsize) ||
+			(pfatfs->root_block.endoff >= pfatfs->volsize))
+			return -1;
+
+		pfatfs->max_cluster_num = ((pfatfs->volsize - pfatfs->data_start_off) /
+			pfatfs->bytes_per_cluster) + 1;
+
+		if (pfatfs->max_cluster_num > 4085) {
+			pfatfs->type = FAT_TYPE_16;
+			pfatfs->writefat = fatfs_write_fat16;
+			pfatfs->readfat = fatfs_read_fat16;
+			pfatfs->readfatbuf = readfatbuf_16;
+		}
+
+		memcpy(label, bpb.specific.fat_12_16.label, sizeof(label) - 1);
+	}
+
+	pfatfs->label = 0;
+	remove_trailing_spaces_char(label);
+	fatfs_set_label_from_char(pfatfs, label);
+	return 0;
+}
+
+int
+fat_mount(fatfs_t **ppfatfs, const char *filename, fatoff_t offset)
+{
+	return fat_mount_opt(ppfatfs, filename, offset, NULL);
+}
+
+int
+fat_mount_opt(fatfs_t **ppfatfs, const char *filename, fatoff_t offset,
+              const struct fatmntopt *popt)
+{
+	int fd, errnum;
+	uint32_t flags = (popt) ? popt->flags : 0;
+	struct fddev *pfddev;
+	struct fatdev dev;
+
+	/* sanity check */
+	if (!ppfatfs || !filename || (offset < 0))
+		return FAT_ERR_INVAL;
+
+	/* mmap is only supported on read-only volumes */
+	if ((flags & FAT_MOUNT_MMAP) && !(flags & FAT_MOUNT_RDONLY))
+		return FAT_ERR_INVAL;
+
+	/* open file */
+	fd = open(filename, (flags & FAT_MOUNT_RDONLY) ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		if (errno == EACCES)
+			return FAT_ERR_ACCESS;
+
+		else if (errno == EBUSY)
+			return FAT_ERR_DEVBUSY;
+
+		return FAT_ERR_IO;
+	}
+
+	/* map the image, the mapping outlives the descriptor */
+	if (flags & FAT_MOUNT_MMAP) {
+		errnum = mmdev_init(&dev, fd, offset);
+		close(fd);
+		if (errnum)
+			return errnum;
+
+		/* on error, the device is released by fat_mount_dev */
+		return fat_mount_dev(ppfatfs, &dev, offset, popt);
+
+#ifdef FAT_HAVE_URING
+	/* io_uring device, pread/pwrite if the kernel refuses it */
+	} else if ((flags & FAT_MOUNT_URING) && !urdev_init(&dev, fd)) {
+		errnum = fat_mount_dev(ppfatfs, &dev, offset, popt);
+		if (errnum)
+			return errnum;
+
+		(*ppfatfs)->pring = &((struct urdev *) dev.priv)->ring;
+		(*ppfatfs)->fd = fd;
+#endif
+
+	/* alloc default device */
+	} else {
+		pfddev = (struct fddev *) calloc(1, sizeof(*pfddev));
+		if (!pfddev) {
+			close(fd);
+			return FAT_ERR_ENOMEM;
+		}
+
+		fddev_init(&dev, pfddev, fd);
+		errnum = fat_mount_dev(ppfatfs, &dev, offset, popt);
+		if (errnum)
+			return errnum;
+
+		(*ppfatfs)->fd = fd;
+	}
+
+	/* file data on a second descriptor, around the page cache */
+	if (flags & FAT_MOUNT_DIRECT)
+		fatdirect_init(*ppfatfs, filename);
+
+	return FAT_ERR_SUCCESS;
+}
+
+int
+fat_mount_dev(fatfs_t **ppfatfs, const struct fatdev *pdev, fatoff_t offset,
+              const struct fatmntopt *popt)
+{
+	int errnum;
+	fatfs_t *pfatfs;
+	uint32_t flags = (popt) ? popt->flags : 0;
+
+	/* sanity check */
+	if (!ppfatfs || !pdev || !pdev->read_at || (offset < 0) ||
+		(!pdev->write_at && !(flags & FAT_MOUNT_RDONLY)) ||
+		(popt && (popt->scan > FAT_SCAN_AVX2))) {
+		if (pdev && pdev->close)
+			pdev->close(pdev->priv);
+		return FAT_ERR_INVAL;
+	}
+
+	/* alloc new fatfs */
+	pfatfs = (fatfs_t *) calloc(1, sizeof(fatfs_t));
+	if (!pfatfs) {
+		if (pdev->close)
+			pdev->close(pdev->priv);
+		return FAT_ERR_ENOMEM;
+	}
+
+	memcpy(&pfatfs->dev, pdev, sizeof(pfatfs->dev));
+	pthread_rwlock_init(&pfatfs->lock, NULL);
+	fat_mutex_init(&pfatfs->alloc_lock);
+	fat_mutex_init(&pfatfs->aio_lock);
+	fat_mutex_init(&pfatfs->cache.lock);
+	fat_mutex_init(&pfatfs->table.lock);
+	fat_mutex_init(&pfatfs->direct.lock);
+	pfatfs->aio_donetail = &pfatfs->aio_done;
+	pfatfs->direct.fd = -1;
+	pfatfs->fd = -1;
+	pfatfs->offset = offset;
+	pfatfs->flags = flags;
+	pfatfs->max_io = (popt && popt->max_io) ? popt->max_io : FAT_MAX_IO_DEFAULT;
+	pfatfs->scan = (popt) ? popt->scan : FAT_SCAN_AUTO;
+	pfatfs->ra_max = (popt && popt->readahead) ? popt->readahead :
+		FAT_READAHEAD_MAX;
+
+	/* parse bpb */
+	if (fatfs_parse_bpb(pfatfs)) {
+		errnum = (fat_errnum) ? fat_errnum : FAT_ERR_NOTFATFS;
+		fat_umount(pfatfs);
+		return errnum;
+	}
+
+	/* sector cache */
+	if (!(flags & FAT_MOUNT_NOCACHE)) {
+		if (fatcache_init(pfatfs, (popt && popt->cache_size) ?
+		                  popt->cache_size : FAT_CACHE_DEFAULT_SIZE,
+		                  (popt) ? popt->dirty_max : 0)) {
+			fat_umount(pfatfs);
+			return FAT_ERR_ENOMEM;
+		}
+	}
+
+	/* fat table */
+	if (flags & FAT_MOUNT_FATTABLE) {
+		if (fattable_init(pfatfs)) {
+			errnum = (fat_errnum) ? fat_errnum : FAT_ERR_ENOMEM;
+			fat_umount(pfatfs);
+			return errnum;
+		}
+	}
+
+	/* other fats follow the active one at sync */
+	if (!(flags & FAT_MOUNT_RDONLY) && fatmirror_init(pfatfs)) {
+		fat_umount(pfatfs);
+		return FAT_ERR_ENOMEM;
+	}
+
+	/* free clusters, counted on demand unless fat32 fsinfo has them */
+	if ((flags & FAT_MOUNT_FULLSCAN) ? fatfs_find_free_clusters(pfatfs) :
+		(fatfs_read_fsinfo(pfatfs) && fatbitmap_init(pfatfs))) {
+		errnum = fat_errnum;
+		fat_umount(pfatfs);
+		return errnum;
+	}
+
+	*ppfatfs = pfatfs;
+	return FAT_ERR_SUCCESS;
+}
+
+/* report every pending transfer */
+static int
+fatfs_aio_drain(fatfs_t *pfatfs)
+{
+	while (__atomic_load_n(&pfatfs->aio_count, __ATOMIC_ACQUIRE)) {
+		if (fat_aio_poll(pfatfs, 1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void
+fat_umount(fatfs_t *pfatfs)
+{
+	if (pfatfs) {
+		fatfs_aio_drain(pfatfs);
+		if (!(pfatfs->flags & FAT_MOUNT_RDONLY))
+			fat_sync(pfatfs);
+		if (pfatfs->dev.close)
+			pfatfs->dev.close(pfatfs->dev.priv);
+		pthread_mutex_destroy(&pfatfs->cache.lock);
+		pthread_mutex_destroy(&pfatfs->table.lock);
+		pthread_mutex_destroy(&pfatfs->direct.lock);
+		pthread_mutex_destroy(&pfatfs->aio_lock);
+		pthread_mutex_destroy(&pfatfs->alloc_lock);
+		pthread_rwlock_destroy(&pfatfs->lock);
+		fatcache_free(pfatfs);
+		fatdirect_free(&pfatfs->direct);
+		fattable_free(pfatfs);
+		free(pfatfs->mirror.dirty);
+		fatbitmap_free(pfatfs);
+		free(pfatfs->label);
+		free(pfatfs);
+	}
+}
+
+int
+fat_sync(fatfs_t *pfatfs)
+{
+	int error = 0;
+
+	if (!pfatfs)
+		return -1;
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (pfatfs->flags & FAT_MOUNT_RDONLY)
+		return 0;
+
+	/* data in flight, metadata, then the device itself */
+	if (fatfs_aio_drain(pfatfs))
+		error = -1;
+
+	fatfs_lock(pfatfs, 0);
+	if (error || fatfs_write_fsinfo(pfatfs) || fatmirror_flush(pfatfs) ||
+		fatcache_flush(pfatfs) ||
+		(pfatfs->dev.flush && pfatfs->dev.flush(pfatfs->dev.priv))) {
+		fat_errnum = FAT_ERR_IO;
+		error = -1;
+	}
+	fatfs_unlock(pfatfs);
+
+	return error;
+}
+
+wchar_t *
+fat_getlabel(fatfs_t *pfatfs)
+{
+	return (pfatfs) ? (pfatfs->label) : NULL;
+}
+
+int
+fat_error(fatfs_t *pfatfs)
+{
+	return (pfatfs) ? fat_errnum : 0;
+}
+
+int
+fat_cachestat(fatfs_t *pfatfs, struct fatcachestat *pstat)
+{
+	if (!pfatfs)
+		return -1;
+
+	if (!pstat) {
+		fat_errnum = FAT_ERR_INVAL;
+		return -1;
+	}
+
+	pstat->hits = 0;
+	pstat->misses = 0;
+	for (uint32_t i = 0; pfatfs->cache.nentries && (i < FAT_CACHE_SLOTS);
+	     i++) {
+		struct fatcache_count *pcount = &pfatfs->cache.counts[i];
+
+		pstat->hits += __atomic_load_n(&pcount->hits, __ATOMIC_RELAXED);
+		pstat->misses += __atomic_load_n(&pcount->misses, __ATOMIC_RELAXED);
+	}
+	pstat->size = (size_t) pfatfs->cache.nentries * pfatfs->bytes_per_sector;
+	fat_errnum = FAT_ERR_SUCCESS;
+	return 0;
+}
+
+/* lowest free cluster once the fat was counted, else the fsinfo hint;
+   0 if none */
+static fatclus_t
+fatfs_first_free(fatfs_t *pfatfs)
+{
+	fatclus_t cluster;
+
+	if (!pfatfs->num_of_free_clusters)
+		return 0;
+
+	if (!fatbitmap_complete(pfatfs)) {
+		cluster = pfatfs->first_free_cluster;
+		return fatfs_isvalid_cluster(pfatfs, cluster) ? cluster : 0;
+	}
+
+	cluster = fatbitmap_find_next(pfatfs, 2);
+	return (cluster == INVALID_CLUSTER) ? 0 : cluster;
+}
+
+int
+fat_statfs(fatfs_t *pfatfs, struct fatstatfs *pstat)
+{
+	int error = 0;
+
+	if (!pfatfs)
+		return -1;
+
+	if (!pstat) {
+		fat_errnum = FAT_ERR_INVAL;
+		return -1;
+	}
+
+	fat_errnum = FAT_ERR_SUCCESS;
+
+	/* fsinfo counts until the first fat update, then the bitmap does */
+	pthread_mutex_lock(&pfatfs->alloc_lock);
+	if (pfatfs->bitmap.words && fatfs_scan_all(pfatfs))
+		error = -1;
+	pstat->f_bfree = (uint32_t) pfatfs->num_of_free_clusters;
+	pstat->f_bnext = (uint32_t) fatfs_first_free(pfatfs);
+	pthread_mutex_unlock(&pfatfs->alloc_lock);
+
+	pstat->f_bsize = pfatfs->bytes_per_cluster;
+	pstat->f_blocks = (uint32_t) pfatfs->max_cluster_num - 1;
+	return error;
+}
+
+static fatdir_t *
+fatfs_opendir(fatfs_t *pfatfs, const wchar_t *path)
+{
+	fatblock_t block;
+	wchar_t *pwsz, *curdir, *nextslash, *maxptr;
+	struct fatdirent fatdirent;
+	fatdir_t *pfatdir = NULL;
+	fatoff_t privoff = 0;
+
+	if (!pfatfs)
+		return NULL;
+
+	if (!path) {
+		fat_errnum = FAT_ERR_INVAL;
+		return NULL;
+	}
+
+	if (!wcslen(path)) {
+		fat_errnum = FAT_ERR_NOENT;
+		return NULL;
+	}
+
+	/* copy root dir block */
+	memcpy(&block, &pfatfs->root_block, sizeof(block));
+	privoff = pfatfs->root_block.curoff;
+
+	/* copy the name */
+	pwsz = wcsdup(path);
+	if (!pwsz) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		return NULL;
+	}
+
+	maxptr = pwsz + wcslen(pwsz);
+
+	/* remove the initial slash, if any */
+	curdir = pwsz;
+	if (curdir[0] == (wchar_t) '/')
+		curdir++;
+
+	/* for all dir names */
+	while ((curdir < maxptr) && (curdir >= pwsz)) {
+		nextslash = wcschr(curdir, (wchar_t) '/');
+		if (nextslash)
+			*nextslash = (wchar_t) '\0';
+
+		/* entry not found, free and ret */
+		if (fatdirent_find_entry(pfatfs, &fatdirent, &block, curdir) < 0) {
+			if (!fat_errnum)
+				fat_errnum = FAT_ERR_NOENT;
+			goto _free_and_ret;
+		}
+
+		/* entry is not dir, free and ret */
+		if (fatdirent.d_type != FAT_TYPE_DIRECTORY) {
+			fat_errnum = FAT_ERR_NOTDIR;
+			goto _free_and_ret;
+		}
+
+		/* dir found, update block */
+		fatfs_fatblock_init(pfatfs, &block, fatdirent.d_cluster);
+
+		privoff = fatdirent.d_privoff;
+		curdir = nextslash + 1;
+	}
+
+	/* allocate memory for fatdir and its entry buffer */
+	pfatdir = calloc(1, sizeof(*pfatdir));
+	if (pfatdir) {
+		pfatdir->buf.size = pfatfs->bytes_per_cluster;
+		pfatdir->buf.data = malloc(pfatdir->buf.size);
+	}
+
+	if (!pfatdir || !pfatdir->buf.data) {
+		free(pfatdir);
+		pfatdir = NULL;
+		fat_errnum = FAT_ERR_ENOMEM;
+		goto _free_and_ret;
+	}
+
+	/* set values */
+	pfatdir->pfatfs = pfatfs;
+	pfatdir->privoff = privoff;
+	pfatdir->position = 0;
+	memcpy(&pfatdir->block, &block, sizeof(block));
+	fat_errnum = FAT_ERR_SUCCESS;
+
+_free_and_ret:
+	free(pwsz);
+	return pfatdir;
+}
+
+fatdir_t *
+fat_opendir(fatfs_t *pfatfs, const wchar_t *path)
+{
+	fatdir_t *pfatdir;
+
+	if (!pfatfs)
+		return NULL;
+
+	fatfs_lock(pfatfs, 0);
+	pfatdir = fatfs_opendir(pfatfs, path);
+	fatfs_unlock(pfatfs);
+	return pfatdir;
+}
+
+struct fatdirent *
+fat_readdir(fatdir_t *pfatdir)
+{
+	int error;
+
+	if (pfatdir) {
+		fatfs_lock(pfatdir->pfatfs, 0);
+		error = fatdirent_read_from_block(pfatdir->pfatfs, &pfatdir->data,
+		                                  &pfatdir->block, &pfatdir->buf);
+		fatfs_unlock(pfatdir->pfatfs);
+
+		if (!error) {
+			pfatdir->position++;
+			fat_errnum = FAT_ERR_SUCCESS;
+			return &pfatdir->data;
+		}
+	}
+
+	return NULL;
+}
+
+long
+fat_telldir(fatdir_t *pfatdir)
+{
+	if (pfatdir) {
+		fat_errnum = FAT_ERR_SUCCESS;
+		return pfatdir->position;
+	}
+
+	return -1;
+}
+
+void
+fat_seekdir(fatdir_t *pfatdir, long loc)
+{
+	if (!pfatdir)
+		return;
+
+	if (loc < 0) {
+		fat_errnum = FAT_ERR_INVAL;
+		return;
+	}
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	fatfs_lock(pfatdir->pfatfs, 0);
+	fat_rewinddir(pfatdir);
+	for (long i = 0; i < loc; i++)
+		fat_readdir(pfatdir);
+	fatfs_unlock(pfatdir->pfatfs);
+}
+
+void
+fat_rewinddir(fatdir_t *pfatdir)
+{
+	/* sanity check */
+	if (!pfatdir)
+		return;
+
+	/* the entry buffer is kept, it still holds the first cluster if the
+	   directory fits in one */
+	pfatdir->position = 0;
+	pfatdir->block.cluster = pfatdir->block.clsinit;
+	pfatdir->block.index = 0;
+
+	/* generic rewind */
+	if (fatfs_isvalid_cluster(pfatdir->pfatfs, pfatdir->block.cluster)) {
+		fatfs_fatblock_init(pfatdir->pfatfs, &pfatdir->block,
+		                    pfatdir->block.clsinit);
+		return;
+	}
+
+	/* rewind on fat12,fat16 root dir */
+	memcpy(&pfatdir->block, &pfatdir->pfatfs->root_block, sizeof(fatblock_t));
+}
+
+void
+fat_closedir(fatdir_t *pfatdir)
+{
+	if (pfatdir)
+		free(pfatdir->buf.data);
+	free(pfatdir);
+}
+
+int
+fat_mkdir(fatfs_t *pfatfs, const wchar_t *path)
+{
+	// TODO: implement
+	fprintf(stderr, "fat_mkdir(%p, %p): not implemented\n",
+	        (void *) pfatfs, (void *) path);
+	return FAT_ERR_NOTIMPL;
+}
+
+int
+fat_rmdir(fatfs_t *pfatfs, const wchar_t *path)
+{
+	// TODO: implement
+	fprintf(stderr, "fat_rmdir(%p, %p): not implemented\n",
+	        (void *) pfatfs, (void *) path);
+	return FAT_ERR_NOTIMPL;
+}
+
+static inline int
+parse_fopen_mode(const char *mode, uint8_t *oflag_mode, uint8_t *create,
+                 uint8_t *trunc)
+{
+	*oflag_mode = 0;
+	*create = 0;
+	*trunc = 0;
+
+	switch (*mode) {
+		case 'a':
+			*create = 1;
+			*oflag_mode = FAT_FILE_MODE_APPEND;
+			if (mode[1] == '+')
+				*oflag_mode |= FAT_FILE_MODE_READ;
+			break;
+
+		case 'r':
+			*oflag_mode = FAT_FILE_MODE_READ;
+			if (mode[1] == '+')
+				*oflag_mode |= FAT_FILE_MODE_WRITE;
+			break;
+
+		case 'w':
+			*oflag_mode = FAT_FILE_MODE_WRITE;
+			*create = 1;
+			*trunc = 1;
+
+			if (mode[1] == '+')
+				*oflag_mode |= FAT_FILE_MODE_READ;
+
+			if ((mode[1] == 'x') || ((strlen(mode) > 2) && (mode[2] == 'x')))
+				*trunc = 0;
+
+			break;
+
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+static inline int
+fatfs_privdirent_update_size(fatfs_t *pfatfs, fatoff_t privoff, fatoff_t size)
+{
+	struct privdirent privdir;
+
+	/* read old directory entry */
+	if (fatfs_read_from_offset(pfatfs, &privdir, sizeof(privdir),
+	                           privoff) !=  sizeof(privdir))
+			return -1;
+
+	// TODO: update the write time
+	privdir.type.gen.file_size = size;
+
+	/* update */
+	if (fatfs_write_to_offset(pfatfs, &privdir, sizeof(privdir),
+	                          privoff) !=  sizeof(privdir))
+			return -1;
+
+	__atomic_fetch_add(&pfatfs->dirgen, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline int
+fatfs_privdirent_update_cluster(fatfs_t *pfatfs, fatoff_t privoff, fatclus_t cl)
+{
+	struct privdirent privdir;
+
+	/* read old directory entry */
+	if (fatfs_read_from_offset(pfatfs, &privdir, sizeof(privdir),
+	                           privoff) !=  sizeof(privdir))
+			return -1;
+
+	// TODO: update the write time
+	privdir.type.gen.first_cluster_low = (uint16_t) cl;
+	privdir.type.gen.first_cluster_high = (cl >> 16);
+
+	/* update */
+	if (fatfs_write_to_offset(pfatfs, &privdir, sizeof(privdir),
+	                          privoff) !=  sizeof(privdir))
+			return -1;
+
+	__atomic_fetch_add(&pfatfs->dirgen, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* extend the chain of pfatfile to hold length bytes */
+static int
+fatfs_fatfile_reserve(fatfile_t *pfatfile, fatoff_t length)
+{
+	fatfs_t *pfatfs = pfatfile->pfatfs;
+	fatclus_t cluster, last = INVALID_CLUSTER, count = 0, needed;
+
+	needed = (fatclus_t) ((length + pfatfs->bytes_per_cluster - 1) /
+		pfatfs->bytes_per_cluster);
+
+	/* the end of chain is the last run */
+	if (fatextmap_build(pfatfs, &pfatfile->map, pfatfile->block.clsinit))
+		return -1;
+
+	if (pfatfile->map.count) {
+		struct fatextent *plast;
+
+		plast = &pfatfile->map.extents[pfatfile->map.count - 1];
+		count = plast->index + plast->length;
+		last = plast->cluster + plast->length - 1;
+	}
+
+	if (count >= needed)
+		return 0;
+
+	cluster = fatfs_fatchain_extend(pfatfs, last, needed - count,
+	                                &pfatfile->map);
+	if (cluster == INVALID_CLUSTER)
+		return -1;
+
+	/* if file is empty */
+	if (last == INVALID_CLUSTER) {
+		/* update privdir, a chain it does not point to would be lost */
+		if (fatfs_privdirent_update_cluster(pfatfs, pfatfile->privoff,
+		                                    cluster)) {
+			int32_t errnum = fat_errnum;
+
+			fatfs_release_chain(pfatfs, cluster, needed);
+			fatextmap_truncate(&pfatfile->map, 0);
+			fat_errnum = errnum;
+			return -1;
+		}
+
+		fatfs_fatblock_init(pfatfs, &pfatfile->block, cluster);
+	}
+
+	return 0;
+}
+
+static inline int
+fatfs_fatfile_expand(fatfile_t *pfatfile, fatoff_t length)
+{
+	int error;
+	size_t expsize, nwrite, zbsize;
+	uint8_t zerobuf[2048];
+	fatblock_t block;
+
+	zbsize = sizeof(zerobuf);
+	expsize = (size_t) (length - pfatfile->filesize);
+	memset(zerobuf, 0, zbsize);
+
+	/* go to end */
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_END))
+		return -1;
+
+	/* reserve the whole growth at once, so the chain can stay contiguous */
+	if (fatfs_fatfile_reserve(pfatfile, length))
+		return -1;
+
+	/* preserve the caller block */
+	memcpy(&block, &pfatfile->block, sizeof(block));
+
+	/* write zeros */
+	error = -1;
+	while (expsize) {
+		nwrite = fatfs_write_to_block(pfatfile->pfatfs, zerobuf,
+		                              (zbsize >= expsize) ? expsize : zbsize,
+		                              &pfatfile->block, &pfatfile->map);
+		if (fat_errnum)
+			goto _restore_block_and_ret;
+
+		expsize -= nwrite;
+	}
+
+	error = 0;
+_restore_block_and_ret:
+	memcpy(&pfatfile->block, &block, sizeof(block));
+	return error;
+}
+
+static inline int
+fatfs_fatfile_shrink(fatfile_t *pfatfile, fatoff_t length)
+{
+	fatblock_t block;
+	fatclus_t cluster, lastvalid;
+
+	/* adjust file pointer */
+	if (fat_fseek(pfatfile, length, FAT_SEEK_SET))
+		return -1;
+
+	/* caller block is set to the last eof */
+	memcpy(&block, &pfatfile->block, sizeof(block));
+
+	lastvalid = pfatfile->block.cluster;
+	cluster = pfatfile->block.cluster;
+
+	/* release all clusters ahead */
+	while (fatfs_goto_next_block(pfatfile->pfatfs, &pfatfile->block) == 0) {
+		if (fatfs_release_cluster(pfatfile->pfatfs, cluster))
+			break;
+		cluster = pfatfile->block.cluster;
+	}
+
+	/* release the last in the chain */
+	if (cluster != lastvalid)
+		fatfs_release_cluster(pfatfile->pfatfs, cluster);
+	/* set new eof */
+	fatfs_link_cluster(pfatfile->pfatfs, lastvalid, END_OF_FILE);
+	fatextmap_truncate(&pfatfile->map, (fatclus_t) ((length +
+		pfatfile->pfatfs->bytes_per_cluster - 1) /
+		pfatfile->pfatfs->bytes_per_cluster));
+
+	/* restore block */
+	memcpy(&pfatfile->block, &block, sizeof(block));
+	if (length == 0) {
+		/* invalidate */
+		pfatfile->block.cluster = INVALID_CLUSTER;
+		pfatfile->block.clsinit = INVALID_CLUSTER;
+		pfatfile->block.curoff = 0;
+		pfatfile->block.endoff = 0;
+		pfatfile->block.index = 0;
+		fatblock_forget(&pfatfile->block);
+		fatfs_release_cluster(pfatfile->pfatfs, lastvalid);
+
+		/* an empty file has no first cluster */
+		if (fatfs_privdirent_update_cluster(pfatfile->pfatfs, pfatfile->privoff,
+		                                    0))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/* file data changed, windows read ahead by any handle are stale */
+static inline void
+fatfile_data_changed(fatfile_t *pfatfile)
+{
+	pfatfile->ra.len = 0;
+	__atomic_fetch_add(&pfatfile->pfatfs->datagen, 1, __ATOMIC_RELEASE);
+}
+
+/* the chain goes on past the cluster holding length bytes */
+static int
+fatfs_fatfile_reserved(fatfile_t *pfatfile, fatoff_t length)
+{
+	fatfs_t *pfatfs = pfatfile->pfatfs;
+	struct fatextent *plast;
+	fatclus_t needed;
+
+	if (fatextmap_build(pfatfs, &pfatfile->map, pfatfile->block.clsinit) ||
+		!pfatfile->map.count)
+		return 0;
+
+	needed = (fatclus_t) ((length + pfatfs->bytes_per_cluster - 1) /
+		pfatfs->bytes_per_cluster);
+	plast = &pfatfile->map.extents[pfatfile->map.count - 1];
+	return (plast->index + plast->length > needed);
+}
+
+static int
+fatfile_truncate(fatfile_t *pfatfile, fatoff_t len)
+{
+	int error;
+
+	/* the same size still drops what fat_fallocate reserved past it */
+	if ((len == pfatfile->filesize) && !fatfs_fatfile_reserved(pfatfile, len))
+		return 0;
+
+	error = (len > pfatfile->filesize) ? fatfs_fatfile_expand(pfatfile, len) :
+		fatfs_fatfile_shrink(pfatfile, len);
+
+	/* a failed change may still have been part done */
+	fatfile_data_changed(pfatfile);
+	if (error)
+		return -1;
+
+	pfatfile->filesize = len;
+	return fatfs_privdirent_update_size(pfatfile->pfatfs,pfatfile->privoff,len);
+}
+
+static fatfile_t *
+fatfs_fopen(fatfs_t *pfatfs, const wchar_t *path, const char *mode)
+{
+	struct fatdirent *dp;
+	fatdir_t *pfatdir = NULL;
+	fatfile_t *pfatfile = NULL;
+	wchar_t *pwsz, *dirpart, *filepart;
+	uint8_t oflag_mode, create, trunc;
+
+	/* sanity checks */
+	if (!pfatfs)
+		return NULL;
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!path || !mode) {
+		fat_errnum = FAT_ERR_INVAL;
+		return NULL;
+	}
+
+	/* parse mode */
+	if (parse_fopen_mode(mode, &oflag_mode, &create, &trunc)) {
+		fat_errnum = FAT_ERR_INVAL;
+		return NULL;
+	}
+
+	/* read-only volume */
+	if ((pfatfs->flags & FAT_MOUNT_RDONLY) &&
+		(oflag_mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND))) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return NULL;
+	}
+
+	/* copy path */
+	pwsz = wcsdup(path);
+	if (!pwsz) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		return NULL;
+	}
+
+	/* split path */
+	split_path(pwsz, &dirpart, &filepart);
+
+	/* open directory */
+	pfatdir = fat_opendir(pfatfs, dirpart);
+	if (!pfatdir)
+		goto _free_and_ret;
+
+	/* if path ends with slash */
+	if (!filepart) {
+		fat_errnum = FAT_ERR_ISDIR;
+		goto _free_and_ret;
+	}
+
+	/* for each directory entry */
+	while ((dp = fat_readdir(pfatdir))) {
+		/* check the name */
+		if (!wcsncmp(filepart, dp->d_name, sizeof(dp->d_name))) {
+
+			/* is dir, return err */
+			if (dp->d_type == FAT_TYPE_DIRECTORY) {
+				fat_errnum = FAT_ERR_ISDIR;
+				goto _free_and_ret;
+			}
+
+			pfatfile = calloc(1, sizeof(*pfatfile));
+			if (!pfatfile) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				goto _free_and_ret;
+			}
+
+			/* init the file structure */
+			fat_mutex_init(&pfatfile->lock);
+			pfatfile->pfatfs = pfatfs;
+			pfatfile->privoff = dp->d_privoff;
+			pfatfile->block.cluster = INVALID_CLUSTER;
+			pfatfile->block.clsinit = INVALID_CLUSTER;
+			pfatfile->mode = oflag_mode;
+			pfatfile->filesize = dp->d_size;
+			pfatfile->oversize = 0;
+
+			/* an empty file may still own the chain fat_fallocate
+			   reserved */
+			if (dp->d_size || fatfs_isvalid_cluster(pfatfs, dp->d_cluster))
+				fatfs_fatblock_init(pfatfile->pfatfs, &pfatfile->block,
+				                    dp->d_cluster);
+		}
+	}
+
+	/* if err, return */
+	if (fat_errnum)
+		goto _free_and_ret;
+
+	if (!pfatfile) {
+		//if (!create) {
+			fat_errnum = FAT_ERR_NOENT;
+		//	goto _free_and_ret;
+		//}
+
+		// TODO: create file
+
+	} else if (trunc) {
+		if (fatfile_truncate(pfatfile, 0)) {
+			fat_fclose(pfatfile);
+			pfatfile = NULL;
+		}
+	}
+
+_free_and_ret:
+	free(pwsz);
+	fat_closedir(pfatdir);
+	return pfatfile;
+}
+
+fatfile_t *
+fat_fopen(fatfs_t *pfatfs, const wchar_t *path, const char *mode)
+{
+	fatfile_t *pfatfile;
+
+	if (!pfatfs)
+		return NULL;
+
+	/* a mode that may create or truncate changes the directory */
+	if (fatfs_lock(pfatfs, (mode && (*mode != 'r'))))
+		return NULL;
+
+	pfatfile = fatfs_fopen(pfatfs, path, mode);
+	fatfs_unlock(pfatfs);
+	return pfatfile;
+}
+
+/* serve reads from a window that grows ahead of a sequential reader */
+static size_t
+fatfs_fatfile_readahead(fatfile_t *pfatfile, void *buf, size_t nbytes)
+{
+	fatfs_t *pfatfs = pfatfile->pfatfs;
+	struct fatra *pra = &pfatfile->ra;
+	fatoff_t pos = fat_ftell(pfatfile);
+	size_t total = 0, nread;
+	uint32_t datagen = __atomic_load_n(&pfatfs->datagen, __ATOMIC_ACQUIRE);
+
+	/* written since it was filled */
+	if (pra->datagen != datagen)
+		pra->len = 0;
+
+	/* a seek collapses the window and drops what it held */
+	if (pos != pra->next) {
+		pra->window = 0;
+		pra->len = 0;
+	} else if (!pra->window)
+		pra->window = (pfatfs->ra_max < FAT_READAHEAD_MIN) ? pfatfs->ra_max :
+			FAT_READAHEAD_MIN;
+
+	pra->next = pos + (fatoff_t) nbytes;
+
+	while (total < nbytes) {
+		/* hit */
+		if (pra->len && (pos >= pra->start) &&
+			(pos < pra->start + (fatoff_t) pra->len)) {
+			size_t slice = (size_t) (pra->start + (fatoff_t) pra->len - pos);
+			if (slice > nbytes - total)
+				slice = nbytes - total;
+
+			memcpy((uint8_t *) buf + total, pra->buf + (pos - pra->start), slice);
+			total += slice;
+			pos += (fatoff_t) slice;
+			continue;
+		}
+
+		if (fat_fseek(pfatfile, pos, FAT_SEEK_SET))
+			return total;
+
+		/* random or large reads go straight to the device */
+		if (nbytes - total >= pra->window)
+			return total + fatfs_read_from_block(pfatfs, (uint8_t *) buf + total,
+			                                     nbytes - total, &pfatfile->block);
+
+		/* fill the window */
+		if (pra->size < pra->window) {
+			uint8_t *ptr = realloc(pra->buf, pra->window);
+			if (!ptr) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				return total;
+			}
+
+			pra->buf = ptr;
+			pra->size = pra->window;
+		}
+
+		nread = pra->window;
+		if ((fatoff_t) nread > pfatfile->filesize - pos)
+			nread = (size_t) (pfatfile->filesize - pos);
+
+		pra->start = pos;
+		pra->datagen = datagen;
+		pra->len = fatfs_read_from_block(pfatfs, pra->buf, nread,
+		                                 &pfatfile->block);
+		if (fat_errnum || !pra->len) {
+			pra->len = 0;
+			return total;
+		}
+
+		/* keep growing while sequential */
+		if (pra->window * 2 <= pfatfs->ra_max)
+			pra->window *= 2;
+	}
+
+	/* the file pointer follows the caller, not the window */
+	fat_fseek(pfatfile, pos, FAT_SEEK_SET);
+	return total;
+}
+
+static size_t
+fatfile_read(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+{
+	size_t bytes_to_read = size * nitems;
+
+	/* sanity check */
+	if (!pfatfile)
+		return 0;
+
+	if (!buf || ((bytes_to_read < size) || (bytes_to_read < nitems))) {
+		fat_errnum = FAT_ERR_INVAL;
+		return 0;
+	}
+
+	/* above max size */
+	if (bytes_to_read > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
+		return 0;
+	}
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!bytes_to_read)
+		return 0;
+
+	/* check mode */
+	if ((pfatfile->mode & FAT_FILE_MODE_READ) == 0) {
+		fat_errnum = FAT_ERR_WRONLY;
+		return 0;
+	}
+
+	/* check file bounds */
+	if (fat_ftell(pfatfile) >= pfatfile->filesize)
+		return 0;
+
+	if ((fat_ftell(pfatfile) + (fatoff_t) bytes_to_read) > pfatfile->filesize)
+		bytes_to_read = pfatfile->filesize - fat_ftell(pfatfile);
+
+	if (!(pfatfile->pfatfs->flags & (FAT_MOUNT_NORA | FAT_MOUNT_MMAP)))
+		return fatfs_fatfile_readahead(pfatfile, buf, bytes_to_read);
+
+	return fatfs_read_from_block(pfatfile->pfatfs, buf, bytes_to_read,
+	                             &pfatfile->block);
+}
+
+size_t
+fat_fread(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+{
+	size_t nread;
+
+	if (!pfatfile)
+		return 0;
+
+	fatfile_lock(pfatfile);
+	nread = fatfile_read(buf, size, nitems, pfatfile);
+	fatfile_unlock(pfatfile);
+	return nread;
+}
+
+static size_t
+fatfile_write(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+{
+	size_t bytes_to_write = size * nitems;
+	size_t nwrite;
+
+	/* sanity check */
+	if (!pfatfile)
+		return 0;
+
+	if (!buf || ((bytes_to_write < size) || (bytes_to_write < nitems))) {
+		fat_errnum = FAT_ERR_INVAL;
+		return 0;
+	}
+
+	/* above max size */
+	if (bytes_to_write > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
+		return 0;
+	}
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!bytes_to_write)
+		return 0;
+
+	/* check mode */
+	if ((pfatfile->mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND)) == 0) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return 0;
+	}
+
+	if (pfatfile->mode & FAT_FILE_MODE_APPEND) {
+		if(fat_fseek(pfatfile, 0, FAT_SEEK_END))
+			return 0;
+	}
+
+	/* if necessary, commit out-of-bounds size */
+	if (pfatfile->oversize) {
+		if (fatfile_truncate(pfatfile, pfatfile->filesize + pfatfile->oversize))
+			return 0;
+
+		/* truncate does not update the file pointer
+		   we should update it if mode != append */
+		if ((pfatfile->mode & FAT_FILE_MODE_APPEND) == 0) {
+			if(fat_fseek(pfatfile, 0, FAT_SEEK_END))
+				return 0;
+		}
+
+	/* file is empty, allocate the whole write as one extent if possible */
+	} else if (pfatfile->filesize == 0) {
+		if (fatfs_fatfile_reserve(pfatfile, (fatoff_t) bytes_to_write) ||
+			fatfile_truncate(pfatfile, 1))
+			return 0;
+	}
+
+	/* write bytes */
+	nwrite = fatfs_write_to_block(pfatfile->pfatfs, buf, bytes_to_write,
+	                              &pfatfile->block, &pfatfile->map);
+	fatfile_data_changed(pfatfile);
+
+	/* if necessary, adjust filesize */
+	fatoff_t curoff = fat_ftell(pfatfile);
+	if (curoff > pfatfile->filesize) {
+		fatfs_privdirent_update_size(pfatfile->pfatfs,pfatfile->privoff,curoff);
+		pfatfile->filesize = curoff;
+	}
+
+	return nwrite;
+}
+
+size_t
+fat_fwrite(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+{
+	size_t nwrite;
+
+	if (!pfatfile)
+		return 0;
+
+	fatfile_lock(pfatfile);
+	nwrite = fatfile_write(buf, size, nitems, pfatfile);
+	fatfile_unlock(pfatfile);
+	return nwrite;
+}
 
-		case 'w':
-			*oflag_mode = FAT_FILE_MODE_WRITE;
-			*create = 1;
-			*trunc = 1;
+/* device segments of a file range, one per run and at most max_io long */
+static struct fatseg *
+fatfs_fatfile_segments(fatfile_t *pfatfile, uint8_t *buf, size_t nbytes,
+                       fatoff_t pos, size_t *pcount)
+{
+	fatfs_t *pfatfs = pfatfile->pfatfs;
+	fatoff_t bpc = pfatfs->bytes_per_cluster;
+	struct fatseg *segs = NULL, *ptr;
+	size_t count = 0, capacity = 0;
 
-			if (mode[1] == '+')
-				*oflag_mode |= FAT_FILE_MODE_READ;
+	if (fatextmap_build(pfatfs, &pfatfile->map, pfatfile->block.clsinit))
+		return NULL;
 
-			if ((mode[1] == 'x') || ((strlen(mode) > 2) && (mode[2] == 'x')))
-				*trunc = 0;
+	while (nbytes) {
+		struct fatextent *pext = fatextmap_find(&pfatfile->map,
+		                                        (fatclus_t) (pos / bpc));
+		fatoff_t runend;
+		size_t slice;
+
+		/* chain shorter than the file */
+		if (!pext) {
+			fat_errnum = FAT_ERR_IO;
+			free(segs);
+			return NULL;
+		}
 
-			break;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 8;
+			ptr = realloc(segs, capacity * sizeof(*segs));
+			if (!ptr) {
+				fat_errnum = FAT_ERR_ENOMEM;
+				free(segs);
+				return NULL;
+			}
+			segs = ptr;
+		}
 
-		default:
-			return -1;
+		runend = (fatoff_t) (pext->index + pext->length) * bpc;
+		slice = ((fatoff_t) nbytes > runend - pos) ? (size_t) (runend - pos) :
+			nbytes;
+		if (slice > pfatfs->max_io)
+			slice = pfatfs->max_io;
+
+		segs[count].buf = buf;
+		segs[count].nbytes = slice;
+		segs[count].off = fatfs_clus2off(pfatfs, pext->cluster) +
+			(pos - ((fatoff_t) pext->index * bpc));
+		count++;
+
+		/* without a buffer, only the device ranges are wanted */
+		if (buf)
+			buf += slice;
+		pos += (fatoff_t) slice;
+		nbytes -= slice;
 	}
 
-	return 0;
+	*pcount = count;
+	return segs;
 }
 
-static inline int
-fatfs_privdirent_update_size(fatfs_t *pfatfs, fatoff_t privoff, fatoff_t size)
+/* start the transfer, or do it now when there is no ring */
+static void
+fatfs_aio_submit(fatfs_t *pfatfs, struct fataio *paio)
 {
-	struct privdirent privdir;
+	pthread_mutex_lock(&pfatfs->aio_lock);
+	pfatfs->aio_count++;
+	pthread_mutex_unlock(&pfatfs->aio_lock);
+
+#ifdef FAT_HAVE_URING
+	if (pfatfs->pring) {
+		struct urdev *purdev = (struct urdev *) pfatfs->dev.priv;
+
+		/*
+		 * cached copies must see the new data; the cache takes its shard
+		 * locks before the ring lock on a miss, never the other way round
+		 */
+		if (paio->write && pfatfs->cache.nentries) {
+			for (size_t i = 0; i < paio->nsegs; i++)
+				fatcache_update(pfatfs, paio->segs[i].buf,
+				                paio->segs[i].nbytes, paio->segs[i].off);
+		}
 
-	/* read old directory entry */
-	if (fatfs_read_from_offset(pfatfs, &privdir, sizeof(privdir),
-	                           privoff) !=  sizeof(privdir))
-			return -1;
+		pthread_mutex_lock(&pfatfs->pring->lock);
 
-	// TODO: update the write time
-	privdir.type.gen.file_size = size;
+		/*
+		 * fatring_queue reaps when the ring is full, the submission holds a
+		 * reference so the reaper cannot finish the request half-queued
+		 */
+		paio->pending++;
 
-	/* update */
-	if (fatfs_write_to_offset(pfatfs, &privdir, sizeof(privdir),
-	                          privoff) !=  sizeof(privdir))
-			return -1;
+		for (size_t i = 0; i < paio->nsegs; i++) {
+			struct fatseg *pseg = &paio->segs[i];
 
-	return 0;
+			if (fatring_queue(pfatfs->pring, paio, purdev->fd, pseg->buf,
+			                  pseg->nbytes, pfatfs->offset + pseg->off)) {
+				paio->errnum = FAT_ERR_IO;
+				break;
+			}
+		}
+
+		/* the whole request costs one submission */
+		if (pfatfs->pring->queued && fatring_enter(pfatfs->pring, 0))
+			paio->errnum = FAT_ERR_IO;
+
+		/* the reaper reports it once the last segment completes */
+		if (--paio->pending) {
+			pthread_mutex_unlock(&pfatfs->pring->lock);
+			return;
+		}
+
+		pthread_mutex_unlock(&pfatfs->pring->lock);
+	} else
+#endif
+	{
+		for (size_t i = 0; i < paio->nsegs; i++) {
+			struct fatseg *pseg = &paio->segs[i];
+			size_t n = paio->write ?
+				fatfs_write_to_offset(pfatfs, pseg->buf, pseg->nbytes, pseg->off) :
+				fatfs_read_from_offset(pfatfs, pseg->buf, pseg->nbytes, pseg->off);
+
+			paio->expect += pseg->nbytes;
+			paio->got += n;
+			if (n != pseg->nbytes) {
+				paio->errnum = FAT_ERR_IO;
+				break;
+			}
+		}
+	}
+
+	/* nothing in flight, report on the next poll */
+	paio->next = NULL;
+	pthread_mutex_lock(&pfatfs->aio_lock);
+	*pfatfs->aio_donetail = paio;
+	pfatfs->aio_donetail = &paio->next;
+	pthread_mutex_unlock(&pfatfs->aio_lock);
 }
 
-static inline int
-fatfs_privdirent_update_cluster(fatfs_t *pfatfs, fatoff_t privoff, fatclus_t cl)
+static struct fataio *
+fatfs_aio_new(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t pos,
+              fat_aio_done done, void *arg)
 {
-	struct privdirent privdir;
+	struct fataio *paio = calloc(1, sizeof(*paio));
 
-	/* read old directory entry */
-	if (fatfs_read_from_offset(pfatfs, &privdir, sizeof(privdir),
-	                           privoff) !=  sizeof(privdir))
-			return -1;
-
-	// TODO: update the write time
-	privdir.type.gen.first_cluster_low = (uint16_t) cl;
-	privdir.type.gen.first_cluster_high = (cl >> 16);
+	if (!paio) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		return NULL;
+	}
 
-	/* update */
-	if (fatfs_write_to_offset(pfatfs, &privdir, sizeof(privdir),
-	                          privoff) !=  sizeof(privdir))
-			return -1;
+	paio->pfatfile = pfatfile;
+	paio->buf = (uint8_t *) buf;
+	paio->nbytes = nbytes;
+	paio->done = done;
+	paio->arg = arg;
+
+	if (nbytes) {
+		paio->segs = fatfs_fatfile_segments(pfatfile, paio->buf, nbytes, pos,
+		                                    &paio->nsegs);
+		if (!paio->segs) {
+			free(paio);
+			return NULL;
+		}
+	}
 
-	return 0;
+	return paio;
 }
 
-static inline int
-fatfs_fatfile_expand(fatfile_t *pfatfile, fatoff_t length)
+static int
+fatfile_read_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                   fat_aio_done done, void *arg)
 {
-	int error;
-	size_t expsize, nwrite, zbsize;
-	uint8_t zerobuf[2048];
-	fatblock_t block;
+	struct fataio *paio;
+	fatoff_t pos;
 
-	zbsize = sizeof(zerobuf);
-	expsize = (size_t) (length - pfatfile->filesize);
-	memset(zerobuf, 0, zbsize);
+	/* sanity check */
+	if (!pfatfile)
+		return -1;
 
-	/* go to end */
-	if (fat_fseek(pfatfile, 0, FAT_SEEK_END))
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!buf || !done) {
+		fat_errnum = FAT_ERR_INVAL;
 		return -1;
+	}
 
-	/* if file is empty */
-	if (pfatfile->filesize == 0) {
-		/* allocate one block */
-		fatclus_t newclus = fatfs_allocate_cluster(pfatfile->pfatfs);
-		if (newclus == INVALID_CLUSTER)
-			return -1;
+	/* above max size */
+	if (nbytes > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
+		return -1;
+	}
 
-		/* set EOF */
-		if (fatfs_link_cluster(pfatfile->pfatfs, newclus, END_OF_FILE))
-			return -1;
+	/* check mode */
+	if ((pfatfile->mode & FAT_FILE_MODE_READ) == 0) {
+		fat_errnum = FAT_ERR_WRONLY;
+		return -1;
+	}
 
-		/* update privdir */
-		if (fatfs_privdirent_update_cluster(pfatfile->pfatfs, pfatfile->privoff,
-		                                    newclus))
-			return -1;
+	/* check file bounds */
+	pos = fat_ftell(pfatfile);
+	if (pos >= pfatfile->filesize)
+		nbytes = 0;
+	else if (pos + (fatoff_t) nbytes > pfatfile->filesize)
+		nbytes = (size_t) (pfatfile->filesize - pos);
+
+	paio = fatfs_aio_new(pfatfile, buf, nbytes, pos, done, arg);
+	if (!paio)
+		return -1;
 
-		fatfs_fatblock_init(pfatfile->pfatfs, &pfatfile->block, newclus);
+	if (nbytes && fat_fseek(pfatfile, pos + (fatoff_t) nbytes, FAT_SEEK_SET)) {
+		free(paio->segs);
+		free(paio);
+		return -1;
 	}
 
-	/* preserve the caller block */
-	memcpy(&block, &pfatfile->block, sizeof(block));
+	fatfs_aio_submit(pfatfile->pfatfs, paio);
+	return 0;
+}
 
-	/* write zeros */
-	error = -1;
-	while (expsize) {
-		nwrite = fatfs_write_to_block(pfatfile->pfatfs, zerobuf,
-		                              (zbsize >= expsize) ? expsize : zbsize,
-		                              &pfatfile->block);
-		if (pfatfile->pfatfs->errnum)
-			goto _restore_block_and_ret;
+int
+fat_fread_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                fat_aio_done done, void *arg)
+{
+	int error;
 
-		expsize -= nwrite;
-	}
+	if (!pfatfile)
+		return -1;
 
-	error = 0;
-_restore_block_and_ret:
-	memcpy(&pfatfile->block, &block, sizeof(block));
+	fatfile_lock(pfatfile);
+	error = fatfile_read_async(buf, nbytes, pfatfile, done, arg);
+	fatfile_unlock(pfatfile);
 	return error;
 }
 
-static inline int
-fatfs_fatfile_shrink(fatfile_t *pfatfile, fatoff_t length)
+static int
+fatfile_write_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                    fat_aio_done done, void *arg)
 {
-	fatblock_t block;
-	fatclus_t cluster, lastvalid;
+	struct fataio *paio;
+	fatoff_t pos;
 
-	/* adjust file pointer */
-	if (fat_fseek(pfatfile, length, FAT_SEEK_SET))
+	/* sanity check */
+	if (!pfatfile)
 		return -1;
 
-	/* caller block is set to the last eof */
-	memcpy(&block, &pfatfile->block, sizeof(block));
-
-	lastvalid = pfatfile->block.cluster;
-	cluster = pfatfile->block.cluster;
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!buf || !done) {
+		fat_errnum = FAT_ERR_INVAL;
+		return -1;
+	}
 
-	/* release all clusters ahead */
-	while (fatfs_goto_next_block(pfatfile->pfatfs, &pfatfile->block) == 0) {
-		if (fatfs_release_cluster(pfatfile->pfatfs, cluster))
-			break;
-		cluster = pfatfile->block.cluster;
+	/* above max size */
+	if (nbytes > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
+		return -1;
 	}
 
-	/* release the last in the chain */
-	if (cluster != lastvalid)
-		fatfs_release_cluster(pfatfile->pfatfs, cluster);
-	/* set new eof */
-	fatfs_link_cluster(pfatfile->pfatfs, lastvalid, END_OF_FILE);
+	/* check mode */
+	if ((pfatfile->mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND)) == 0) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return -1;
+	}
 
-	/* restore block */
-	memcpy(&pfatfile->block, &block, sizeof(block));
-	if (length == 0) {
-		/* invalidate */
-		pfatfile->block.cluster = INVALID_CLUSTER;
-		pfatfile->block.clsinit = INVALID_CLUSTER;
-		pfatfile->block.curoff = 0;
-		pfatfile->block.endoff = 0;
-		pfatfile->block.index = 0;
-		fatfs_release_cluster(pfatfile->pfatfs, lastvalid);
+	if (pfatfile->mode & FAT_FILE_MODE_APPEND) {
+		if (fat_fseek(pfatfile, 0, FAT_SEEK_END))
+			return -1;
+	}
 
-		/* update the first cluster */
-		if (fatfs_privdirent_update_cluster(pfatfile->pfatfs, pfatfile->privoff,
-		                                    INVALID_CLUSTER))
+	/* the gap before the write is zero-filled now */
+	if (pfatfile->oversize) {
+		pos = fat_ftell(pfatfile);
+		if (fatfile_truncate(pfatfile, pos) ||
+			fat_fseek(pfatfile, pos, FAT_SEEK_SET))
 			return -1;
 	}
 
+	/* clusters and size are committed before the data */
+	pos = fat_ftell(pfatfile);
+	if (nbytes && fatfs_fatfile_reserve(pfatfile, pos + (fatoff_t) nbytes))
+		return -1;
+
+	paio = fatfs_aio_new(pfatfile, buf, nbytes, pos, done, arg);
+	if (!paio)
+		return -1;
+
+	paio->write = 1;
+	fatfile_data_changed(pfatfile);
+	if (pos + (fatoff_t) nbytes > pfatfile->filesize) {
+		pfatfile->filesize = pos + (fatoff_t) nbytes;
+		fatfs_privdirent_update_size(pfatfile->pfatfs, pfatfile->privoff,
+		                             pfatfile->filesize);
+	}
+
+	if (fat_fseek(pfatfile, pos + (fatoff_t) nbytes, FAT_SEEK_SET)) {
+		free(paio->segs);
+		free(paio);
+		return -1;
+	}
+
+	fatfs_aio_submit(pfatfile->pfatfs, paio);
 	return 0;
 }
 
-
-static int
-fatfile_truncate(fatfile_t *pfatfile, fatoff_t len)
+int
+fat_fwrite_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                 fat_aio_done done, void *arg)
 {
-	if (len == pfatfile->filesize)
-		return 0;
-
-	if (len > pfatfile->filesize) {
-		if (fatfs_fatfile_expand(pfatfile, len))
-			return -1;
+	int error;
 
-	} else {
-		if (fatfs_fatfile_shrink(pfatfile, len))
-			return -1;
-	}
+	if (!pfatfile)
+		return -1;
 
-	pfatfile->filesize = len;
-	return fatfs_privdirent_update_size(pfatfile->pfatfs,pfatfile->privoff,len);
+	fatfile_lock(pfatfile);
+	error = fatfile_write_async(buf, nbytes, pfatfile, done, arg);
+	fatfile_unlock(pfatfile);
+	return error;
 }
 
-fatfile_t *
-fat_fopen(fatfs_t *pfatfs, const wchar_t *path, const char *mode)
+int
+fat_aio_poll(fatfs_t *pfatfs, int wait)
 {
-	struct fatdirent *dp;
-	fatdir_t *pfatdir = NULL;
-	fatfile_t *pfatfile = NULL;
-	wchar_t *pwsz, *dirpart, *filepart;
-	uint8_t oflag_mode, create, trunc;
+	struct fataio *paio, *list;
+	int count = 0;
 
-	/* sanity checks */
 	if (!pfatfs)
-		return NULL;
+		return -1;
 
-	pfatfs->errnum = FAT_ERR_SUCCESS;
-	if (!path || !mode) {
-		pfatfs->errnum = FAT_ERR_INVAL;
-		return NULL;
-	}
+	fat_errnum = FAT_ERR_SUCCESS;
 
-	/* parse mode */
-	if (parse_fopen_mode(mode, &oflag_mode, &create, &trunc)) {
-		pfatfs->errnum = FAT_ERR_INVAL;
-		return NULL;
-	}
+#ifdef FAT_HAVE_URING
+	if (pfatfs->pring) {
+		struct fatring *pring = pfatfs->pring;
+		uint64_t events;
 
-	/* copy path */
-	pwsz = wcsdup(path);
-	if (!pwsz) {
-		pfatfs->errnum = FAT_ERR_ENOMEM;
-		return NULL;
+		pthread_mutex_lock(&pring->lock);
+		fatring_reap(pring);
+		while (wait && !pring->done && !pfatfs->aio_done &&
+		       (pring->queued || pring->inflight)) {
+			if (fatring_enter(pring, 1)) {
+				pthread_mutex_unlock(&pring->lock);
+				fat_errnum = FAT_ERR_IO;
+				return -1;
+			}
+			fatring_reap(pring);
+		}
+
+		/* rearm the descriptor */
+		if ((pring->evfd >= 0) &&
+			(read(pring->evfd, &events, sizeof(events)) < 0) &&
+			(errno != EAGAIN))
+			fat_errnum = FAT_ERR_IO;
+
+		/* move finished transfers to the done list */
+		pthread_mutex_lock(&pfatfs->aio_lock);
+		if (pring->done) {
+			*pfatfs->aio_donetail = pring->done;
+			pfatfs->aio_donetail = pring->donetail;
+			pring->done = NULL;
+			pring->donetail = &pring->done;
+		}
+		pthread_mutex_unlock(&pfatfs->aio_lock);
+		pthread_mutex_unlock(&pring->lock);
 	}
+#endif
+
+	/* transfers submitted by the callbacks wait for the next poll */
+	pthread_mutex_lock(&pfatfs->aio_lock);
+	list = pfatfs->aio_done;
+	pfatfs->aio_done = NULL;
+	pfatfs->aio_donetail = &pfatfs->aio_done;
+	pthread_mutex_unlock(&pfatfs->aio_lock);
+
+	while ((paio = list)) {
+		list = paio->next;
+
+		if (!paio->errnum && (paio->got != paio->expect))
+			paio->errnum = FAT_ERR_IO;
+
+		/* the device does not see dirty cached sectors */
+		if (!paio->errnum && !paio->write && pfatfs->pring) {
+			for (size_t i = 0; i < paio->nsegs; i++)
+				fatcache_overlay(pfatfs, paio->segs[i].buf,
+				                 paio->segs[i].nbytes, paio->segs[i].off);
+		}
 
-	/* split path */
-	split_path(pwsz, &dirpart, &filepart);
+		/* windows filled while the write was in flight are stale */
+		if (paio->write)
+			__atomic_fetch_add(&pfatfs->datagen, 1, __ATOMIC_RELEASE);
 
-	/* open directory */
-	pfatdir = fat_opendir(pfatfs, dirpart);
-	if (!pfatdir)
-		goto _free_and_ret;
+		pthread_mutex_lock(&pfatfs->aio_lock);
+		pfatfs->aio_count--;
+		pthread_mutex_unlock(&pfatfs->aio_lock);
+		paio->done(paio->pfatfile, paio->buf, paio->errnum ? 0 : paio->nbytes,
+		           paio->errnum, paio->arg);
 
-	/* if path ends with slash */
-	if (!filepart) {
-		pfatfs->errnum = FAT_ERR_ISDIR;
-		goto _free_and_ret;
+		free(paio->segs);
+		free(paio);
+		count++;
 	}
 
-	/* for each directory entry */
-	while ((dp = fat_readdir(pfatdir))) {
-		/* check the name */
-		if (!wcsncmp(filepart, dp->d_name, sizeof(dp->d_name))) {
+	return count;
+}
 
-			/* is dir, return err */
-			if (dp->d_type == FAT_TYPE_DIRECTORY) {
-				pfatfs->errnum = FAT_ERR_ISDIR;
-				goto _free_and_ret;
-			}
+int
+fat_aio_fd(fatfs_t *pfatfs)
+{
+	if (!pfatfs)
+		return -1;
 
-			pfatfile = calloc(1, sizeof(*pfatfile));
-			if (!pfatfile) {
-				pfatfs->errnum = FAT_ERR_ENOMEM;
-				goto _free_and_ret;
-			}
+#ifdef FAT_HAVE_URING
+	if (pfatfs->pring)
+		return pfatfs->pring->evfd;
+#endif
+
+	return -1;
+}
+
+#ifdef FAT_HAVE_SENDFILE
+/* move up to nbytes from in_fd to out_fd in the kernel, *pmethod goes to
+   the next primitive each time one is refused for this pair */
+static ssize_t
+fatfs_kernel_copy(int in_fd, int out_fd, fatoff_t off, size_t nbytes,
+                  int *pmethod)
+{
+	loff_t loff = (loff_t) off;
+	off_t soff = (off_t) off;
+	ssize_t n = -1;
+
+	while (*pmethod != FAT_XFER_BUFFERED) {
+		if (*pmethod == FAT_XFER_COPY_RANGE)
+			n = copy_file_range(in_fd, &loff, out_fd, NULL, nbytes, 0);
+		else if (*pmethod == FAT_XFER_SENDFILE)
+			n = sendfile(out_fd, in_fd, &soff, nbytes);
+		else
+			n = splice(in_fd, &loff, out_fd, NULL, nbytes, 0);
+
+		if (n > 0)
+			return n;
+
+		/* anything but a refusal is an error of out_fd */
+		if ((n < 0) && (errno != EINVAL) && (errno != EXDEV) &&
+			(errno != EBADF) && (errno != ENOSYS) && (errno != EOPNOTSUPP))
+			return -1;
+
+		(*pmethod)++;
+	}
+
+	return -1;
+}
+
+/* send file data straight from the image descriptor */
+static size_t
+fatfs_sendfile_kernel(fatfile_t *pfatfile, int out_fd, fatoff_t pos,
+                      size_t count)
+{
+	fatfs_t *pfatfs = pfatfile->pfatfs;
+	int method = FAT_XFER_COPY_RANGE;
+	struct fatseg *segs;
+	size_t nsegs, total = 0;
+	ssize_t n;
+
+	/* the device must hold what is still in memory */
+	if (fatfs_aio_drain(pfatfs) || fatcache_flush(pfatfs)) {
+		fat_errnum = FAT_ERR_IO;
+		return 0;
+	}
 
-			/* init the file structure */
-			pfatfile->pfatfs = pfatfs;
-			pfatfile->privoff = dp->d_privoff;
-			pfatfile->block.cluster = INVALID_CLUSTER;
-			pfatfile->block.clsinit = INVALID_CLUSTER;
-			pfatfile->mode = oflag_mode;
-			pfatfile->filesize = dp->d_size;
-			pfatfile->oversize = 0;
+	segs = fatfs_fatfile_segments(pfatfile, NULL, count, pos, &nsegs);
+	if (!segs)
+		return 0;
 
-			/* if file is not empty, it has a valid block */
-			if (dp->d_size)
-				fatfs_fatblock_init(pfatfile->pfatfs, &pfatfile->block,
-				                    dp->d_cluster);
+	for (size_t i = 0; i < nsegs; ) {
+		n = fatfs_kernel_copy(pfatfs->fd, out_fd, pfatfs->offset + segs[i].off,
+		                      segs[i].nbytes, &method);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* refused, the rest is copied by fat_sendfile */
+			if (method != FAT_XFER_BUFFERED)
+				fat_errnum = FAT_ERR_IO;
+			break;
 		}
+
+		total += (size_t) n;
+		segs[i].off += n;
+		segs[i].nbytes -= (size_t) n;
+		if (!segs[i].nbytes)
+			i++;
 	}
 
-	/* if err, return */
-	if (pfatfs->errnum)
-		goto _free_and_ret;
+	free(segs);
+	return total;
+}
+#endif
 
-	if (!pfatfile) {
-		//if (!create) {
-			pfatfs->errnum = FAT_ERR_NOENT;
-		//	goto _free_and_ret;
-		//}
+/* read into a buffer and write it to out_fd */
+static size_t
+fatfs_sendfile_buffered(fatfile_t *pfatfile, int out_fd, fatoff_t pos,
+                        size_t count)
+{
+	size_t total = 0, nread, nwrite;
+	uint8_t *buf;
+	ssize_t n;
 
-		// TODO: create file
+	buf = (uint8_t *) malloc(FAT_SENDFILE_BUFSZ);
+	if (!buf) {
+		fat_errnum = FAT_ERR_ENOMEM;
+		return 0;
+	}
 
-	} else if (trunc) {
-		if (fatfile_truncate(pfatfile, 0)) {
-			fat_fclose(pfatfile);
-			pfatfile = NULL;
+	if (fat_fseek(pfatfile, pos, FAT_SEEK_SET))
+		goto out;
+
+	while (total < count) {
+		nread = (count - total > FAT_SENDFILE_BUFSZ) ? FAT_SENDFILE_BUFSZ :
+			count - total;
+		if (fat_fread(buf, 1, nread, pfatfile) != nread) {
+			if (!fat_errnum)
+				fat_errnum = FAT_ERR_IO;
+			break;
+		}
+
+		for (nwrite = 0; nwrite < nread; nwrite += (size_t) n) {
+			n = write(out_fd, buf + nwrite, nread - nwrite);
+			if (n < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+
+				fat_errnum = FAT_ERR_IO;
+				total += nwrite;
+				goto out;
+			}
 		}
+
+		total += nread;
 	}
 
-_free_and_ret:
-	free(pwsz);
-	fat_closedir(pfatdir);
-	return pfatfile;
+out:
+	free(buf);
+	return total;
 }
 
-size_t
-fat_fread(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+static size_t
+fatfile_sendfile(int out_fd, fatfile_t *pfatfile, fatoff_t *poffset,
+                 size_t count)
 {
-	size_t bytes_to_read = size * nitems;
+	fatfs_t *pfatfs;
+	fatoff_t pos, saved;
+	size_t total = 0;
+	int errnum;
 
 	/* sanity check */
 	if (!pfatfile)
 		return 0;
 
-	if (!buf || ((bytes_to_read < size) || (bytes_to_read < nitems))) {
-		pfatfile->pfatfs->errnum = FAT_ERR_INVAL;
+	pfatfs = pfatfile->pfatfs;
+	fat_errnum = FAT_ERR_SUCCESS;
+	if ((out_fd < 0) || (poffset && (*poffset < 0))) {
+		fat_errnum = FAT_ERR_INVAL;
 		return 0;
 	}
 
 	/* above max size */
-	if (bytes_to_read > UINT_MAX) {
-		pfatfile->pfatfs->errnum = FAT_ERR_MAXSIZE;
+	if (count > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
 		return 0;
 	}
 
-	pfatfile->pfatfs->errnum = FAT_ERR_SUCCESS;
-	if (!bytes_to_read)
-		return 0;
-
 	/* check mode */
 	if ((pfatfile->mode & FAT_FILE_MODE_READ) == 0) {
-		pfatfile->pfatfs->errnum = FAT_ERR_WRONLY;
+		fat_errnum = FAT_ERR_WRONLY;
 		return 0;
 	}
 
 	/* check file bounds */
-	if ((fat_ftell(pfatfile) + (fatoff_t) bytes_to_read) > pfatfile->filesize)
-		bytes_to_read = pfatfile->filesize - fat_ftell(pfatfile);
+	saved = fat_ftell(pfatfile);
+	pos = (poffset) ? *poffset : saved;
+	if (pos >= pfatfile->filesize)
+		return 0;
 
-	return fatfs_read_from_block(pfatfile->pfatfs, buf, bytes_to_read,
-	                             &pfatfile->block);
+	if ((pos + (fatoff_t) count) > pfatfile->filesize)
+		count = (size_t) (pfatfile->filesize - pos);
+
+#ifdef FAT_HAVE_SENDFILE
+	if (pfatfs->fd >= 0)
+		total = fatfs_sendfile_kernel(pfatfile, out_fd, pos, count);
+#endif
+
+	/* what the kernel did not move goes through a buffer */
+	if ((total < count) && !fat_errnum)
+		total += fatfs_sendfile_buffered(pfatfile, out_fd,
+		                                 pos + (fatoff_t) total, count - total);
+
+	/* the file pointer moves only without an offset */
+	errnum = fat_errnum;
+	if (poffset) {
+		*poffset = pos + (fatoff_t) total;
+		if (fat_ftell(pfatfile) != saved)
+			fat_fseek(pfatfile, saved, FAT_SEEK_SET);
+	} else {
+		fat_fseek(pfatfile, pos + (fatoff_t) total, FAT_SEEK_SET);
+	}
+
+	fat_errnum = errnum;
+	return total;
 }
 
 size_t
-fat_fwrite(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile)
+fat_sendfile(int out_fd, fatfile_t *pfatfile, fatoff_t *poffset, size_t count)
 {
-	size_t bytes_to_write = size * nitems;
-	size_t nwrite;
+	size_t ncopy;
+
+	if (!pfatfile)
+		return 0;
+
+	fatfile_lock(pfatfile);
+	ncopy = fatfile_sendfile(out_fd, pfatfile, poffset, count);
+	fatfile_unlock(pfatfile);
+	return ncopy;
+}
+
+size_t
+fat_pread(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t offset)
+{
+	fatfs_t *pfatfs;
+	struct fatseg *segs;
+	size_t count, total_read = 0;
 
 	/* sanity check */
 	if (!pfatfile)
 		return 0;
 
-	if (!buf || ((bytes_to_write < size) || (bytes_to_write < nitems))) {
-		pfatfile->pfatfs->errnum = FAT_ERR_INVAL;
+	pfatfs = pfatfile->pfatfs;
+	if (!buf || (offset < 0)) {
+		fat_errnum = FAT_ERR_INVAL;
 		return 0;
 	}
 
 	/* above max size */
-	if (bytes_to_write > UINT_MAX) {
-		pfatfile->pfatfs->errnum = FAT_ERR_MAXSIZE;
+	if (nbytes > UINT_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
 		return 0;
 	}
 
-	pfatfile->pfatfs->errnum = FAT_ERR_SUCCESS;
-	if (!bytes_to_write)
+	/* the file is locked for the extent map only, the transfers of other
+	   threads on this handle run alongside */
+	fat_errnum = FAT_ERR_SUCCESS;
+	fatfile_lock(pfatfile);
+
+	/* check mode */
+	segs = NULL;
+	if ((pfatfile->mode & FAT_FILE_MODE_READ) == 0)
+		fat_errnum = FAT_ERR_WRONLY;
+
+	/* check file bounds */
+	else if (offset < pfatfile->filesize) {
+		if ((offset + (fatoff_t) nbytes) > pfatfile->filesize)
+			nbytes = (size_t) (pfatfile->filesize - offset);
+
+		/* the extent map gives the device ranges, the file block is not used */
+		segs = fatfs_fatfile_segments(pfatfile, (uint8_t *) buf, nbytes,
+		                              offset, &count);
+	}
+
+	pthread_mutex_unlock(&pfatfile->lock);
+	if (!segs) {
+		fatfs_unlock(pfatfs);
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; i += FAT_READ_BATCH) {
+		size_t batch = (count - i > FAT_READ_BATCH) ? FAT_READ_BATCH :
+			count - i;
+
+		if (fatfs_read_segments(pfatfs, segs + i, batch))
+			break;
+
+		for (size_t j = i; j < i + batch; j++)
+			total_read += segs[j].nbytes;
+	}
+
+	fatfs_unlock(pfatfs);
+	free(segs);
+	return total_read;
+}
+
+static size_t
+fatfile_pwrite(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t offset)
+{
+	fatfs_t *pfatfs;
+	struct fatseg *segs;
+	fatoff_t pos, end;
+	size_t count, nwrite, total_write = 0;
+	int grow;
+
+	/* sanity check */
+	if (!pfatfile)
+		return 0;
+
+	pfatfs = pfatfile->pfatfs;
+	if (!buf || (offset < 0)) {
+		fat_errnum = FAT_ERR_INVAL;
+		return 0;
+	}
+
+	/* above max size */
+	end = offset + (fatoff_t) nbytes;
+	if ((nbytes > UINT_MAX) || (end > UINT32_MAX)) {
+		fat_errnum = FAT_ERR_MAXSIZE;
 		return 0;
+	}
 
 	/* check mode */
+	fat_errnum = FAT_ERR_SUCCESS;
 	if ((pfatfile->mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND)) == 0) {
-		pfatfile->pfatfs->errnum = FAT_ERR_RDONLY;
+		fat_errnum = FAT_ERR_RDONLY;
 		return 0;
 	}
 
-	if (pfatfile->mode & FAT_FILE_MODE_APPEND) {
-		if(fat_fseek(pfatfile, 0, FAT_SEEK_END))
-			return 0;
-	}
+	if (!nbytes)
+		return 0;
 
-	/* if necessary, commit out-of-bounds size */
-	if (pfatfile->oversize) {
-		if (fatfile_truncate(pfatfile, pfatfile->filesize + pfatfile->oversize))
-			return 0;
+	/* growing moves the file block, it is put back at the end */
+	grow = (end > pfatfile->filesize);
+	pos = (pfatfile->block.cluster == INVALID_CLUSTER) ? pfatfile->oversize :
+		fat_ftell(pfatfile);
 
-		/* truncate does not update the file pointer
-		   we should update it if mode != append */
-		if ((pfatfile->mode & FAT_FILE_MODE_APPEND) == 0) {
-			if(fat_fseek(pfatfile, 0, FAT_SEEK_END))
-				return 0;
-		}
+	/* zero-fill the gap, then reserve the rest of the write */
+	if (grow && (offset > pfatfile->filesize) &&
+		fatfile_truncate(pfatfile, offset))
+		goto out;
 
-	/* file is empty, allocate one block */
-	} else if (pfatfile->filesize == 0) {
-		if (fatfile_truncate(pfatfile, 1))
-			return 0;
+	if (grow && fatfs_fatfile_reserve(pfatfile, end))
+		goto out;
+
+	segs = fatfs_fatfile_segments(pfatfile, (uint8_t *) buf, nbytes, offset,
+	                              &count);
+	if (!segs)
+		goto out;
+
+	for (size_t i = 0; i < count; i++) {
+		nwrite = fatfs_write_data(pfatfs, segs[i].buf, segs[i].nbytes,
+		                          segs[i].off);
+		total_write += nwrite;
+		if (fat_errnum)
+			break;
 	}
 
-	/* write bytes */
-	nwrite = fatfs_write_to_block(pfatfile->pfatfs, buf, bytes_to_write,
-	                              &pfatfile->block);
+	free(segs);
+	fatfile_data_changed(pfatfile);
 
 	/* if necessary, adjust filesize */
-	fatoff_t curoff = fat_ftell(pfatfile);
-	if (curoff > pfatfile->filesize) {
-		fatfs_privdirent_update_size(pfatfile->pfatfs,pfatfile->privoff,curoff);
-		pfatfile->filesize = curoff;
+	if (offset + (fatoff_t) total_write > pfatfile->filesize) {
+		pfatfile->filesize = offset + (fatoff_t) total_write;
+		fatfs_privdirent_update_size(pfatfs, pfatfile->privoff,
+		                             pfatfile->filesize);
+	}
+
+out:
+	if (grow) {
+		int errnum = fat_errnum;
+
+		fat_fseek(pfatfile, pos, FAT_SEEK_SET);
+		fat_errnum = errnum;
 	}
 
+	return total_write;
+}
+
+size_t
+fat_pwrite(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t offset)
+{
+	size_t nwrite;
+
+	if (!pfatfile)
+		return 0;
+
+	fatfile_lock(pfatfile);
+	nwrite = fatfile_pwrite(pfatfile, buf, nbytes, offset);
+	fatfile_unlock(pfatfile);
 	return nwrite;
 }
 
+static int
+fatfile_fmap(fatfile_t *pfatfile, struct fat_extent *pextents, size_t max,
+             size_t *pcount)
+{
+	fatfs_t *pfatfs;
+	fatoff_t bpc, logical = 0;
+	size_t count = 0;
+
+	/* sanity check */
+	if (!pfatfile)
+		return -1;
+
+	pfatfs = pfatfile->pfatfs;
+	fat_errnum = FAT_ERR_SUCCESS;
+	if (!pcount || (max && !pextents)) {
+		fat_errnum = FAT_ERR_INVAL;
+		return -1;
+	}
+
+	*pcount = 0;
+	if (!pfatfile->filesize)
+		return 0;
+
+	if (fatextmap_build(pfatfs, &pfatfile->map, pfatfile->block.clsinit))
+		return -1;
+
+	/* runs are merged by the map, the last one stops at the file size */
+	bpc = pfatfs->bytes_per_cluster;
+	for (size_t i = 0; i < pfatfile->map.count; i++) {
+		struct fatextent *pext = &pfatfile->map.extents[i];
+		fatoff_t length = (fatoff_t) pext->length * bpc;
+
+		logical = (fatoff_t) pext->index * bpc;
+		if (logical >= pfatfile->filesize)
+			break;
+
+		if (length > pfatfile->filesize - logical)
+			length = pfatfile->filesize - logical;
+
+		if (count < max) {
+			pextents[count].e_logical = logical;
+			pextents[count].e_physical = pfatfs->offset +
+				fatfs_clus2off(pfatfs, pext->cluster);
+			pextents[count].e_length = length;
+		}
+
+		logical += length;
+		count++;
+	}
+
+	/* chain shorter than the file */
+	if (logical < pfatfile->filesize) {
+		fat_errnum = FAT_ERR_IO;
+		return -1;
+	}
+
+	*pcount = count;
+	return 0;
+}
+
 int
-fat_fseek(fatfile_t *pfatfile, fatoff_t offset, int whence)
+fat_fmap(fatfile_t *pfatfile, struct fat_extent *pextents, size_t max,
+         size_t *pcount)
+{
+	int error;
+
+	if (!pfatfile)
+		return -1;
+
+	fatfile_lock(pfatfile);
+	error = fatfile_fmap(pfatfile, pextents, max, pcount);
+	fatfile_unlock(pfatfile);
+	return error;
+}
+
+static int
+fatfile_seek(fatfile_t *pfatfile, fatoff_t offset, int whence)
 {
 	/* check */
 	if (!pfatfile)
 		return -1;
 
 	/* adjust offset */
-	pfatfile->pfatfs->errnum = FAT_ERR_SUCCESS;
+	fat_errnum = FAT_ERR_SUCCESS;
 	if (whence == FAT_SEEK_END)
 		offset += pfatfile->filesize;
 	else if (whence == FAT_SEEK_CUR)
 		offset += fat_ftell(pfatfile);
 	else if (whence != FAT_SEEK_SET) {
-		pfatfile->pfatfs->errnum = FAT_ERR_INVAL;
+		fat_errnum = FAT_ERR_INVAL;
 		return -1;
 	}
 
 	/* check negative */
 	if (offset < 0) {
-		pfatfile->pfatfs->errnum = FAT_ERR_INVAL;
+		fat_errnum = FAT_ERR_INVAL;
 		return -1;
 	}
 
 	/* ensure block is on cluster chain */
 	if (pfatfile->block.cluster != INVALID_CLUSTER) {
-		/* rewind file */
-		fatfs_fatblock_init(pfatfile->pfatfs, &pfatfile->block,
-		                    pfatfile->block.clsinit);
-		pfatfile->oversize = 0;
+		fatfs_t *pfatfs = pfatfile->pfatfs;
+		fatblock_t *pblock = &pfatfile->block;
 
-		/* advance blocks */
-		fatoff_t nblks = (offset / pfatfile->pfatfs->bytes_per_cluster) - 1;
-		if (offset > pfatfile->filesize) {
-			nblks = (pfatfile->filesize / pfatfile->pfatfs->bytes_per_cluster);
-			nblks -= 1;
-		}
+		/* a cluster boundary is the end of the previous cluster */
+		fatoff_t target = (offset > pfatfile->filesize) ? pfatfile->filesize :
+			offset;
+		fatoff_t index = (target > 0) ?
+			(target - 1) / pfatfs->bytes_per_cluster : 0;
 
-		for (fatoff_t i = 0; i < nblks; i++) {
-			if (fatfs_goto_next_block(pfatfile->pfatfs, &pfatfile->block))
-				break;
-		}
+		/* jump straight to the cluster */
+		if (fatextmap_build(pfatfs, &pfatfile->map, pblock->clsinit))
+			return -1;
 
-		/* if err, return */
-		if (pfatfile->pfatfs->errnum)
+		fatclus_t cluster = fatextmap_lookup(&pfatfile->map, (fatclus_t) index);
+		if (cluster == INVALID_CLUSTER) {
+			fat_errnum = FAT_ERR_IO;
 			return -1;
+		}
 
-		/* advance offset */
-		if (offset <= pfatfile->filesize) {
-			pfatfile->block.curoff += offset - fat_ftell(pfatfile);
-		} else
-			pfatfile->block.curoff += pfatfile->filesize - fat_ftell(pfatfile);
+		pblock->cluster = cluster;
+		pblock->index = index;
+		fatblock_forget(pblock);
+		pblock->curoff = fatfs_clus2off(pfatfs, cluster) +
+			(target - (index * pfatfs->bytes_per_cluster));
+		pblock->endoff = fatfs_clus2off(pfatfs, cluster) +
+			pfatfs->bytes_per_cluster;
+		pfatfile->oversize = 0;
 	}
 
 	pfatfile->oversize = offset - fat_ftell(pfatfile);
 	return 0;
 }
 
-fatoff_t
-fat_ftell(fatfile_t *pfatfile)
+int
+fat_fseek(fatfile_t *pfatfile, fatoff_t offset, int whence)
+{
+	int error;
+
+	if (!pfatfile)
+		return -1;
+
+	fatfile_lock(pfatfile);
+	error = fatfile_seek(pfatfile, offset, whence);
+	fatfile_unlock(pfatfile);
+	return error;
+}
+
+static fatoff_t
+fatfile_tell(fatfile_t *pfatfile)
 {
 	fatoff_t offset = 0;
 
@@ -1857,10 +6437,39 @@ fat_ftell(fatfile_t *pfatfile)
 	return offset;
 }
 
+fatoff_t
+fat_ftell(fatfile_t *pfatfile)
+{
+	fatoff_t pos;
+
+	if (!pfatfile)
+		return -1;
+
+	fatfile_lock(pfatfile);
+	pos = fatfile_tell(pfatfile);
+	fatfile_unlock(pfatfile);
+	return pos;
+}
+
 void
 fat_fclose(fatfile_t *pfatfile)
 {
-	free(pfatfile);
+	if (pfatfile) {
+		/* callbacks may still refer to this file */
+		fatfs_aio_drain(pfatfile->pfatfs);
+
+		fatfile_lock(pfatfile);
+		/* write back the metadata changed through this file */
+		if ((pfatfile->mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND)) &&
+			fatcache_flush(pfatfile->pfatfs))
+			fat_errnum = FAT_ERR_IO;
+		fatfile_unlock(pfatfile);
+
+		pthread_mutex_destroy(&pfatfile->lock);
+		fatextmap_free(&pfatfile->map);
+		free(pfatfile->ra.buf);
+		free(pfatfile);
+	}
 }
 
 int
@@ -1873,16 +6482,86 @@ fat_truncate(fatfs_t *pfatfs, const wchar_t *filepath, fatoff_t length)
 		return -1;
 
 	if (!filepath || (length < 0)) {
-		pfatfs->errnum = FAT_ERR_INVAL;
+		fat_errnum = FAT_ERR_INVAL;
 		return -1;
 	}
 
+	/* other handles cache the size and the chain, keep them out */
+	if (fatfs_lock(pfatfs, 1))
+		return -1;
+
 	pfatfile = fat_fopen(pfatfs, filepath, "r+");
+	if (pfatfile) {
+		error = fatfile_truncate(pfatfile, length);
+		fat_fclose(pfatfile);
+	} else
+		error = -1;
+	fatfs_unlock(pfatfs);
+
+	return error;
+}
+
+static int
+fatfile_fallocate(fatfile_t *pfatfile, fatoff_t offset, fatoff_t len,
+                  int flags)
+{
+	fatoff_t end, curoff;
+
+	if (!pfatfile)
+		return -1;
+
+	fat_errnum = FAT_ERR_SUCCESS;
+	if ((offset < 0) || (len <= 0) || (offset > INT64_MAX - len) ||
+		(flags & ~(FAT_FALLOC_KEEP_SIZE | FAT_FALLOC_NOZERO))) {
+		fat_errnum = FAT_ERR_INVAL;
+		return -1;
+	}
+
+	/* fat file size is 32 bits */
+	end = offset + len;
+	if (end > UINT32_MAX) {
+		fat_errnum = FAT_ERR_MAXSIZE;
+		return -1;
+	}
+
+	/* check mode */
+	if ((pfatfile->mode & (FAT_FILE_MODE_WRITE | FAT_FILE_MODE_APPEND)) == 0) {
+		fat_errnum = FAT_ERR_RDONLY;
+		return -1;
+	}
+
+	/* reserve the chain */
+	if (fatfs_fatfile_reserve(pfatfile, end))
+		return -1;
+
+	if ((flags & FAT_FALLOC_KEEP_SIZE) || (end <= pfatfile->filesize))
+		return 0;
+
+	/* commit the new size, the file pointer is left untouched */
+	curoff = fat_ftell(pfatfile);
+	if (flags & FAT_FALLOC_NOZERO) {
+		pfatfile->filesize = end;
+		if (fatfs_privdirent_update_size(pfatfile->pfatfs, pfatfile->privoff,
+		                                 end))
+			return -1;
+
+	} else if (fatfile_truncate(pfatfile, end))
+		return -1;
+
+	return fat_fseek(pfatfile, curoff, FAT_SEEK_SET);
+}
+
+int
+fat_fallocate(fatfile_t *pfatfile, fatoff_t offset, fatoff_t len, int flags)
+{
+	int error;
+
 	if (!pfatfile)
 		return -1;
 
-	error = fatfile_truncate(pfatfile, length);
-	fat_fclose(pfatfile);
+	fatfile_lock(pfatfile);
+	error = fatfile_fallocate(pfatfile, offset, len, flags);
+	fatfile_unlock(pfatfile);
 	return error;
 }
 
@@ -21,6 +21,7 @@ extern "C" {
 #endif
 
 #include <wchar.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef int64_t fatoff_t;
@@ -42,6 +43,79 @@ typedef struct fatfile fatfile_t;
 /* max file name */
 #define FAT_MAX_NAME       260
 
+/* mount flags */
+#define FAT_MOUNT_RDONLY   0x01 /* read-only volume */
+#define FAT_MOUNT_MMAP     0x02 /* map the image, needs FAT_MOUNT_RDONLY */
+#define FAT_MOUNT_NOCACHE  0x04 /* disable the sector cache */
+#define FAT_MOUNT_FATTABLE 0x08 /* keep the active fat decoded in memory */
+#define FAT_MOUNT_NORA     0x10 /* no readahead on sequential fat_fread */
+#define FAT_MOUNT_URING    0x20 /* io_uring device if the kernel has it */
+#define FAT_MOUNT_DIRECT   0x40 /* file data with O_DIRECT, not with mmap */
+#define FAT_MOUNT_FULLSCAN 0x80 /* count free clusters at mount, ignore fsinfo */
+
+/* kernels counting free clusters, for fatmntopt.scan; one the cpu lacks
+   falls back to the best it has below it */
+#define FAT_SCAN_AUTO      0 /* best for this cpu */
+#define FAT_SCAN_SCALAR    1
+#define FAT_SCAN_SSE2      2
+#define FAT_SCAN_AVX2      3
+
+/* fat_fallocate flags */
+#define FAT_FALLOC_KEEP_SIZE 0x01 /* reserve only, keep the file size */
+#define FAT_FALLOC_NOZERO    0x02 /* do not zero-fill, storage is known zero */
+
+/* mount options, a NULL pointer selects the defaults */
+struct fatmntopt {
+	uint32_t flags;
+	size_t   cache_size; /* sector cache size in bytes, 0 for default */
+	size_t   dirty_max;  /* dirty bytes before a write back, 0 for cache_size */
+	size_t   max_io;     /* largest read across contiguous clusters, 0 default */
+	size_t   readahead;  /* largest readahead window in bytes, 0 default */
+	uint32_t scan;       /* FAT_SCAN_* kernel, 0 for the best one */
+};
+
+/* sector cache statistics */
+struct fatcachestat {
+	uint64_t hits;
+	uint64_t misses;
+	size_t   size;       /* bytes */
+};
+
+/* volume usage, see fat_statfs */
+struct fatstatfs {
+	uint32_t f_bsize;    /* cluster size in bytes */
+	uint32_t f_blocks;   /* clusters in the data region */
+	uint32_t f_bfree;    /* free clusters */
+	uint32_t f_bnext;    /* lowest free cluster after a full count, the
+	                        fsinfo next free hint before; 0 if unknown */
+};
+
+/* block device, offsets are absolute on the device */
+struct fatdev {
+	void *priv;
+
+	/* transfer exactly nbytes, return 0 on success or -1 on error */
+	int      (*read_at)(void *priv, void *buf, size_t nbytes, fatoff_t off);
+	int      (*write_at)(void *priv, const void *buf, size_t nbytes,
+	                     fatoff_t off);
+
+	/* optional: commit written data, device size in bytes, release priv */
+	int      (*flush)(void *priv);
+	fatoff_t (*size)(void *priv);
+	void     (*close)(void *priv);
+};
+
+/* run of file data on the device, see fat_fmap */
+struct fat_extent {
+	fatoff_t e_logical;  /* offset in the file */
+	fatoff_t e_physical; /* offset on the device, as given to fatdev */
+	fatoff_t e_length;   /* bytes */
+};
+
+/* completion of an asynchronous transfer, run from fat_aio_poll */
+typedef void (*fat_aio_done)(fatfile_t *pfatfile, void *buf, size_t nbytes,
+                             int errnum, void *arg);
+
 struct fatdirent {
 	fatoff_t      d_privoff;
 	fatclus_t     d_cluster;
@@ -62,27 +136,50 @@ enum {
 	FAT_ERR_NOTDIR,       /* a component of the path is not a directory */
 	FAT_ERR_ISDIR,        /* path is a directory */
 	FAT_ERR_WRONLY,       /* write-only file */
-	FAT_ERR_RDONLY,       /* read-only file  */
+	FAT_ERR_RDONLY,       /* read-only file or volume */
 	FAT_ERR_MAXSIZE,      /* read/write size is above UINT_MAX */
 	FAT_ERR_FULLDISK,     /* disk is full */
 	FAT_ERR_IO,           /* I/O error */
 	FAT_ERR_LOOP,         /* there is a loop in the FAT chain */
 	FAT_ERR_NOTIMPL,      /* function is not implemented */
+	FAT_ERR_DEADLK,       /* the volume is held shared by this thread */
 };
 
 /* file system operations */
 int
 fat_mount(fatfs_t **ppfatfs, const char *filename, fatoff_t offset);
 
+int
+fat_mount_opt(fatfs_t **ppfatfs, const char *filename, fatoff_t offset,
+              const struct fatmntopt *popt);
+
+/* the volume owns pdev->priv from now on, even if the mount fails */
+int
+fat_mount_dev(fatfs_t **ppfatfs, const struct fatdev *pdev, fatoff_t offset,
+              const struct fatmntopt *popt);
+
 void
 fat_umount(fatfs_t *pfatfs);
 
+int
+fat_sync(fatfs_t *pfatfs);
+
 wchar_t *
 fat_getlabel(fatfs_t *pfatfs);
 
+/* error of the last call made by this thread; a volume and its file
+   handles may be shared by threads, a directory handle may not */
 int
 fat_error(fatfs_t *pfatfs);
 
+int
+fat_cachestat(fatfs_t *pfatfs, struct fatcachestat *pstat);
+
+/* the free clusters are counted on the first call, unless fat32 fsinfo
+   has them and the fat is unchanged */
+int
+fat_statfs(fatfs_t *pfatfs, struct fatstatfs *pstat);
+
 /* directory operations */
 fatdir_t *
 fat_opendir(fatfs_t *pfatfs, const wchar_t *path);
@@ -118,6 +215,14 @@ fat_fread(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile);
 size_t
 fat_fwrite(void *buf, size_t size, size_t nitems, fatfile_t *pfatfile);
 
+/* positional transfers, the file pointer does not move; fat_pwrite past
+   the end of file zero-fills the gap */
+size_t
+fat_pread(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t offset);
+
+size_t
+fat_pwrite(fatfile_t *pfatfile, void *buf, size_t nbytes, fatoff_t offset);
+
 int
 fat_fseek(fatfile_t *pfatfile, fatoff_t offset, int whence);
 
@@ -127,9 +232,48 @@ fat_ftell(fatfile_t *pfatfile);
 void
 fat_fclose(fatfile_t *pfatfile);
 
+/* asynchronous file operations, the file pointer moves on submission and
+   buf must stay valid until done runs; fat_fclose, fat_sync and fat_umount
+   complete the pending transfers first. A callback run from fat_sendfile
+   gets FAT_ERR_DEADLK from fat_truncate and from fat_fopen modes that
+   write, the volume is held shared there */
+int
+fat_fread_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                fat_aio_done done, void *arg);
+
+int
+fat_fwrite_async(void *buf, size_t nbytes, fatfile_t *pfatfile,
+                 fat_aio_done done, void *arg);
+
+/* run the callbacks of finished transfers, with wait block for one */
+int
+fat_aio_poll(fatfs_t *pfatfs, int wait);
+
+/* descriptor readable on completions, -1 without io_uring */
+int
+fat_aio_fd(fatfs_t *pfatfs);
+
+/* copy count bytes from offset (the file pointer if NULL, which then moves)
+   to out_fd, in the kernel when the image is a file; a short count leaves
+   the reason in fat_error */
+size_t
+fat_sendfile(int out_fd, fatfile_t *pfatfile, fatoff_t *poffset, size_t count);
+
+/* where the file data lives, adjacent clusters merged: up to max runs are
+   stored and *pcount receives how many the file has; data written through
+   the volume reaches the device on fat_sync */
+int
+fat_fmap(fatfile_t *pfatfile, struct fat_extent *pextents, size_t max,
+         size_t *pcount);
+
 int
 fat_truncate(fatfs_t *pfatfs, const wchar_t *filepath, fatoff_t length);
 
+/* clusters reserved past the file size with FAT_FALLOC_KEEP_SIZE stay in
+   the chain, across fat_fclose, until the file is truncated */
+int
+fat_fallocate(fatfile_t *pfatfile, fatoff_t offset, fatoff_t len, int flags);
+
 int
 fat_unlink(fatfs_t *pfatfs, const wchar_t *path);
 
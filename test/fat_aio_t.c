@@ -0,0 +1,309 @@
+/*
+ * fat_aio_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_fseek, fat_ftell, fat_fread_async,
+ *            fat_fwrite_async, fat_aio_poll, fat_aio_fd, fat_sendfile,
+ *            fat_truncate
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+#define TESTSIZE   20000
+#define SPLITSIZE  (1024 * 1024)
+#define SPLITIO    512
+
+struct result {
+	int    count;
+	size_t nbytes;
+	int    errnum;
+};
+
+static void
+aio_done(fatfile_t *pfatfile, void *buf, size_t nbytes, int errnum, void *arg)
+{
+	struct result *pres = (struct result *) arg;
+
+	(void) pfatfile;
+	(void) buf;
+	pres->count++;
+	pres->nbytes += nbytes;
+	if (errnum)
+		pres->errnum = errnum;
+}
+
+static int
+aio_wait(fatfs_t *pfatfs, struct result *pres, int count)
+{
+	while (pres->count < count) {
+		if (fat_aio_poll(pfatfs, 1) < 0) {
+			fprintf(stderr, "fat_aio_poll: error=%d\n", fat_error(pfatfs));
+			return -1;
+		}
+	}
+
+	return pres->errnum ? -1 : 0;
+}
+
+static int
+test_aio(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	static char wbuf[TESTSIZE], rbuf[TESTSIZE];
+	struct result res = { 0, 0, 0 };
+	fatfile_t *pfatfile;
+	fatoff_t filesize;
+
+	for (int i = 0; i < TESTSIZE; i++)
+		wbuf[i] = (char) (i * 7 + (i >> 9));
+
+	pfatfile = fat_fopen(pfatfs, filepath, "a+");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_END)) {
+		fprintf(stderr, "fat_fseek: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	filesize = fat_ftell(pfatfile);
+
+	/* two writes in flight, the file pointer moves on submission */
+	if (fat_fwrite_async(wbuf, TESTSIZE / 2, pfatfile, aio_done, &res) ||
+		fat_fwrite_async(wbuf + TESTSIZE / 2, TESTSIZE / 2, pfatfile, aio_done,
+		                 &res) ||
+		fat_ftell(pfatfile) != filesize + TESTSIZE) {
+		fprintf(stderr, "fat_fwrite_async: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	if (aio_wait(pfatfs, &res, 2) || res.nbytes != TESTSIZE) {
+		fprintf(stderr, "fat_fwrite_async: %ls: nbytes=%zu error=%d\n",
+		        filepath, res.nbytes, res.errnum);
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* read back, past the end of file */
+	memset(&res, 0, sizeof(res));
+	if (fat_fseek(pfatfile, filesize, FAT_SEEK_SET) ||
+		fat_fread_async(rbuf, TESTSIZE, pfatfile, aio_done, &res) ||
+		fat_fread_async(rbuf, TESTSIZE, pfatfile, aio_done, &res)) {
+		fprintf(stderr, "fat_fread_async: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	if (aio_wait(pfatfs, &res, 2) || res.nbytes != TESTSIZE ||
+		memcmp(rbuf, wbuf, TESTSIZE)) {
+		fprintf(stderr, "fat_fread_async: %ls: nbytes=%zu error=%d\n",
+		        filepath, res.nbytes, res.errnum);
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* nothing left */
+	if (fat_aio_poll(pfatfs, 1) != 0) {
+		fprintf(stderr, "fat_aio_poll: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* fat_fclose completes a pending transfer */
+	memset(&res, 0, sizeof(res));
+	if (fat_fseek(pfatfile, filesize, FAT_SEEK_SET) ||
+		fat_fread_async(rbuf, TESTSIZE, pfatfile, aio_done, &res)) {
+		fprintf(stderr, "fat_fread_async: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	if (res.count != 1 || res.nbytes != TESTSIZE) {
+		fprintf(stderr, "fat_fclose: %ls: pending transfer lost\n", filepath);
+		return -1;
+	}
+
+	fprintf(stderr, "%ls: filesize=%" PRId64 "\n", filepath,
+	        filesize + TESTSIZE);
+	return 0;
+}
+
+struct nested {
+	fatfs_t *pfatfs;
+	fatoff_t length;
+	int count;
+	int error;
+	int errnum;
+};
+
+/* the callback changes the volume from inside the call that ran it */
+static void
+nested_done(fatfile_t *pfatfile, void *buf, size_t nbytes, int errnum,
+            void *arg)
+{
+	struct nested *pnested = (struct nested *) arg;
+
+	(void) pfatfile;
+	(void) buf;
+	(void) nbytes;
+	(void) errnum;
+	pnested->count++;
+	pnested->error = fat_truncate(pnested->pfatfs, SECONDFILE,
+	                              pnested->length);
+	pnested->errnum = fat_error(pnested->pfatfs);
+}
+
+/* fat_sendfile holds the volume shared while it completes transfers */
+static int
+test_aio_nested(fatfs_t *pfatfs)
+{
+	struct nested nested = { pfatfs, 0, 0, 0, 0 };
+	fatfile_t *pfatfile = fat_fopen(pfatfs, SECONDFILE, "r");
+	fatoff_t offset = 0;
+	char buf[16];
+	int fd = open("/dev/null", O_WRONLY), error = -1;
+
+	if (!pfatfile || (fd < 0) || fat_fseek(pfatfile, 0, FAT_SEEK_END))
+		goto out;
+
+	/* the size stays, only the lock is exercised */
+	nested.length = fat_ftell(pfatfile);
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_SET) ||
+		fat_fread_async(buf, sizeof(buf), pfatfile, nested_done, &nested))
+		goto out;
+
+	fat_sendfile(fd, pfatfile, &offset, sizeof(buf));
+	if ((nested.count != 1) || (nested.error != -1) ||
+		(nested.errnum != FAT_ERR_DEADLK)) {
+		fprintf(stderr, "fat_sendfile: nested fat_truncate error=%d\n",
+		        nested.errnum);
+		goto out;
+	}
+
+	/* fat_aio_poll holds nothing */
+	if (fat_fread_async(buf, sizeof(buf), pfatfile, nested_done, &nested) ||
+		(fat_aio_poll(pfatfs, 1) != 1) || (nested.count != 2) ||
+		nested.error) {
+		fprintf(stderr, "fat_aio_poll: nested fat_truncate error=%d\n",
+		        nested.errnum);
+		goto out;
+	}
+
+	error = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	fat_fclose(pfatfile);
+	return error;
+}
+
+/* with a small max_io a request spans more segments than the ring holds */
+static int
+test_aio_split(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	struct result res = { 0, 0, 0 };
+	fatfile_t *pfatfile;
+	fatoff_t filesize;
+	char *wbuf, *rbuf;
+	int error = -1;
+
+	wbuf = malloc(SPLITSIZE);
+	rbuf = calloc(1, SPLITSIZE);
+	pfatfile = fat_fopen(pfatfs, filepath, "a+");
+	if (!wbuf || !rbuf || !pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		goto _done;
+	}
+
+	for (int i = 0; i < SPLITSIZE; i++)
+		wbuf[i] = (char) (i * 13 + (i >> 11));
+
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_END)) {
+		fprintf(stderr, "fat_fseek: error=%d\n", fat_error(pfatfs));
+		goto _done;
+	}
+
+	filesize = fat_ftell(pfatfile);
+
+	/* each request completes exactly once */
+	if (fat_fwrite_async(wbuf, SPLITSIZE, pfatfile, aio_done, &res) ||
+		aio_wait(pfatfs, &res, 1) || (fat_aio_poll(pfatfs, 1) != 0) ||
+		(res.count != 1) || (res.nbytes != SPLITSIZE)) {
+		fprintf(stderr, "fat_fwrite_async: %ls: count=%d nbytes=%zu error=%d\n",
+		        filepath, res.count, res.nbytes, res.errnum);
+		goto _done;
+	}
+
+	memset(&res, 0, sizeof(res));
+	if (fat_fseek(pfatfile, filesize, FAT_SEEK_SET) ||
+		fat_fread_async(rbuf, SPLITSIZE, pfatfile, aio_done, &res) ||
+		aio_wait(pfatfs, &res, 1) || (fat_aio_poll(pfatfs, 1) != 0) ||
+		(res.count != 1) || (res.nbytes != SPLITSIZE) ||
+		memcmp(rbuf, wbuf, SPLITSIZE)) {
+		fprintf(stderr, "fat_fread_async: %ls: count=%d nbytes=%zu error=%d\n",
+		        filepath, res.count, res.nbytes, res.errnum);
+		goto _done;
+	}
+
+	fprintf(stderr, "%ls: split filesize=%" PRId64 "\n", filepath,
+	        filesize + SPLITSIZE);
+	error = 0;
+
+_done:
+	fat_fclose(pfatfile);
+	free(rbuf);
+	free(wbuf);
+	return error;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatmntopt opt;
+
+	for (int i = 1; i < argc; i++) {
+		/* default device, io_uring when available, then split requests */
+		for (int j = 0; j < 3; j++) {
+			memset(&opt, 0, sizeof(opt));
+			opt.flags = j ? FAT_MOUNT_URING : 0;
+			opt.max_io = (j == 2) ? SPLITIO : 0;
+			errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+			if (errnum) {
+				fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i],
+				        errnum);
+				return EXIT_FAILURE;
+			}
+
+			fprintf(stderr, "fat_mount_opt: %s: disk label: %ls aio_fd=%d\n",
+			        argv[i], fat_getlabel(pfatfs), fat_aio_fd(pfatfs));
+
+			if (j == 2) {
+				errnum = test_aio_split(pfatfs, FIRSTFILE);
+			} else if ((errnum = test_aio(pfatfs, FIRSTFILE)) == 0) {
+				errnum = test_aio(pfatfs, SECONDFILE) ||
+					(!j && test_aio_nested(pfatfs));
+			}
+
+			fat_umount(pfatfs);
+
+			if (errnum)
+				return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
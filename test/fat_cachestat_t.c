@@ -0,0 +1,90 @@
+/*
+ * fat_cachestat_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_opendir,
+ *            fat_readdir, fat_rewinddir, fat_closedir, fat_cachestat
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+static int
+test_cachestat(fatfs_t *pfatfs)
+{
+	struct fatcachestat first, second, third;
+
+	/* open root */
+	fatdir_t *pfatdir = fat_opendir(pfatfs, L"/");
+	fprintf(stderr, "fat_opendir: rootdir: error=%d\n", fat_error(pfatfs));
+
+	if (!pfatdir)
+		return -1;
+
+	/* first pass loads the directory sectors */
+	while (fat_readdir(pfatdir));
+	if (fat_cachestat(pfatfs, &first)) {
+		fat_closedir(pfatdir);
+		return -1;
+	}
+
+	fprintf(stderr, "fat_cachestat: hits=%" PRIu64 " misses=%" PRIu64
+	        " size=%zu\n", first.hits, first.misses, first.size);
+
+	/* second pass runs from memory, a rewind would reuse the buffer of
+	   the directory handle */
+	fat_closedir(pfatdir);
+	pfatdir = fat_opendir(pfatfs, L"/");
+	if (!pfatdir)
+		return -1;
+
+	while (fat_readdir(pfatdir));
+	fat_cachestat(pfatfs, &second);
+
+	fprintf(stderr, "fat_cachestat: hits=%" PRIu64 " misses=%" PRIu64
+	        " size=%zu\n", second.hits, second.misses, second.size);
+
+	/* and so does a rewind, from the handle buffer or the cache */
+	fat_rewinddir(pfatdir);
+	while (fat_readdir(pfatdir));
+	fat_cachestat(pfatfs, &third);
+	fat_closedir(pfatdir);
+
+	if ((second.misses != first.misses) || (second.hits <= first.hits) ||
+		(third.misses != first.misses) || (third.hits < second.hits))
+		return -1;
+
+	/* invalid argument */
+	if (!fat_cachestat(pfatfs, NULL))
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatmntopt opt = { 0 };
+
+	for (int i = 1; i < argc; i++) {
+		opt.cache_size = 64 * 1024;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount_opt: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = test_cachestat(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,326 @@
+/*
+ * fat_fallocate_t.c
+ * functions: fat_mount, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_fseek, fat_ftell, fat_fread, fat_fwrite,
+ *            fat_fallocate, fat_truncate, fat_statfs
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+static fatoff_t
+fat_get_filesize(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	fatoff_t offset = 0;
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_END)) {
+		fprintf(stderr, "fat_get_filesize: fat_fseek: error=%d\n",
+		        fat_error(pfatfs));
+		return -1;
+	}
+
+	offset = fat_ftell(pfatfile);
+	fat_fclose(pfatfile);
+	return offset;
+}
+
+static int
+test_keep_size(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	char buf[10000];
+	fatoff_t filesize = fat_get_filesize(pfatfs, filepath);
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "a");
+
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	/* reserve, size must not change */
+	if (fat_fallocate(pfatfile, 0, 65536, FAT_FALLOC_KEEP_SIZE)) {
+		fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	if (fat_get_filesize(pfatfs, filepath) != filesize) {
+		fprintf(stderr, "fat_fallocate: size changed with KEEP_SIZE\n");
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* write into the reserved chain */
+	memset(buf, 'x', sizeof(buf));
+	if (fat_fwrite(buf, 1, sizeof(buf), pfatfile) != sizeof(buf)) {
+		fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+
+	fprintf(stderr, "%ls: filesize=%" PRId64 "\n", filepath,
+	        fat_get_filesize(pfatfs, filepath));
+
+	if (fat_get_filesize(pfatfs, filepath) != filesize + (fatoff_t) sizeof(buf))
+		return -1;
+
+	return 0;
+}
+
+static int
+test_fallocate(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	char c = 1;
+	fatfile_t *pfatfile;
+
+	if (test_keep_size(pfatfs, filepath))
+		return -1;
+
+	/* read-only file */
+	pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (fat_fallocate(pfatfile, 0, 4096, 0) != -1 ||
+		fat_error(pfatfs) != FAT_ERR_RDONLY) {
+		fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r+");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	/* invalid argument */
+	if (fat_fallocate(pfatfile, -1, 4096, 0) != -1 ||
+		fat_fallocate(pfatfile, 0, 0, 0) != -1 ||
+		fat_fallocate(pfatfile, 0, 4096, 0x80) != -1) {
+		fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* grow with zeros, the file pointer stays */
+	if (fat_fallocate(pfatfile, 30000, 10000, 0) || fat_ftell(pfatfile) != 0) {
+		fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	if (fat_fseek(pfatfile, 39999, FAT_SEEK_SET) ||
+		fat_fread(&c, 1, 1, pfatfile) != 1 || c != 0) {
+		fprintf(stderr, "fat_fread: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* grow without zero-filling */
+	if (fat_fallocate(pfatfile, 40000, 5000, FAT_FALLOC_NOZERO)) {
+		fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+
+	fprintf(stderr, "%ls: filesize=%" PRId64 "\n", filepath,
+	        fat_get_filesize(pfatfs, filepath));
+
+	if (fat_get_filesize(pfatfs, filepath) != 45000)
+		return -1;
+
+	return 0;
+}
+
+/* a request larger than the free space fails and allocates nothing */
+static int
+test_fulldisk(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	struct fatstatfs before, after;
+	fatfile_t *pfatfile;
+	fatoff_t filesize;
+	int error;
+
+	/* from the end of the chain, then for an empty file; the truncate
+	   drops what test_keep_size reserved past the size */
+	for (int i = 0; i < 2; i++) {
+		filesize = i ? 0 : fat_get_filesize(pfatfs, filepath);
+		if (fat_truncate(pfatfs, filepath, filesize))
+			return -1;
+
+		pfatfile = fat_fopen(pfatfs, filepath, "r+");
+		if (!pfatfile || fat_statfs(pfatfs, &before)) {
+			fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+			fat_fclose(pfatfile);
+			return -1;
+		}
+
+		error = fat_fallocate(pfatfile, filesize, (fatoff_t) (before.f_bfree +
+		                      10) * before.f_bsize,
+		                      FAT_FALLOC_KEEP_SIZE | FAT_FALLOC_NOZERO);
+		if ((error != -1) || (fat_error(pfatfs) != FAT_ERR_FULLDISK)) {
+			fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+			fat_fclose(pfatfile);
+			return -1;
+		}
+
+		fat_fclose(pfatfile);
+		if (fat_statfs(pfatfs, &after) || (after.f_bfree != before.f_bfree) ||
+			(fat_get_filesize(pfatfs, filepath) != filesize)) {
+			fprintf(stderr, "fat_fallocate: %ls: clusters lost bfree=%u/%u\n",
+			        filepath, after.f_bfree, before.f_bfree);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* free clusters now, -1 on error */
+static int64_t
+statfs_bfree(fatfs_t *pfatfs)
+{
+	struct fatstatfs stat;
+
+	return fat_statfs(pfatfs, &stat) ? -1 : (int64_t) stat.f_bfree;
+}
+
+/* a KEEP_SIZE reservation outlives the handle, truncation gives it back */
+static int
+test_reserve(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	struct fatstatfs stat;
+	fatfile_t *pfatfile;
+	int64_t bfree;
+	char c = 'x';
+
+	if (fat_truncate(pfatfs, filepath, 0) || fat_statfs(pfatfs, &stat))
+		return -1;
+
+	bfree = stat.f_bfree;
+
+	for (int i = 0; i < 2; i++) {
+		/* reserved on an empty file, then again once reopened */
+		pfatfile = fat_fopen(pfatfs, filepath, "r+");
+		if (!pfatfile || fat_fallocate(pfatfile, 0, 8 * stat.f_bsize,
+		                               FAT_FALLOC_KEEP_SIZE)) {
+			fprintf(stderr, "fat_fallocate: error=%d\n", fat_error(pfatfs));
+			fat_fclose(pfatfile);
+			return -1;
+		}
+
+		fat_fclose(pfatfile);
+		if ((statfs_bfree(pfatfs) != bfree - 8) ||
+			(fat_get_filesize(pfatfs, filepath) != 0)) {
+			fprintf(stderr, "fat_fallocate: %ls: pass %d bfree=%" PRId64
+			        "/%" PRId64 "\n", filepath, i, statfs_bfree(pfatfs),
+			        bfree - 8);
+			return -1;
+		}
+	}
+
+	/* a write lands in the reserved chain */
+	pfatfile = fat_fopen(pfatfs, filepath, "a");
+	if (!pfatfile || (fat_fwrite(&c, 1, 1, pfatfile) != 1)) {
+		fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	if ((statfs_bfree(pfatfs) != bfree - 8) ||
+		(fat_get_filesize(pfatfs, filepath) != 1))
+		return -1;
+
+	/* truncating to the same size drops the rest */
+	if (fat_truncate(pfatfs, filepath, 1) ||
+		(statfs_bfree(pfatfs) != bfree - 1) ||
+		(fat_get_filesize(pfatfs, filepath) != 1))
+		return -1;
+
+	/* and so does opening for write, on an empty file */
+	if (fat_truncate(pfatfs, filepath, 0))
+		return -1;
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r+");
+	if (!pfatfile || fat_fallocate(pfatfile, 0, 8 * stat.f_bsize,
+	                               FAT_FALLOC_KEEP_SIZE)) {
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	pfatfile = fat_fopen(pfatfs, filepath, "w");
+	fat_fclose(pfatfile);
+	if (!pfatfile || (statfs_bfree(pfatfs) != bfree)) {
+		fprintf(stderr, "fat_fopen: %ls: reservation kept bfree=%" PRId64
+		        "/%" PRId64 "\n", filepath, statfs_bfree(pfatfs), bfree);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* free clusters as counted by a scan at mount */
+static int
+fullscan_bfree(const char *filename, uint32_t *pbfree)
+{
+	struct fatmntopt opt = { 0 };
+	struct fatstatfs stat;
+	fatfs_t *pfatfs;
+	int error;
+
+	opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_FULLSCAN;
+	if (fat_mount_opt(&pfatfs, filename, 0, &opt))
+		return -1;
+
+	error = fat_statfs(pfatfs, &stat);
+	fat_umount(pfatfs);
+	*pbfree = stat.f_bfree;
+	return error;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatstatfs stat;
+	uint32_t bfree;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount(&pfatfs, argv[i], 0);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		if ((errnum = test_fallocate(pfatfs, FIRSTFILE)) == 0) {
+			errnum = test_fallocate(pfatfs, SECONDFILE) ||
+				test_fulldisk(pfatfs, FIRSTFILE) ||
+				test_reserve(pfatfs, FIRSTFILE) ||
+				fat_statfs(pfatfs, &stat);
+		}
+
+		fat_umount(pfatfs);
+
+		/* nothing was left allocated on the device */
+		if (errnum || fullscan_bfree(argv[i], &bfree) ||
+			(bfree != stat.f_bfree))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/*
+ * fat_fmap_t.c
+ * functions: fat_mount, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_fread, fat_fwrite, fat_sync, fat_fmap
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+#define TESTSIZE   100000
+
+/* grow the file past a few clusters */
+static int
+fill_file(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	static char buf[TESTSIZE];
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "a");
+
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	for (int i = 0; i < TESTSIZE; i++)
+		buf[i] = (char) (i * 7 + (i >> 9));
+
+	if (fat_fwrite(buf, 1, sizeof(buf), pfatfile) != sizeof(buf)) {
+		fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	return fat_sync(pfatfs);
+}
+
+/* read every run straight from the image */
+static int
+test_fmap(fatfs_t *pfatfs, const char *filename, const wchar_t *filepath)
+{
+	static char buf[TESTSIZE * 2], raw[TESTSIZE * 2];
+	struct fat_extent *pextents = NULL;
+	fatoff_t logical = 0;
+	size_t count, nread;
+	fatfile_t *pfatfile;
+	int fd, ret = -1;
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	nread = fat_fread(buf, 1, sizeof(buf), pfatfile);
+	fd = open(filename, O_RDONLY);
+
+	/* count first, then fetch */
+	if ((fd < 0) || fat_fmap(pfatfile, NULL, 0, &count) || !count ||
+		!(pextents = calloc(count, sizeof(*pextents))) ||
+		fat_fmap(pfatfile, pextents, count, &count)) {
+		fprintf(stderr, "fat_fmap: error=%d\n", fat_error(pfatfs));
+		goto out;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if ((pextents[i].e_logical != logical) ||
+			(pextents[i].e_length > (fatoff_t) (nread - logical)) ||
+			(pread(fd, raw + logical, pextents[i].e_length,
+			       pextents[i].e_physical) != pextents[i].e_length)) {
+			fprintf(stderr, "fat_fmap: %ls: bad extent %zu\n", filepath, i);
+			goto out;
+		}
+
+		logical += pextents[i].e_length;
+	}
+
+	if ((logical != (fatoff_t) nread) || memcmp(buf, raw, nread)) {
+		fprintf(stderr, "fat_fmap: %ls: data mismatch\n", filepath);
+		goto out;
+	}
+
+	fprintf(stderr, "%ls: extents=%zu size=%zu\n", filepath, count, nread);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	free(pextents);
+	fat_fclose(pfatfile);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount(&pfatfs, argv[i], 0);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = fill_file(pfatfs, FIRSTFILE);
+		if (!errnum)
+			errnum = test_fmap(pfatfs, argv[i], FIRSTFILE);
+		if (!errnum)
+			errnum = test_fmap(pfatfs, argv[i], SECONDFILE);
+
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -1,12 +1,13 @@
 /*
  * fat_fread_t.c
  * functions: fat_mount, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
- *            fat_error, fat_fread
+ *            fat_error, fat_fread, fat_fseek, fat_pwrite
  */
 
 #include "fat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define FIRSTFILE  L"/FIRST.txt"
 #define SECONDFILE L"Second_File_Using_Long_Name.txt"
@@ -38,6 +39,52 @@ test_readfile(fatfs_t *pfatfs, const wchar_t *filepath)
 	return 0;
 }
 
+/* reads ahead of one handle see writes made through another */
+static int
+test_coherence(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	char buf[4];
+	int error = -1;
+	fatfile_t *preader = fat_fopen(pfatfs, filepath, "r");
+	fatfile_t *pwriter = fat_fopen(pfatfs, filepath, "r+");
+
+	if (!preader || !pwriter) {
+		fprintf(stderr, "fat_fopen: %ls: error=%d\n", filepath,
+		        fat_error(pfatfs));
+		goto out;
+	}
+
+	/* the first reads fill the window past what they return */
+	if ((fat_fread(buf, 1, sizeof(buf), preader) != sizeof(buf)) ||
+		(fat_fread(buf, 1, sizeof(buf), preader) != sizeof(buf)))
+		goto out;
+
+	/* sequential, the next bytes changed */
+	if ((fat_pwrite(pwriter, "YYYY", 4, 8) != 4) ||
+		(fat_fread(buf, 1, sizeof(buf), preader) != sizeof(buf)) ||
+		memcmp(buf, "YYYY", 4)) {
+		fprintf(stderr, "fat_fread: %ls: stale data after a write\n",
+		        filepath);
+		goto out;
+	}
+
+	/* seek back over bytes written since */
+	if ((fat_pwrite(pwriter, "ZZZZ", 4, 0) != 4) ||
+		fat_fseek(preader, 0, FAT_SEEK_SET) ||
+		(fat_fread(buf, 1, sizeof(buf), preader) != sizeof(buf)) ||
+		memcmp(buf, "ZZZZ", 4)) {
+		fprintf(stderr, "fat_fread: %ls: stale data after a seek\n",
+		        filepath);
+		goto out;
+	}
+
+	error = 0;
+out:
+	fat_fclose(pwriter);
+	fat_fclose(preader);
+	return error;
+}
+
 int main(int argc, char *argv[])
 {
 	int errnum;
@@ -55,7 +102,8 @@ int main(int argc, char *argv[])
 		        fat_getlabel(pfatfs));
 
 		if ((errnum = test_readfile(pfatfs, FIRSTFILE)) == 0) {
-			errnum = test_readfile(pfatfs, SECONDFILE);
+			errnum = test_readfile(pfatfs, SECONDFILE) ||
+				test_coherence(pfatfs, FIRSTFILE);
 		}
 
 		fat_umount(pfatfs);
@@ -1,14 +1,23 @@
 /*
  * fat_fseek_t.c
  * functions: fat_mount, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
- *            fat_error, fat_fseek, fat_ftell
+ *            fat_error, fat_fseek, fat_ftell, fat_fread, fat_fwrite,
+ *            fat_truncate, fat_statfs
  */
 
 #include "fat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 
+#define BACKFILE   L"/FILE001.TXT"
+#define OTHERFILE  L"/FILE002.TXT"
+
+/* clusters of BACKFILE, single sectors on fat32 */
+#define NCLUSTERS  16
+#define KEEPBYTES  100
+
 struct seekpos {
 	fatoff_t off;
 	int whence;
@@ -73,6 +82,139 @@ _close_and_quit:
 	return error;
 }
 
+static uint8_t
+pattern(fatoff_t off, int gen)
+{
+	return (uint8_t) (off * 7 + off / 512 + gen);
+}
+
+/* write the pattern of gen over [from, to) */
+static int
+write_pattern(fatfile_t *pfatfile, fatoff_t from, fatoff_t to, int gen)
+{
+	uint8_t *buf = malloc((size_t) (to - from));
+	int error = -1;
+
+	if (!buf || !pfatfile)
+		goto out;
+
+	for (fatoff_t off = from; off < to; off++)
+		buf[off - from] = pattern(off, gen);
+
+	if (!fat_fseek(pfatfile, from, FAT_SEEK_SET) &&
+		(fat_fwrite(buf, 1, (size_t) (to - from), pfatfile) ==
+		 (size_t) (to - from)))
+		error = 0;
+out:
+	free(buf);
+	return error;
+}
+
+static int
+write_file(fatfs_t *pfatfs, const wchar_t *filepath, fatoff_t from,
+           fatoff_t to, int gen)
+{
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "r+");
+	int error = write_pattern(pfatfile, from, to, gen);
+
+	fat_fclose(pfatfile);
+	return error;
+}
+
+/* read from the last cluster to the first, across each boundary and
+   whole clusters; bytes before split are of gen 0, the rest of gen */
+static int
+read_backward(fatfile_t *pfatfile, fatoff_t bsize, fatoff_t split, int gen)
+{
+	uint8_t *buf = malloc((size_t) bsize);
+	fatoff_t start;
+	size_t len;
+	int error = -1;
+
+	if (!buf || !pfatfile)
+		goto out;
+
+	for (fatoff_t k = NCLUSTERS - 1; k >= 0; k--) {
+		for (int i = 0; i < 2; i++) {
+			start = (i || !k) ? k * bsize : k * bsize - 8;
+			len = (i || !k) ? (size_t) bsize : 16;
+
+			if (fat_fseek(pfatfile, start, FAT_SEEK_SET) ||
+				(fat_fread(buf, 1, len, pfatfile) != len)) {
+				fprintf(stderr, "fat_fread: %" PRId64 ": short read\n", start);
+				goto out;
+			}
+
+			for (size_t j = 0; j < len; j++) {
+				fatoff_t off = start + (fatoff_t) j;
+
+				if (buf[j] != pattern(off, (off < split) ? 0 : gen)) {
+					fprintf(stderr, "fat_fread: %" PRId64 ": bad data\n", off);
+					goto out;
+				}
+			}
+		}
+	}
+
+	error = 0;
+out:
+	free(buf);
+	return error;
+}
+
+static int
+read_file(fatfs_t *pfatfs, const wchar_t *filepath, fatoff_t bsize,
+          fatoff_t split, int gen)
+{
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "r");
+	int error = read_backward(pfatfile, bsize, split, gen);
+
+	fat_fclose(pfatfile);
+	return error;
+}
+
+/* backward reads over many clusters, again once a truncate and a
+   regrowth gave the file a new tail */
+static int
+test_backward(fatfs_t *pfatfs)
+{
+	struct fatstatfs stat;
+	fatfile_t *pfatfile;
+	fatoff_t bsize, size;
+	int error;
+
+	if (fat_statfs(pfatfs, &stat))
+		return -1;
+
+	bsize = stat.f_bsize;
+	size = NCLUSTERS * bsize;
+	if (write_file(pfatfs, BACKFILE, 0, size, 0) ||
+		read_file(pfatfs, BACKFILE, bsize, size, 0))
+		return -1;
+
+	/* the clusters given back go to another file first, neither file
+	   may see the data of the other */
+	if (fat_truncate(pfatfs, BACKFILE, KEEPBYTES) ||
+		write_file(pfatfs, OTHERFILE, 0, size, 2) ||
+		write_file(pfatfs, BACKFILE, KEEPBYTES, size, 1) ||
+		read_file(pfatfs, BACKFILE, bsize, KEEPBYTES, 1) ||
+		read_file(pfatfs, OTHERFILE, bsize, 0, 2))
+		return -1;
+
+	/* and through the handle that truncated */
+	pfatfile = fat_fopen(pfatfs, BACKFILE, "w+");
+	error = !pfatfile || write_file(pfatfs, OTHERFILE, 0, size, 3) ||
+		write_pattern(pfatfile, 0, size, 4) ||
+		read_backward(pfatfile, bsize, 0, 4);
+	fat_fclose(pfatfile);
+
+	if (error || read_file(pfatfs, BACKFILE, bsize, 0, 4) ||
+		read_file(pfatfs, OTHERFILE, bsize, 0, 3))
+		return -1;
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int errnum;
@@ -89,7 +231,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
 		        fat_getlabel(pfatfs));
 
-		errnum = test_seekfile(pfatfs);
+		errnum = test_seekfile(pfatfs) || test_backward(pfatfs);
 		fat_umount(pfatfs);
 
 		if (errnum)
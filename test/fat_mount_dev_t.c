@@ -0,0 +1,91 @@
+/*
+ * fat_mount_dev_t.c
+ * functions: fat_mount_dev, fat_umount, fat_getlabel, fat_opendir,
+ *            fat_readdir, fat_closedir
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* stdio device, exercises a user supplied backend */
+static int
+stdio_read_at(void *priv, void *buf, size_t nbytes, fatoff_t off)
+{
+	FILE *stream = (FILE *) priv;
+
+	if (fseeko(stream, off, SEEK_SET))
+		return -1;
+
+	return (fread(buf, 1, nbytes, stream) == nbytes) ? 0 : -1;
+}
+
+static int
+stdio_write_at(void *priv, const void *buf, size_t nbytes, fatoff_t off)
+{
+	FILE *stream = (FILE *) priv;
+
+	if (fseeko(stream, off, SEEK_SET))
+		return -1;
+
+	return (fwrite(buf, 1, nbytes, stream) == nbytes) ? 0 : -1;
+}
+
+static int
+stdio_flush(void *priv)
+{
+	return fflush((FILE *) priv);
+}
+
+static void
+stdio_close(void *priv)
+{
+	fclose((FILE *) priv);
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	fatdir_t *pfatdir;
+	struct fatdirent *dp;
+	struct fatdev dev;
+
+	for (int i = 1; i < argc; i++) {
+		dev.priv = fopen(argv[i], "r+b");
+		if (!dev.priv) {
+			fprintf(stderr, "fopen: %s: failed\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		dev.read_at = stdio_read_at;
+		dev.write_at = stdio_write_at;
+		dev.flush = stdio_flush;
+		dev.size = NULL;
+		dev.close = stdio_close;
+
+		errnum = fat_mount_dev(&pfatfs, &dev, 0, NULL);
+		if (errnum) {
+			fprintf(stderr, "fat_mount_dev: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount_dev: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		pfatdir = fat_opendir(pfatfs, L"/");
+		if (!pfatdir) {
+			fprintf(stderr, "fat_opendir: error=%d\n", fat_error(pfatfs));
+			fat_umount(pfatfs);
+			return EXIT_FAILURE;
+		}
+
+		while ((dp = fat_readdir(pfatdir)))
+			fprintf(stderr, "fat_readdir: %ls\n", dp->d_name);
+
+		fat_closedir(pfatdir);
+		fat_umount(pfatfs);
+	}
+
+	return EXIT_SUCCESS;
+}
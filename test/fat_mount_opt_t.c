@@ -0,0 +1,186 @@
+/*
+ * fat_mount_opt_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_fopen, fat_fread,
+ *            fat_fclose, fat_error, fat_truncate, fat_fwrite, fat_fseek
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+
+static int
+test_read(fatfs_t *pfatfs)
+{
+	size_t nread;
+	char buf[64];
+
+	fatfile_t *pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r");
+	fprintf(stderr, "fat_fopen: %ls: error=%d\n", FIRSTFILE, fat_error(pfatfs));
+
+	if (!pfatfile)
+		return -1;
+
+	nread = fat_fread(buf, 1, sizeof(buf) - 1, pfatfile);
+	buf[nread] = '\0';
+	fprintf(stderr, "fat_fread: n=%zu: %s", nread, buf);
+	fat_fclose(pfatfile);
+
+	return (nread) ? 0 : -1;
+}
+
+static int
+test_rdonly(fatfs_t *pfatfs)
+{
+	fatfile_t *pfatfile;
+
+	if (test_read(pfatfs))
+		return -1;
+
+	/* writes must fail */
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r+");
+	fprintf(stderr, "fat_fopen(r+): error=%d\n", fat_error(pfatfs));
+	if (pfatfile || (fat_error(pfatfs) != FAT_ERR_RDONLY)) {
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	if (!fat_truncate(pfatfs, FIRSTFILE, 0))
+		return -1;
+
+	fprintf(stderr, "fat_truncate: error=%d\n", fat_error(pfatfs));
+	return (fat_error(pfatfs) == FAT_ERR_RDONLY) ? 0 : -1;
+}
+
+/* unaligned write then read back, both through direct I/O */
+static int
+test_direct(fatfs_t *pfatfs)
+{
+	static char wbuf[10000], rbuf[10000];
+	fatfile_t *pfatfile;
+	int ret = -1;
+
+	for (size_t i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = (char) (i * 13 + (i >> 8));
+
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r+");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	if (fat_fseek(pfatfile, 3, FAT_SEEK_SET) ||
+		fat_fwrite(wbuf, 1, sizeof(wbuf), pfatfile) != sizeof(wbuf) ||
+		fat_fseek(pfatfile, 3, FAT_SEEK_SET) ||
+		fat_fread(rbuf, 1, sizeof(rbuf), pfatfile) != sizeof(rbuf)) {
+		fprintf(stderr, "fat_fwrite/fat_fread: error=%d\n", fat_error(pfatfs));
+		goto out;
+	}
+
+	if (memcmp(wbuf, rbuf, sizeof(wbuf))) {
+		fprintf(stderr, "fat_fread: data mismatch\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	fat_fclose(pfatfile);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatmntopt opt = { 0 };
+
+	for (int i = 1; i < argc; i++) {
+		/* mmap without read-only is invalid */
+		opt.flags = FAT_MOUNT_MMAP;
+		if (fat_mount_opt(&pfatfs, argv[i], 0, &opt) != FAT_ERR_INVAL)
+			return EXIT_FAILURE;
+
+		opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_MMAP;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount_opt: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = test_rdonly(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* in memory fat */
+		opt.flags = FAT_MOUNT_FATTABLE;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		errnum = test_read(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* one cluster per read, no readahead */
+		opt.flags = FAT_MOUNT_NORA;
+		opt.max_io = 1;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+		opt.max_io = 0;
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		errnum = test_read(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* file data around the page cache */
+		opt.flags = FAT_MOUNT_DIRECT;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		errnum = test_direct(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* what direct I/O wrote is seen through the page cache */
+		opt.flags = 0;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		errnum = test_read(pfatfs);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
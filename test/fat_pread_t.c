@@ -0,0 +1,145 @@
+/*
+ * fat_pread_t.c
+ * functions: fat_mount, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_fseek, fat_ftell, fat_fread, fat_truncate,
+ *            fat_pread, fat_pwrite
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+#define TESTSIZE   50000
+
+static char image[TESTSIZE * 2];
+static fatoff_t image_size;
+
+/* write through fat_pwrite and keep a copy of what the file holds */
+static int
+check_pwrite(fatfile_t *pfatfile, fatoff_t offset, size_t nbytes)
+{
+	static char buf[TESTSIZE];
+	fatoff_t pos = fat_ftell(pfatfile);
+
+	for (size_t i = 0; i < nbytes; i++)
+		buf[i] = (char) ((offset + i) * 7 + nbytes);
+
+	if (fat_pwrite(pfatfile, buf, nbytes, offset) != nbytes ||
+		fat_ftell(pfatfile) != pos) {
+		fprintf(stderr, "fat_pwrite: offset=%" PRId64 " nbytes=%zu\n", offset,
+		        nbytes);
+		return -1;
+	}
+
+	/* the gap is zero */
+	if (offset > image_size)
+		memset(image + image_size, 0, offset - image_size);
+
+	memcpy(image + offset, buf, nbytes);
+	if (offset + (fatoff_t) nbytes > image_size)
+		image_size = offset + (fatoff_t) nbytes;
+
+	return 0;
+}
+
+static int
+check_pread(fatfile_t *pfatfile, fatoff_t offset, size_t nbytes)
+{
+	static char buf[TESTSIZE * 2];
+	size_t expected = 0;
+	fatoff_t pos = fat_ftell(pfatfile);
+
+	if (offset < image_size)
+		expected = (offset + (fatoff_t) nbytes > image_size) ?
+			(size_t) (image_size - offset) : nbytes;
+
+	if (fat_pread(pfatfile, buf, nbytes, offset) != expected ||
+		fat_ftell(pfatfile) != pos || memcmp(buf, image + offset, expected)) {
+		fprintf(stderr, "fat_pread: offset=%" PRId64 " nbytes=%zu\n", offset,
+		        nbytes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+test_pread(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	fatfile_t *pfatfile;
+	int ret = -1;
+
+	if (fat_truncate(pfatfs, filepath, 0)) {
+		fprintf(stderr, "fat_truncate: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r+");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	/* empty file, past the end, inside, across the end */
+	image_size = 0;
+	if (check_pwrite(pfatfile, 3000, 20000) ||
+		check_pwrite(pfatfile, 30000, TESTSIZE) ||
+		check_pwrite(pfatfile, 1, 10) ||
+		check_pwrite(pfatfile, 10000, 12345) ||
+		check_pwrite(pfatfile, 70000, 15000))
+		goto out;
+
+	if (fat_fseek(pfatfile, 77, FAT_SEEK_SET) ||
+		check_pread(pfatfile, 0, sizeof(image)) ||
+		check_pread(pfatfile, 1, 1) ||
+		check_pread(pfatfile, 4095, 8193) ||
+		check_pread(pfatfile, 84000, 5000) ||
+		check_pread(pfatfile, 85000, 10))
+		goto out;
+
+	/* what fat_fread sees after a reopen */
+	fat_fclose(pfatfile);
+	pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (!pfatfile || check_pread(pfatfile, 0, sizeof(image)))
+		goto out;
+
+	fprintf(stderr, "%ls: filesize=%" PRId64 "\n", filepath, image_size);
+	ret = 0;
+out:
+	fat_fclose(pfatfile);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount(&pfatfs, argv[i], 0);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		if ((errnum = test_pread(pfatfs, FIRSTFILE)) == 0) {
+			errnum = test_pread(pfatfs, SECONDFILE);
+		}
+
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
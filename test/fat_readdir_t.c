@@ -1,12 +1,31 @@
 /*
  * fat_readdir_t.c
- * functions: fat_mount, fat_umount, fat_getlabel, fat_opendir, fat_closedir,
- *            fat_error, fat_readdir
+ * functions: fat_mount, fat_mount_opt, fat_umount, fat_getlabel,
+ *            fat_opendir, fat_closedir, fat_error, fat_readdir
  */
 
 #include "fat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#define LONGNAME   L"Second_File_Using_Long_Name.txt"
+#define SHORTNAME  L"SECOND~1.TXT"
+#define NEXTNAME   L"FILE001.TXT"
+
+/* long name slots of LONGNAME, stored last one first */
+#define NSLOTS     3
+#define SLOTSIZE   32
+
+/* damage to the slots, readdir falls back to the 8.3 name */
+enum {
+	LFN_ORPHAN,   /* the slot starting the name is deleted */
+	LFN_GAP,      /* a slot in the middle is deleted */
+	LFN_CHKSUM,   /* a whole chain, for another short entry */
+	LFN_ORDER,    /* ordinals out of order */
+	LFN_NCASES
+};
 
 static int
 test_readdir(fatfs_t *pfatfs)
@@ -29,6 +48,106 @@ test_readdir(fatfs_t *pfatfs)
 	return 0;
 }
 
+static void
+corrupt_slots(uint8_t slots[NSLOTS][SLOTSIZE], int how)
+{
+	switch (how) {
+	case LFN_ORPHAN:
+		slots[0][0] = 0xe5;
+		break;
+	case LFN_GAP:
+		slots[1][0] = 0xe5;
+		break;
+	case LFN_CHKSUM:
+		for (int i = 0; i < NSLOTS; i++)
+			slots[i][13]++;
+		break;
+	case LFN_ORDER:
+		slots[1][0] = 1;
+		slots[2][0] = 2;
+		break;
+	}
+}
+
+/* volume offset of the short entry of name in the root, -1 if absent */
+static fatoff_t
+find_privoff(const char *filename, const wchar_t *name)
+{
+	struct fatmntopt opt = { 0 };
+	struct fatdirent *dp;
+	fatdir_t *pfatdir;
+	fatfs_t *pfatfs;
+	fatoff_t privoff = -1;
+
+	opt.flags = FAT_MOUNT_RDONLY;
+	if (fat_mount_opt(&pfatfs, filename, 0, &opt))
+		return -1;
+
+	pfatdir = fat_opendir(pfatfs, L"/");
+	while (pfatdir && (dp = fat_readdir(pfatdir))) {
+		if (!wcscmp(dp->d_name, name)) {
+			privoff = dp->d_privoff;
+			break;
+		}
+	}
+
+	fat_closedir(pfatdir);
+	fat_umount(pfatfs);
+	return privoff;
+}
+
+static int
+write_slots(FILE *fp, fatoff_t privoff, uint8_t slots[NSLOTS][SLOTSIZE])
+{
+	if (fseeko(fp, privoff - NSLOTS * SLOTSIZE, SEEK_SET) ||
+		(fwrite(slots, SLOTSIZE, NSLOTS, fp) != NSLOTS) || fflush(fp))
+		return -1;
+
+	return 0;
+}
+
+/* broken long names are dropped, the entries after them are not */
+static int
+test_badlfn(const char *filename)
+{
+	uint8_t saved[NSLOTS][SLOTSIZE], slots[NSLOTS][SLOTSIZE];
+	fatoff_t privoff = find_privoff(filename, LONGNAME);
+	FILE *fp;
+	int error = 0;
+
+	if (privoff < NSLOTS * SLOTSIZE)
+		return -1;
+
+	fp = fopen(filename, "r+b");
+	if (!fp || fseeko(fp, privoff - NSLOTS * SLOTSIZE, SEEK_SET) ||
+		(fread(saved, SLOTSIZE, NSLOTS, fp) != NSLOTS)) {
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+
+	for (int how = 0; (how < LFN_NCASES) && !error; how++) {
+		memcpy(slots, saved, sizeof(slots));
+		corrupt_slots(slots, how);
+
+		error = write_slots(fp, privoff, slots) ||
+			(find_privoff(filename, SHORTNAME) != privoff) ||
+			(find_privoff(filename, LONGNAME) != -1) ||
+			(find_privoff(filename, NEXTNAME) == -1);
+
+		fprintf(stderr, "fat_readdir: %s: damaged long name %d: %s\n",
+		        filename, how, (error) ? "not dropped" : "8.3 name");
+	}
+
+	/* the image is left as found */
+	if (write_slots(fp, privoff, saved) ||
+		(find_privoff(filename, LONGNAME) != privoff))
+		error = -1;
+
+	fclose(fp);
+	return error;
+}
+
 int main(int argc, char *argv[])
 {
 	int errnum;
@@ -48,6 +167,9 @@ int main(int argc, char *argv[])
 		errnum = test_readdir(pfatfs);
 		fat_umount(pfatfs);
 
+		if (!errnum)
+			errnum = test_badlfn(argv[i]);
+
 		if (errnum)
 			return EXIT_FAILURE;
 	}
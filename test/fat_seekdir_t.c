@@ -1,12 +1,22 @@
 /*
  * fat_seekdir_t.c
  * functions: fat_mount, fat_umount, fat_getlabel, fat_opendir, fat_closedir,
- *            fat_error, fat_readdir, fat_telldir, fat_seekdir, fat_rewinddir
+ *            fat_error, fat_readdir, fat_telldir, fat_seekdir, fat_rewinddir,
+ *            fat_fopen, fat_fclose, fat_fwrite, fat_truncate, fat_fallocate
  */
 
 #include "fat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+
+/* the image root holds FILE001.TXT to FILE100.TXT: more than a cluster on
+   fat32, more than a buffered chunk of the fat16 root region */
+#define MINENTRIES 100
+#define MAXENTRIES 512
 
 static int
 test_seekdir(fatfs_t *pfatfs)
@@ -79,6 +89,134 @@ test_seekdir(fatfs_t *pfatfs)
 	return 0;
 }
 
+static int
+same_entry(const struct fatdirent *pa, const struct fatdirent *pb)
+{
+	return pa && pb && (pa->d_size == pb->d_size) &&
+		(pa->d_cluster == pb->d_cluster) && !wcscmp(pa->d_name, pb->d_name);
+}
+
+/* seeks and rewinds across the clusters of the root list it again */
+static int
+test_replay(fatfs_t *pfatfs)
+{
+	struct fatdirent *entries, *dp;
+	fatdir_t *pfatdir;
+	long count = 0;
+	int error = -1;
+
+	entries = calloc(MAXENTRIES, sizeof(*entries));
+	pfatdir = fat_opendir(pfatfs, L"/");
+	if (!entries || !pfatdir)
+		goto out;
+
+	while ((count < MAXENTRIES) && (dp = fat_readdir(pfatdir)))
+		memcpy(&entries[count++], dp, sizeof(*dp));
+
+	fprintf(stderr, "fat_readdir: rootdir: %ld entries\n", count);
+	if (count < MINENTRIES)
+		goto out;
+
+	/* backward, each seek starts over from the first cluster */
+	for (long i = count - 1; i >= 0; i--) {
+		fat_seekdir(pfatdir, i);
+		dp = fat_readdir(pfatdir);
+		if (!same_entry(dp, &entries[i]) || (fat_telldir(pfatdir) != i + 1)) {
+			fprintf(stderr, "fat_seekdir(pfatdir, %ld): %ls\n", i,
+			        (dp) ? dp->d_name : L"NULL");
+			goto out;
+		}
+	}
+
+	/* a rewind from the last cluster gives the same listing */
+	while (fat_readdir(pfatdir));
+	fat_rewinddir(pfatdir);
+	for (long i = 0; i < count; i++) {
+		dp = fat_readdir(pfatdir);
+		if (!same_entry(dp, &entries[i])) {
+			fprintf(stderr, "fat_rewinddir: entry %ld: %ls\n", i,
+			        (dp) ? dp->d_name : L"NULL");
+			goto out;
+		}
+	}
+
+	if (fat_readdir(pfatdir))
+		goto out;
+
+	error = 0;
+out:
+	fat_closedir(pfatdir);
+	free(entries);
+	return error;
+}
+
+/* rewind and look name up again */
+static struct fatdirent *
+rewind_find(fatdir_t *pfatdir, const wchar_t *name)
+{
+	struct fatdirent *dp;
+
+	fat_rewinddir(pfatdir);
+	while ((dp = fat_readdir(pfatdir)) && wcscmp(dp->d_name, name));
+	return dp;
+}
+
+/* an open handle sees the size and first cluster updates of the entry */
+static int
+test_dirgen(fatfs_t *pfatfs)
+{
+	char buf[10] = { 0 };
+	fatdir_t *pfatdir = fat_opendir(pfatfs, L"/");
+	fatfile_t *pfatfile = NULL;
+	struct fatdirent *dp;
+	fatoff_t size;
+	int error = -1;
+
+	dp = rewind_find(pfatdir, FIRSTFILE + 1);
+	if (!dp)
+		goto out;
+
+	/* new size */
+	size = dp->d_size;
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "a");
+	if (!pfatfile || (fat_fwrite(buf, 1, sizeof(buf), pfatfile) != sizeof(buf)))
+		goto out;
+
+	fat_fclose(pfatfile);
+	pfatfile = NULL;
+	dp = rewind_find(pfatdir, FIRSTFILE + 1);
+	if (!dp || (dp->d_size != size + (fatoff_t) sizeof(buf)))
+		goto out;
+
+	/* first cluster dropped */
+	if (fat_truncate(pfatfs, FIRSTFILE, 0))
+		goto out;
+
+	dp = rewind_find(pfatdir, FIRSTFILE + 1);
+	if (!dp || dp->d_size || dp->d_cluster)
+		goto out;
+
+	/* and set again, the size stays 0 */
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r+");
+	if (!pfatfile || fat_fallocate(pfatfile, 0, 1, FAT_FALLOC_KEEP_SIZE))
+		goto out;
+
+	fat_fclose(pfatfile);
+	pfatfile = NULL;
+	dp = rewind_find(pfatdir, FIRSTFILE + 1);
+	if (!dp || dp->d_size || !dp->d_cluster)
+		goto out;
+
+	error = 0;
+out:
+	if (error)
+		fprintf(stderr, "fat_readdir: %ls: stale entry, error=%d\n",
+		        FIRSTFILE, fat_error(pfatfs));
+	fat_fclose(pfatfile);
+	fat_closedir(pfatdir);
+	return error;
+}
+
 int main(int argc, char *argv[])
 {
 	int errnum;
@@ -95,7 +233,8 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
 		        fat_getlabel(pfatfs));
 
-		errnum = test_seekdir(pfatfs);
+		errnum = test_seekdir(pfatfs) || test_replay(pfatfs) ||
+			test_dirgen(pfatfs);
 		fat_umount(pfatfs);
 
 		if (errnum)
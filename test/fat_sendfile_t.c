@@ -0,0 +1,150 @@
+/*
+ * fat_sendfile_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_fseek, fat_ftell, fat_fread, fat_fwrite,
+ *            fat_sendfile
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+#define TESTSIZE   100000
+
+/* grow the file past a few clusters */
+static int
+fill_file(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	static char buf[TESTSIZE];
+	fatfile_t *pfatfile = fat_fopen(pfatfs, filepath, "a");
+
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	for (int i = 0; i < TESTSIZE; i++)
+		buf[i] = (char) (i * 7 + (i >> 9));
+
+	if (fat_fwrite(buf, 1, sizeof(buf), pfatfile) != sizeof(buf)) {
+		fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	return 0;
+}
+
+static int
+test_sendfile(fatfs_t *pfatfs, const wchar_t *filepath)
+{
+	static char buf[TESTSIZE * 2], out[TESTSIZE * 2];
+	char tmpname[] = "/tmp/fat_sendfile_XXXXXX";
+	fatoff_t offset = 10, filesize;
+	fatfile_t *pfatfile;
+	size_t nread;
+	int fd, ret = -1;
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (!pfatfile) {
+		fprintf(stderr, "fat_fopen: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	nread = fat_fread(buf, 1, sizeof(buf), pfatfile);
+	filesize = fat_ftell(pfatfile);
+	fd = mkstemp(tmpname);
+	if ((fd < 0) || (nread != (size_t) filesize)) {
+		fprintf(stderr, "fat_fread: error=%d\n", fat_error(pfatfs));
+		goto out;
+	}
+
+	unlink(tmpname);
+
+	/* with an offset, the file pointer stays */
+	if (fat_fseek(pfatfile, 5, FAT_SEEK_SET) ||
+		fat_sendfile(fd, pfatfile, &offset, sizeof(buf)) != nread - 10 ||
+		offset != filesize || fat_ftell(pfatfile) != 5) {
+		fprintf(stderr, "fat_sendfile: error=%d\n", fat_error(pfatfs));
+		goto out;
+	}
+
+	/* without, it moves */
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_SET) ||
+		fat_sendfile(fd, pfatfile, NULL, 10) != 10 ||
+		fat_ftell(pfatfile) != 10 || fat_fseek(pfatfile, 0, FAT_SEEK_END) ||
+		fat_sendfile(fd, pfatfile, NULL, 100) != 0) {
+		fprintf(stderr, "fat_sendfile: error=%d\n", fat_error(pfatfs));
+		goto out;
+	}
+
+	if (pread(fd, out, sizeof(out), 0) != (ssize_t) nread ||
+		memcmp(out, buf + 10, nread - 10) || memcmp(out + nread - 10, buf, 10)) {
+		fprintf(stderr, "fat_sendfile: %ls: data mismatch\n", filepath);
+		goto out;
+	}
+
+	fprintf(stderr, "%ls: sent=%zu\n", filepath, nread);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	fat_fclose(pfatfile);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatmntopt opt;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount(&pfatfs, argv[i], 0);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = fill_file(pfatfs, FIRSTFILE);
+		if (!errnum)
+			errnum = test_sendfile(pfatfs, FIRSTFILE);
+		if (!errnum)
+			errnum = test_sendfile(pfatfs, SECONDFILE);
+
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* a mapped image has no descriptor, data goes through a buffer */
+		memset(&opt, 0, sizeof(opt));
+		opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_MMAP;
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		errnum = test_sendfile(pfatfs, FIRSTFILE);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
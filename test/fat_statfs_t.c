@@ -0,0 +1,194 @@
+/*
+ * fat_statfs_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_fopen,
+ *            fat_fwrite, fat_fclose, fat_truncate, fat_statfs,
+ *            fat_error
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+#define WRITESIZE  (64 * 1024)
+#define NHOLES     300
+
+/* usage as counted by a scan at mount, with the given kernel */
+static int
+fullscan_statfs_opt(const char *filename, uint32_t flags, uint32_t scan,
+                    struct fatstatfs *pstat)
+{
+	struct fatmntopt opt = { 0 };
+	fatfs_t *pfatfs;
+	int error;
+
+	opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_FULLSCAN | flags;
+	opt.scan = scan;
+	if (fat_mount_opt(&pfatfs, filename, 0, &opt))
+		return -1;
+
+	error = fat_statfs(pfatfs, pstat);
+	fat_umount(pfatfs);
+	return error;
+}
+
+static int
+fullscan_statfs(const char *filename, struct fatstatfs *pstat)
+{
+	return fullscan_statfs_opt(filename, 0, FAT_SCAN_AUTO, pstat);
+}
+
+/* two files grown a cluster at a time, then one dropped: a free cluster
+   every other one, across many vector blocks of the fat */
+static int
+make_holes(fatfs_t *pfatfs)
+{
+	struct fatstatfs stat;
+	fatfile_t *pfirst, *psecond;
+	char *buf;
+	int error = -1;
+
+	if (fat_statfs(pfatfs, &stat))
+		return -1;
+
+	buf = calloc(1, stat.f_bsize);
+	pfirst = fat_fopen(pfatfs, FIRSTFILE, "w");
+	psecond = fat_fopen(pfatfs, SECONDFILE, "a");
+	if (!buf || !pfirst || !psecond)
+		goto out;
+
+	for (int i = 0; i < NHOLES; i++) {
+		if ((fat_fwrite(buf, 1, stat.f_bsize, pfirst) != stat.f_bsize) ||
+			(fat_fwrite(buf, 1, stat.f_bsize, psecond) != stat.f_bsize)) {
+			fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+			goto out;
+		}
+	}
+
+	error = 0;
+out:
+	fat_fclose(psecond);
+	fat_fclose(pfirst);
+	free(buf);
+	return (error || fat_truncate(pfatfs, FIRSTFILE, 0)) ? -1 : 0;
+}
+
+/* the vector kernels agree with the scalar one, through the device and
+   through the in memory fat */
+static int
+test_kernels(const char *filename)
+{
+	static const uint32_t kernels[] = {
+		FAT_SCAN_SCALAR, FAT_SCAN_SSE2, FAT_SCAN_AVX2, FAT_SCAN_AUTO
+	};
+	static const uint32_t flags[] = { 0, FAT_MOUNT_FATTABLE };
+	struct fatstatfs ref, stat;
+
+	if (fullscan_statfs_opt(filename, 0, FAT_SCAN_SCALAR, &ref))
+		return -1;
+
+	fprintf(stderr, "fat_statfs: bfree=%u bnext=%u\n", ref.f_bfree,
+	        ref.f_bnext);
+
+	for (size_t i = 0; i < sizeof(flags) / sizeof(*flags); i++) {
+		for (size_t j = 0; j < sizeof(kernels) / sizeof(*kernels); j++) {
+			if (fullscan_statfs_opt(filename, flags[i], kernels[j], &stat) ||
+				memcmp(&stat, &ref, sizeof(ref))) {
+				fprintf(stderr, "fat_statfs: kernel=%u flags=%u bfree=%u "
+				        "bnext=%u\n", kernels[j], flags[i], stat.f_bfree,
+				        stat.f_bnext);
+				return -1;
+			}
+		}
+	}
+
+	/* unknown kernel */
+	if (fullscan_statfs_opt(filename, 0, FAT_SCAN_AVX2 + 1, &stat) != -1)
+		return -1;
+
+	return 0;
+}
+
+static int
+test_statfs(fatfs_t *pfatfs, const char *filename)
+{
+	struct fatstatfs lazy, full;
+	fatfile_t *pfatfile;
+	char *buf;
+
+	/* the lazy count agrees with the full scan */
+	if (fat_statfs(pfatfs, &lazy) || fullscan_statfs(filename, &full))
+		return -1;
+
+	fprintf(stderr, "fat_statfs: bsize=%u blocks=%u bfree=%u\n",
+	        lazy.f_bsize, lazy.f_blocks, lazy.f_bfree);
+
+	/* the first free cluster is only a hint until the fat was counted */
+	if ((lazy.f_bsize != full.f_bsize) || (lazy.f_blocks != full.f_blocks) ||
+		(lazy.f_bfree != full.f_bfree) || (lazy.f_bfree > lazy.f_blocks) ||
+		(lazy.f_bnext && (lazy.f_bnext < full.f_bnext)))
+		return -1;
+
+	/* allocation is accounted, the file had one cluster */
+	buf = calloc(1, WRITESIZE);
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "w");
+	if (!buf || !pfatfile ||
+		(fat_fwrite(buf, 1, WRITESIZE, pfatfile) != WRITESIZE)) {
+		fprintf(stderr, "fat_fwrite: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		free(buf);
+		return -1;
+	}
+
+	fat_fclose(pfatfile);
+	free(buf);
+
+	if (fat_statfs(pfatfs, &full) ||
+		(full.f_bfree != lazy.f_bfree + 1 - WRITESIZE / lazy.f_bsize))
+		return -1;
+
+	/* and so is the release */
+	if (fat_truncate(pfatfs, FIRSTFILE, 0) || fat_statfs(pfatfs, &full) ||
+		(full.f_bfree != lazy.f_bfree + 1))
+		return -1;
+
+	/* invalid argument */
+	if (!fat_statfs(pfatfs, NULL))
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatstatfs before, after;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount_opt(&pfatfs, argv[i], 0, NULL);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount_opt: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = test_statfs(pfatfs, argv[i]) || make_holes(pfatfs) ||
+			fat_statfs(pfatfs, &before);
+		fat_umount(pfatfs);
+
+		/* what was left on the device */
+		if (errnum || fullscan_statfs(argv[i], &after) ||
+			(after.f_bfree != before.f_bfree) ||
+			(before.f_bnext && (before.f_bnext < after.f_bnext)) ||
+			test_kernels(argv[i]))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
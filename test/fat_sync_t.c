@@ -0,0 +1,351 @@
+/*
+ * fat_sync_t.c
+ * functions: fat_mount, fat_mount_opt, fat_umount, fat_getlabel, fat_fopen,
+ *            fat_fclose, fat_error, fat_fseek, fat_ftell, fat_fwrite, fat_sync,
+ *            fat_fallocate
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+
+/* file size as seen by an independent read-only mount */
+static fatoff_t
+fat_get_filesize(const char *filename, const wchar_t *filepath)
+{
+	fatoff_t offset = -1;
+	fatfs_t *pfatfs = NULL;
+	fatfile_t *pfatfile;
+	struct fatmntopt opt = { 0 };
+
+	opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_NOCACHE;
+	if (fat_mount_opt(&pfatfs, filename, 0, &opt))
+		return -1;
+
+	pfatfile = fat_fopen(pfatfs, filepath, "r");
+	if (pfatfile && !fat_fseek(pfatfile, 0, FAT_SEEK_END))
+		offset = fat_ftell(pfatfile);
+
+	fat_fclose(pfatfile);
+	fat_umount(pfatfs);
+	return offset;
+}
+
+static int
+test_sync(fatfs_t *pfatfs, const char *filename)
+{
+	fatoff_t before, after;
+
+	fatfile_t *pfatfile = fat_fopen(pfatfs, FIRSTFILE, "a");
+	fprintf(stderr, "fat_fopen: %ls: error=%d\n", FIRSTFILE, fat_error(pfatfs));
+
+	if (!pfatfile)
+		return -1;
+
+	before = fat_get_filesize(filename, FIRSTFILE);
+	if (fat_fwrite("another line!\n", 1, 14, pfatfile) != 14) {
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	/* the new size reaches the device */
+	if (fat_sync(pfatfs)) {
+		fprintf(stderr, "fat_sync: error=%d\n", fat_error(pfatfs));
+		fat_fclose(pfatfile);
+		return -1;
+	}
+
+	after = fat_get_filesize(filename, FIRSTFILE);
+	fprintf(stderr, "fat_sync: filesize=%" PRId64 " -> %" PRId64 "\n",
+	        before, after);
+
+	fat_fclose(pfatfile);
+	return (after == before + 14) ? 0 : -1;
+}
+
+/* fat32 fsinfo free count and cluster size, read from the image */
+static int
+fat_get_fsinfo(const char *filename, uint32_t *pfree, uint32_t *pclussize)
+{
+	uint8_t boot[512], fsinfo[512];
+	uint16_t bps, fs_info, spf16;
+	FILE *fp = fopen(filename, "rb");
+	int ret = -1;
+
+	if (!fp)
+		return -1;
+
+	if (fread(boot, 1, sizeof(boot), fp) != sizeof(boot))
+		goto out;
+
+	memcpy(&bps, boot + 11, sizeof(bps));
+	memcpy(&spf16, boot + 22, sizeof(spf16));
+	memcpy(&fs_info, boot + 48, sizeof(fs_info));
+
+	/* fat12/16 have no fsinfo */
+	if (spf16 || !fs_info || (fs_info == 0xffff)) {
+		ret = 1;
+		goto out;
+	}
+
+	if (fseek(fp, (long) fs_info * bps, SEEK_SET) ||
+		fread(fsinfo, 1, sizeof(fsinfo), fp) != sizeof(fsinfo))
+		goto out;
+
+	memcpy(pfree, fsinfo + 488, sizeof(*pfree));
+	*pclussize = (uint32_t) bps * boot[13];
+	ret = 0;
+out:
+	fclose(fp);
+	return ret;
+}
+
+/* layout of the fats, read from the boot sector of the image */
+struct fatlayout {
+	long first;      /* offset of the first fat */
+	long size;       /* bytes per fat */
+	uint8_t num;
+	uint16_t extflags;
+};
+
+static int
+fat_get_layout(FILE *fp, struct fatlayout *playout)
+{
+	uint8_t boot[512];
+	uint16_t bps, reserved, spf16;
+	uint32_t spf32;
+
+	if (fseek(fp, 0, SEEK_SET) || (fread(boot, 1, sizeof(boot), fp) !=
+	                               sizeof(boot)))
+		return -1;
+
+	memcpy(&bps, boot + 11, sizeof(bps));
+	memcpy(&reserved, boot + 14, sizeof(reserved));
+	memcpy(&spf16, boot + 22, sizeof(spf16));
+	memcpy(&spf32, boot + 36, sizeof(spf32));
+
+	playout->first = (long) reserved * bps;
+	playout->size = (long) (spf16 ? spf16 : spf32) * bps;
+	playout->num = boot[16];
+	playout->extflags = 0;
+	if (!spf16)
+		memcpy(&playout->extflags, boot + 40, sizeof(playout->extflags));
+
+	return 0;
+}
+
+/* number of fats that differ from the first one, -1 on error */
+static int
+fat_cmp_copies(const char *filename)
+{
+	struct fatlayout layout;
+	uint8_t first[512], copy[512];
+	FILE *fp = fopen(filename, "rb");
+	int ndiff = -1;
+
+	if (!fp)
+		return -1;
+
+	if (fat_get_layout(fp, &layout))
+		goto out;
+
+	ndiff = 0;
+	for (uint8_t i = 1; i < layout.num; i++) {
+		for (long off = 0; off < layout.size; off += sizeof(first)) {
+			if (fseek(fp, layout.first + off, SEEK_SET) ||
+				(fread(first, 1, sizeof(first), fp) != sizeof(first)) ||
+				fseek(fp, layout.first + (i * layout.size) + off, SEEK_SET) ||
+				(fread(copy, 1, sizeof(copy), fp) != sizeof(copy))) {
+				ndiff = -1;
+				goto out;
+			}
+
+			if (memcmp(first, copy, sizeof(first))) {
+				ndiff++;
+				break;
+			}
+		}
+	}
+out:
+	fclose(fp);
+	return ndiff;
+}
+
+/* set the fat32 extended flags, copy the fat 'from' over the others */
+static int
+fat_set_mirroring(const char *filename, uint16_t extflags, uint8_t from)
+{
+	struct fatlayout layout;
+	uint8_t buf[512];
+	FILE *fp = fopen(filename, "r+b");
+	int ret = -1;
+
+	if (!fp)
+		return -1;
+
+	if (fat_get_layout(fp, &layout) || fseek(fp, 40, SEEK_SET) ||
+		(fwrite(&extflags, 1, sizeof(extflags), fp) != sizeof(extflags)))
+		goto out;
+
+	for (long off = 0; off < layout.size; off += sizeof(buf)) {
+		if (fseek(fp, layout.first + (from * layout.size) + off, SEEK_SET) ||
+			(fread(buf, 1, sizeof(buf), fp) != sizeof(buf)))
+			goto out;
+
+		for (uint8_t i = 0; i < layout.num; i++) {
+			if ((i != from) &&
+				(fseek(fp, layout.first + (i * layout.size) + off, SEEK_SET) ||
+				 (fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf))))
+				goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	fclose(fp);
+	return ret;
+}
+
+/* grow a file by ten clusters through a fresh mount */
+static int
+fat_grow_file(const char *filename, uint32_t clussize)
+{
+	fatfs_t *pfatfs = NULL;
+	fatfile_t *pfatfile;
+	fatoff_t size;
+	int ret = -1;
+
+	if (fat_mount(&pfatfs, filename, 0))
+		return -1;
+
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r+");
+	if (pfatfile && !fat_fseek(pfatfile, 0, FAT_SEEK_END)) {
+		size = fat_ftell(pfatfile);
+		size = ((size + clussize - 1) / clussize) * clussize;
+		ret = fat_fallocate(pfatfile, 0, size + 10 * (fatoff_t) clussize, 0);
+	}
+
+	fat_fclose(pfatfile);
+	fat_umount(pfatfs);
+	return ret;
+}
+
+/* the mirrors are written at sync; a fat32 volume without mirroring only
+   has its active fat updated */
+static int
+test_mirror(const char *filename)
+{
+	struct fatlayout layout;
+	uint32_t nfree, clussize;
+	FILE *fp;
+	int ret;
+
+	if (fat_cmp_copies(filename) != 0)
+		return -1;
+
+	fprintf(stderr, "fat mirrors: equal\n");
+	ret = fat_get_fsinfo(filename, &nfree, &clussize);
+	if (ret)
+		return (ret > 0) ? 0 : -1;
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return -1;
+	ret = fat_get_layout(fp, &layout);
+	fclose(fp);
+	if (ret || (layout.num < 2))
+		return ret;
+
+	/* the second fat is active */
+	if (fat_set_mirroring(filename, 0x81, 0) || fat_grow_file(filename, clussize))
+		return -1;
+
+	ret = fat_cmp_copies(filename);
+	fprintf(stderr, "fat mirrors: no mirroring, %d copies differ\n", ret);
+	if (ret != 1)
+		return -1;
+
+	/* back to a mirrored volume */
+	if (fat_set_mirroring(filename, layout.extflags, 1) ||
+		fat_cmp_copies(filename))
+		return -1;
+
+	return 0;
+}
+
+/* clusters allocated through the volume reach the fsinfo free count */
+static int
+test_fsinfo(const char *filename, uint32_t flags)
+{
+	struct fatmntopt opt = { 0 };
+	uint32_t before, after, clussize;
+	fatfs_t *pfatfs = NULL;
+	fatfile_t *pfatfile;
+	fatoff_t size;
+	int ret;
+
+	ret = fat_get_fsinfo(filename, &before, &clussize);
+	if (ret)
+		return (ret > 0) ? 0 : -1;
+
+	opt.flags = flags;
+	if (fat_mount_opt(&pfatfs, filename, 0, &opt))
+		return -1;
+
+	ret = -1;
+	pfatfile = fat_fopen(pfatfs, FIRSTFILE, "r+");
+	if (!pfatfile || fat_fseek(pfatfile, 0, FAT_SEEK_END))
+		goto out;
+
+	/* grow the file by ten clusters past its last one */
+	size = fat_ftell(pfatfile);
+	size = ((size + clussize - 1) / clussize) * clussize;
+	if (fat_fallocate(pfatfile, 0, size + 10 * (fatoff_t) clussize, 0) ||
+		fat_sync(pfatfs) || fat_get_fsinfo(filename, &after, &clussize))
+		goto out;
+
+	fprintf(stderr, "fsinfo: flags=%#x free=%" PRIu32 " -> %" PRIu32 "\n",
+	        flags, before, after);
+	ret = (after + 10 == before) ? 0 : -1;
+out:
+	fat_fclose(pfatfile);
+	fat_umount(pfatfs);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		errnum = fat_mount(&pfatfs, argv[i], 0);
+
+		if (errnum) {
+			fprintf(stderr, "fat_mount: %s: error=%d\n", argv[i], errnum);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(stderr, "fat_mount: %s: disk label: %ls\n", argv[i],
+		        fat_getlabel(pfatfs));
+
+		errnum = test_sync(pfatfs, argv[i]);
+		fat_umount(pfatfs);
+
+		if (errnum)
+			return EXIT_FAILURE;
+
+		/* trusted at mount, then recounted */
+		if (test_fsinfo(argv[i], 0) ||
+			test_fsinfo(argv[i], FAT_MOUNT_FULLSCAN) ||
+			test_mirror(argv[i]))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
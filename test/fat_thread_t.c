@@ -0,0 +1,179 @@
+/*
+ * fat_thread_t.c
+ * functions: fat_mount_opt, fat_umount, fat_getlabel, fat_fopen, fat_fclose,
+ *            fat_error, fat_truncate, fat_pread, fat_pwrite, fat_fseek
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FIRSTFILE  L"/FIRST.txt"
+#define SECONDFILE L"Second_File_Using_Long_Name.txt"
+
+#define NTHREADS   8
+#define CHUNKSIZE  3000
+#define NCHUNKS    40
+
+struct worker {
+	fatfs_t *pfatfs;
+	const wchar_t *filepath;
+	char seed;
+	int result;
+};
+
+static void
+fill_chunk(char *buf, int chunk, char seed)
+{
+	for (int i = 0; i < CHUNKSIZE; i++)
+		buf[i] = (char) (chunk * 31 + i + seed);
+}
+
+/* both files grow at the same time, the allocator is shared */
+static void *
+writer(void *arg)
+{
+	struct worker *pworker = arg;
+	char buf[CHUNKSIZE];
+	fatfile_t *pfatfile = fat_fopen(pworker->pfatfs, pworker->filepath, "r+");
+
+	pworker->result = -1;
+	if (!pfatfile)
+		return NULL;
+
+	for (int chunk = 0; chunk < NCHUNKS; chunk++) {
+		fill_chunk(buf, chunk, pworker->seed);
+		if (fat_pwrite(pfatfile, buf, CHUNKSIZE,
+		               (fatoff_t) chunk * CHUNKSIZE) != CHUNKSIZE) {
+			fprintf(stderr, "fat_pwrite: chunk=%d error=%d\n", chunk,
+			        fat_error(pworker->pfatfs));
+			goto out;
+		}
+	}
+
+	pworker->result = 0;
+out:
+	fat_fclose(pfatfile);
+	return NULL;
+}
+
+/* readers of one file each open their own handle and read every chunk */
+static void *
+reader(void *arg)
+{
+	struct worker *pworker = arg;
+	char buf[CHUNKSIZE], expected[CHUNKSIZE];
+	fatfile_t *pfatfile = fat_fopen(pworker->pfatfs, pworker->filepath, "r");
+
+	pworker->result = -1;
+	if (!pfatfile)
+		return NULL;
+
+	for (int chunk = NCHUNKS - 1; chunk >= 0; chunk--) {
+		fill_chunk(expected, chunk, pworker->seed);
+		if (fat_pread(pfatfile, buf, CHUNKSIZE,
+		              (fatoff_t) chunk * CHUNKSIZE) != CHUNKSIZE ||
+			memcmp(buf, expected, CHUNKSIZE)) {
+			fprintf(stderr, "fat_pread: chunk=%d error=%d\n", chunk,
+			        fat_error(pworker->pfatfs));
+			goto out;
+		}
+	}
+
+	/* a failing call of this thread is not seen by the others */
+	if ((fat_fseek(pfatfile, -1, FAT_SEEK_SET) == 0) ||
+		(fat_error(pworker->pfatfs) != FAT_ERR_INVAL))
+		goto out;
+
+	pworker->result = 0;
+out:
+	fat_fclose(pfatfile);
+	return NULL;
+}
+
+static int
+run_workers(fatfs_t *pfatfs, void *(*routine)(void *), int nthreads)
+{
+	pthread_t threads[NTHREADS];
+	struct worker workers[NTHREADS];
+	int ret = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].pfatfs = pfatfs;
+		workers[i].filepath = (i % 2) ? SECONDFILE : FIRSTFILE;
+		workers[i].seed = (char) (i % 2);
+		workers[i].result = -1;
+		if (pthread_create(&threads[i], NULL, routine, &workers[i]))
+			return -1;
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		if (workers[i].result)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int
+test_thread(fatfs_t *pfatfs)
+{
+	if (fat_truncate(pfatfs, FIRSTFILE, 0) ||
+		fat_truncate(pfatfs, SECONDFILE, 0)) {
+		fprintf(stderr, "fat_truncate: error=%d\n", fat_error(pfatfs));
+		return -1;
+	}
+
+	if (run_workers(pfatfs, writer, 2)) {
+		fprintf(stderr, "writers failed\n");
+		return -1;
+	}
+
+	if (run_workers(pfatfs, reader, NTHREADS)) {
+		fprintf(stderr, "readers failed\n");
+		return -1;
+	}
+
+	/* the error state of the main thread is untouched */
+	if (fat_error(pfatfs) != FAT_ERR_SUCCESS)
+		return -1;
+
+	fprintf(stderr, "threads: %d readers, 2 writers\n", NTHREADS);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int errnum;
+	fatfs_t *pfatfs = NULL;
+	struct fatmntopt opt;
+
+	for (int i = 1; i < argc; i++) {
+		/* page cache, then direct I/O where writers share blocks */
+		for (int j = 0; j < 2; j++) {
+			memset(&opt, 0, sizeof(opt));
+			opt.flags = j ? FAT_MOUNT_DIRECT : 0;
+			errnum = fat_mount_opt(&pfatfs, argv[i], 0, &opt);
+
+			if (errnum) {
+				fprintf(stderr, "fat_mount_opt: %s: error=%d\n", argv[i],
+				        errnum);
+				return EXIT_FAILURE;
+			}
+
+			fprintf(stderr, "fat_mount_opt: %s: disk label: %ls\n", argv[i],
+			        fat_getlabel(pfatfs));
+
+			errnum = test_thread(pfatfs);
+			fat_umount(pfatfs);
+
+			if (errnum)
+				return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
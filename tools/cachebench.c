@@ -0,0 +1,258 @@
+/*
+ * cachebench.c
+ * Copyright (C) 2020 p4n7hr0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "fat.h"
+#include <wchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <locale.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PROGRAM_NAME "cachebench"
+#define PROGRAM_VERSION "0.1"
+
+/* small reads are served by the sector cache */
+#define READ_SIZE 64
+
+struct worker {
+	fatfs_t *pfatfs;
+	const wchar_t *path;
+	unsigned long ops;
+	unsigned seed;
+	int error;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] --read pathname [disk]\n\n",
+	        PROGRAM_NAME);
+	fprintf(stderr, "'disk' is a device or regular file\n\n");
+
+	fprintf(stderr, "Standard options:\n");
+	fprintf(stderr, "-h, --help       display this help and exit\n");
+	fprintf(stderr, "--version        display version information and exit\n");
+	fprintf(stderr, "--offset offset  choose the start offset (default=0)\n\n");
+
+	fprintf(stderr, "Benchmark options:\n");
+	fprintf(stderr, "--read pathname  file read at random offsets\n");
+	fprintf(stderr, "--threads count  largest thread count (default=32)\n");
+	fprintf(stderr, "--ops count      reads per thread (default=200000)\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* every thread has its own handle, only the volume is shared */
+static void *
+cachebench_worker(void *arg)
+{
+	struct worker *pworker = arg;
+	unsigned char buf[READ_SIZE];
+	fatfile_t *pfatfile;
+	fatoff_t size;
+
+	pworker->error = -1;
+	pfatfile = fat_fopen(pworker->pfatfs, pworker->path, "r");
+	if (!pfatfile)
+		return NULL;
+
+	if (fat_fseek(pfatfile, 0, FAT_SEEK_END) ||
+		((size = fat_ftell(pfatfile)) < READ_SIZE))
+		goto out;
+
+	for (unsigned long i = 0; i < pworker->ops; i++) {
+		fatoff_t offset = (fatoff_t) rand_r(&pworker->seed) %
+			(size - READ_SIZE + 1);
+
+		if (fat_pread(pfatfile, buf, READ_SIZE, offset) != READ_SIZE)
+			goto out;
+	}
+
+	pworker->error = 0;
+out:
+	fat_fclose(pfatfile);
+	return NULL;
+}
+
+static int
+cachebench_run(fatfs_t *pfatfs, const wchar_t *path, int nthreads,
+               unsigned long ops)
+{
+	pthread_t *threads = calloc((size_t) nthreads, sizeof(*threads));
+	struct worker *workers = calloc((size_t) nthreads, sizeof(*workers));
+	struct fatcachestat before, after;
+	double start, elapsed;
+	int error = -1, started = 0;
+
+	if (!threads || !workers)
+		goto out;
+
+	fat_cachestat(pfatfs, &before);
+	start = now();
+	for (started = 0; started < nthreads; started++) {
+		workers[started].pfatfs = pfatfs;
+		workers[started].path = path;
+		workers[started].ops = ops;
+		workers[started].seed = (unsigned) started + 1;
+		if (pthread_create(&threads[started], NULL, cachebench_worker,
+		                   &workers[started]))
+			break;
+	}
+
+	error = (started == nthreads) ? 0 : -1;
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		if (workers[i].error)
+			error = -1;
+	}
+
+	elapsed = now() - start;
+	fat_cachestat(pfatfs, &after);
+	if (error) {
+		fprintf(stderr, "%s: %ls: read error, the file needs %d bytes\n",
+		        PROGRAM_NAME, path, READ_SIZE);
+		goto out;
+	}
+
+	fprintf(stdout, "%-9d %-12.0f %-10.1f %-12" PRIu64 " %" PRIu64 "\n",
+	        nthreads, (double) ops * nthreads / elapsed,
+	        (double) ops * nthreads * READ_SIZE / elapsed / 1e6,
+	        after.hits - before.hits, after.misses - before.misses);
+out:
+	free(threads);
+	free(workers);
+	return error;
+}
+
+static void
+cachebench(const wchar_t *path, const char *disk, fatoff_t offset,
+           int maxthreads, unsigned long ops)
+{
+	struct fatmntopt opt;
+	fatfs_t *pfatfs;
+	int error;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_NORA;
+
+	error = fat_mount_opt(&pfatfs, disk, offset, &opt);
+	if (error) {
+		fprintf(stderr, "%s: fat_mount: %s: error=%d\n",
+			PROGRAM_NAME, disk, error);
+		return;
+	}
+
+	fprintf(stdout, "%-9s %-12s %-10s %-12s %s\n", "[threads]", "[reads/s]",
+	        "[MB/s]", "[hits]", "[misses]");
+	for (int n = 1; n <= maxthreads; n <<= 1) {
+		if (cachebench_run(pfatfs, path, n, ops))
+			break;
+	}
+
+	fat_umount(pfatfs);
+}
+
+int main(int argc, char *argv[])
+{
+	fatoff_t offset = 0;
+	int ch = 0, maxthreads = 32;
+	unsigned long ops = 200000;
+	wchar_t *path = NULL;
+
+	enum {
+		OPTION_HELP = CHAR_MAX+1,
+		OPTION_VERSION,
+		OPTION_OFFSET,
+		OPTION_READ,
+		OPTION_THREADS,
+		OPTION_OPS
+	};
+
+	struct option longopts[] = {
+		{ "help"   , no_argument,       NULL, 'h'            },
+		{ "version", no_argument,       NULL, OPTION_VERSION },
+		{ "offset" , required_argument, NULL, OPTION_OFFSET  },
+		{ "read"   , required_argument, NULL, OPTION_READ    },
+		{ "threads", required_argument, NULL, OPTION_THREADS },
+		{ "ops"    , required_argument, NULL, OPTION_OPS     },
+		{ NULL     , 0                , NULL, 0              }
+	};
+
+	setlocale(LC_CTYPE, "");
+	while ((ch = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+		switch (ch) {
+			case 'h':
+				usage();
+				return EXIT_FAILURE;
+
+			case OPTION_VERSION:
+				fprintf(stderr, "%s: %s\n", PROGRAM_NAME, PROGRAM_VERSION);
+				return EXIT_FAILURE;
+
+			case OPTION_OFFSET:
+				offset = (fatoff_t) strtoul(optarg, NULL, 0);
+				break;
+
+			case OPTION_READ:
+				/* allocate memory for path */
+				path = calloc(1, (strlen(optarg) + 1) * sizeof(wchar_t));
+				if (!path) {
+					fprintf(stderr, "%s: calloc error", PROGRAM_NAME);
+					return EXIT_FAILURE;
+				}
+
+				/* convert path */
+				mbstowcs(path, optarg, strlen(optarg));
+				break;
+
+			case OPTION_THREADS:
+				maxthreads = (int) strtol(optarg, NULL, 0);
+				break;
+
+			case OPTION_OPS:
+				ops = strtoul(optarg, NULL, 0);
+				break;
+
+			default:
+				fprintf(stderr, "Try '%s -h' for more information.\n", PROGRAM_NAME);
+				return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (!argc || !path || (maxthreads < 1)) {
+		usage();
+		free(path);
+		return EXIT_FAILURE;
+	}
+
+	cachebench(path, *argv, offset, maxthreads, ops);
+	free(path);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+ * scanbench.c
+ * Copyright (C) 2020 p4n7hr0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "fat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+
+#define PROGRAM_NAME "scanbench"
+#define PROGRAM_VERSION "0.1"
+
+/* scalar first, the others are checked against it */
+static const struct {
+	const char *name;
+	uint32_t scan;
+} kernels[] = {
+	{ "scalar", FAT_SCAN_SCALAR },
+	{ "sse2"  , FAT_SCAN_SSE2   },
+	{ "avx2"  , FAT_SCAN_AVX2   }
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] [disk]\n\n", PROGRAM_NAME);
+	fprintf(stderr, "'disk' is a device or regular file\n\n");
+
+	fprintf(stderr, "Standard options:\n");
+	fprintf(stderr, "-h, --help       display this help and exit\n");
+	fprintf(stderr, "--version        display version information and exit\n");
+	fprintf(stderr, "--offset offset  choose the start offset (default=0)\n\n");
+
+	fprintf(stderr, "Benchmark options:\n");
+	fprintf(stderr, "--runs count     mounts per kernel (default=20)\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* a full scan mount, the image stays in the page cache between runs;
+   pstat gets what the kernel counted */
+static double
+scanbench_kernel(const char *disk, fatoff_t offset, uint32_t scan, int runs,
+                 struct fatstatfs *pstat)
+{
+	struct fatmntopt opt;
+	double best = -1.0;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.flags = FAT_MOUNT_RDONLY | FAT_MOUNT_FULLSCAN | FAT_MOUNT_NOCACHE;
+	opt.scan = scan;
+
+	for (int i = 0; i < runs; i++) {
+		fatfs_t *pfatfs;
+		double start = now(), elapsed;
+		int error = fat_mount_opt(&pfatfs, disk, offset, &opt);
+
+		elapsed = now() - start;
+		if (error) {
+			fprintf(stderr, "%s: fat_mount: %s: error=%d\n",
+				PROGRAM_NAME, disk, error);
+			return -1.0;
+		}
+
+		if (fat_statfs(pfatfs, pstat)) {
+			fprintf(stderr, "%s: fat_statfs: %s: error=%d\n",
+				PROGRAM_NAME, disk, fat_error(pfatfs));
+			fat_umount(pfatfs);
+			return -1.0;
+		}
+
+		fat_umount(pfatfs);
+
+		if ((best < 0) || (elapsed < best))
+			best = elapsed;
+	}
+
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	fatoff_t offset = 0;
+	int ch = 0, runs = 20;
+	double scalar = 0;
+	struct fatstatfs stat, ref;
+
+	enum {
+		OPTION_HELP = CHAR_MAX+1,
+		OPTION_VERSION,
+		OPTION_OFFSET,
+		OPTION_RUNS
+	};
+
+	struct option longopts[] = {
+		{ "help"   , no_argument,       NULL, 'h'            },
+		{ "version", no_argument,       NULL, OPTION_VERSION },
+		{ "offset" , required_argument, NULL, OPTION_OFFSET  },
+		{ "runs"   , required_argument, NULL, OPTION_RUNS    },
+		{ NULL     , 0                , NULL, 0              }
+	};
+
+	while ((ch = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+		switch (ch) {
+			case 'h':
+				usage();
+				return EXIT_FAILURE;
+
+			case OPTION_VERSION:
+				fprintf(stderr, "%s: %s\n", PROGRAM_NAME, PROGRAM_VERSION);
+				return EXIT_FAILURE;
+
+			case OPTION_OFFSET:
+				offset = (fatoff_t) strtoul(optarg, NULL, 0);
+				break;
+
+			case OPTION_RUNS:
+				runs = (int) strtol(optarg, NULL, 0);
+				break;
+
+			default:
+				fprintf(stderr, "Try '%s -h' for more information.\n", PROGRAM_NAME);
+				return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (!argc || (runs < 1)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	/* a kernel the cpu lacks falls back to the best one it has */
+	fprintf(stdout, "%-9s %-12s %-10s %-10s %s\n", "[kernel]", "[mount ms]",
+	        "[speedup]", "[free]", "[first free]");
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+		double best = scanbench_kernel(*argv, offset, kernels[i].scan, runs,
+		                               &stat);
+
+		if (best < 0)
+			return EXIT_FAILURE;
+		if (i == 0) {
+			scalar = best;
+			ref = stat;
+		}
+
+		fprintf(stdout, "%-9s %-12.3f %-10.2f %-10u %u\n", kernels[i].name,
+		        best * 1e3, scalar / best, stat.f_bfree, stat.f_bnext);
+
+		/* faster is no use if it counts differently */
+		if ((stat.f_bfree != ref.f_bfree) || (stat.f_bnext != ref.f_bnext)) {
+			fprintf(stderr, "%s: %s: disagrees with scalar\n", PROGRAM_NAME,
+			        kernels[i].name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}